@@ -0,0 +1,676 @@
+// rq-bench
+// Throughput and latency benchmark for librq.
+//
+// A producer and a consumer (each with their own rq_t) are run in the same
+// event loop.  The producer keeps a window of requests outstanding, spread
+// over a number of queues, and the consumer replies to each one with the same
+// payload.  At the end, the message rate, data rate and round-trip latency
+// percentiles are reported.
+//
+// The benchmark can either be run against a real RQ controller, or against a
+// small fake controller that is built into the benchmark (loopback mode).  The
+// fake controller does the bare minimum of routing requests and replies, so
+// that the cost of the client side (RISP parsing, buffer management) can be
+// measured on its own.
+//
+// Every reply is checked against the payload that was sent, and the benchmark
+// exits with an error if any of them dont match.  This is used to validate the
+// built-in protocol parser (RISP_INLINE=1) against librisp; see 'make
+// bench-compare'.
+
+#include <rq.h>
+#include <rq-proto.h>
+
+#include <arpa/inet.h>
+#include <assert.h>
+#include <errno.h>
+#include <event.h>
+#include <netinet/in.h>
+#include <rispbuf.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+
+#define BENCH_DEFAULT_PORT      13799
+#define BENCH_DEFAULT_COUNT     100000
+#define BENCH_DEFAULT_SIZE      128
+#define BENCH_DEFAULT_QUEUES    1
+#define BENCH_DEFAULT_WINDOW    100
+
+// message ids on the wire are limited to 16 bits.
+#define BENCH_MAX_IDS           0x8000
+
+
+typedef struct {
+	struct event_base *evbase;
+	struct __fake_t *fake;
+	rq_t producer;
+	rq_t consumer;
+
+	char **queues;
+	int queue_count;
+
+	char *payload;
+	int size;
+	int count;
+	int window;
+
+	int sent;
+	int replied;
+	int failed;
+	int mismatched;
+	int accepted;
+
+	uint64_t *latency;
+	uint64_t *sendtime;
+	uint64_t start, finish;
+	int started;
+} bench_t;
+
+
+static uint64_t bench_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return(((uint64_t) ts.tv_sec * 1000000000ULL) + ts.tv_nsec);
+}
+
+
+
+//-----------------------------------------------------------------------------
+// The fake controller.
+//
+// Each connected client gets a risp parser context, an input buffer and an
+// output buffer.  Consumers register queues with CONSUME, producers send
+// REQUEST which is passed to the consumer of that queue with a controller
+// assigned id, and the consumers REPLY is passed back to the producer with
+// the original id.
+
+typedef struct __fake_client_t {
+	struct __fake_t *fake;
+	evutil_socket_t handle;
+	struct event *read_event;
+	struct event *write_event;
+	expbuf_t *in, *out;
+
+	// data collected from the commands since the last CLEAR.
+	int id;
+	int qid;
+	char queue[256];
+	expbuf_t *payload;
+	int noreply;
+	int closing;
+} fake_client_t;
+
+typedef struct {
+	fake_client_t *consumer;
+	char name[256];
+} fake_queue_t;
+
+typedef struct {
+	fake_client_t *producer;
+	int src_id;
+	int active;
+} fake_route_t;
+
+typedef struct __fake_t {
+	struct event_base *evbase;
+	evutil_socket_t listener;
+	struct event *accept_event;
+	risp_t *risp;
+
+	fake_queue_t queues[256];
+	int queue_count;
+
+	fake_route_t routes[BENCH_MAX_IDS];
+	int next_route;
+} fake_t;
+
+
+static void fake_write_handler(int fd, short int flags, void *arg);
+
+static void fake_send(fake_client_t *client)
+{
+	assert(client);
+	if (BUF_LENGTH(client->out) > 0 && client->write_event == NULL) {
+		client->write_event = event_new(client->fake->evbase, client->handle, EV_WRITE | EV_PERSIST, fake_write_handler, client);
+		event_add(client->write_event, NULL);
+	}
+}
+
+static void fake_close(fake_client_t *client)
+{
+	int i;
+
+	assert(client);
+	if (client->read_event) { event_free(client->read_event); }
+	if (client->write_event) { event_free(client->write_event); }
+	close(client->handle);
+
+	for (i=0; i<client->fake->queue_count; i++) {
+		if (client->fake->queues[i].consumer == client) {
+			client->fake->queues[i].consumer = NULL;
+		}
+	}
+	for (i=0; i<BENCH_MAX_IDS; i++) {
+		if (client->fake->routes[i].producer == client) {
+			client->fake->routes[i].active = 0;
+		}
+	}
+
+	expbuf_free(client->in);
+	expbuf_free(client->out);
+	expbuf_free(client->payload);
+	free(client);
+}
+
+static void fake_write_handler(int fd, short int flags, void *arg)
+{
+	fake_client_t *client = arg;
+	int res;
+
+	assert(client);
+	res = send(fd, BUF_DATA(client->out), BUF_LENGTH(client->out), 0);
+	if (res > 0) {
+		expbuf_purge(client->out, res);
+	}
+	else if (res == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+		fake_close(client);
+		return;
+	}
+
+	if (BUF_LENGTH(client->out) == 0) {
+		event_free(client->write_event);
+		client->write_event = NULL;
+	}
+}
+
+static void fake_read_handler(int fd, short int flags, void *arg)
+{
+	fake_client_t *client = arg;
+	int res;
+
+	assert(client);
+	expbuf_shrink(client->in, 16384);
+	res = read(fd, BUF_DATA(client->in) + BUF_LENGTH(client->in), BUF_MAX(client->in) - BUF_LENGTH(client->in));
+	if (res > 0) {
+		BUF_LENGTH(client->in) += res;
+		res = risp_process(client->fake->risp, client, BUF_LENGTH(client->in), (unsigned char *) BUF_DATA(client->in));
+		assert(res >= 0);
+		if (res > 0) { expbuf_purge(client->in, res); }
+		if (client->closing) { fake_close(client); }
+	}
+	else if (res == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+		fake_close(client);
+	}
+}
+
+static void fake_accept_handler(int fd, short int flags, void *arg)
+{
+	fake_t *fake = arg;
+	fake_client_t *client;
+	evutil_socket_t handle;
+
+	handle = accept(fd, NULL, NULL);
+	if (handle >= 0) {
+		evutil_make_socket_nonblocking(handle);
+		client = calloc(1, sizeof(*client));
+		assert(client);
+		client->fake = fake;
+		client->handle = handle;
+		client->in = expbuf_init(NULL, 16384);
+		client->out = expbuf_init(NULL, 16384);
+		client->payload = expbuf_init(NULL, 0);
+		client->read_event = event_new(fake->evbase, handle, EV_READ | EV_PERSIST, fake_read_handler, client);
+		event_add(client->read_event, NULL);
+	}
+}
+
+
+static void fakeClear(void *ptr)
+{
+	fake_client_t *client = ptr;
+	client->id = -1;
+	client->qid = 0;
+	client->queue[0] = 0;
+	client->noreply = 0;
+	expbuf_clear(client->payload);
+}
+
+static void fakeNoreply(void *ptr)
+{
+	fake_client_t *client = ptr;
+	client->noreply = 1;
+}
+
+static void fakeNothing(void *ptr)
+{
+}
+
+static void fakeInt(void *ptr, risp_int_t value)
+{
+}
+
+static void fakeID(void *ptr, risp_int_t value)
+{
+	fake_client_t *client = ptr;
+	client->id = value;
+}
+
+static void fakeQueueID(void *ptr, risp_int_t value)
+{
+	fake_client_t *client = ptr;
+	client->qid = value;
+}
+
+static void fakeQueue(void *ptr, risp_length_t length, risp_data_t *data)
+{
+	fake_client_t *client = ptr;
+	assert(length < sizeof(client->queue));
+	memcpy(client->queue, data, length);
+	client->queue[length] = 0;
+}
+
+static void fakePayload(void *ptr, risp_length_t length, risp_data_t *data)
+{
+	fake_client_t *client = ptr;
+	expbuf_set(client->payload, data, length);
+}
+
+static void fakePing(void *ptr)
+{
+	fake_client_t *client = ptr;
+	addCmd(client->out, RQ_CMD_PONG);
+	fake_send(client);
+}
+
+// the client is going away.  We dont keep track of outstanding requests the
+// way a real controller would, so we just drop the connection once we have
+// finished processing what it sent.
+static void fakeClosing(void *ptr)
+{
+	fake_client_t *client = ptr;
+	client->closing = 1;
+}
+
+static void fakeConsume(void *ptr)
+{
+	fake_client_t *client = ptr;
+	fake_t *fake = client->fake;
+	int i;
+
+	for (i=0; i<fake->queue_count && strcmp(fake->queues[i].name, client->queue) != 0; i++);
+	if (i == fake->queue_count) {
+		assert(fake->queue_count < 255);
+		strcpy(fake->queues[i].name, client->queue);
+		fake->queue_count ++;
+	}
+	fake->queues[i].consumer = client;
+
+	addCmd(client->out, RQ_CMD_CLEAR);
+	addCmdInt(client->out, RQ_CMD_QUEUEID, i + 1);
+	addCmdShortStr(client->out, RQ_CMD_QUEUE, strlen(client->queue), client->queue);
+	addCmd(client->out, RQ_CMD_CONSUMING);
+	fake_send(client);
+}
+
+static void fakeRequest(void *ptr)
+{
+	fake_client_t *client = ptr;
+	fake_t *fake = client->fake;
+	fake_client_t *consumer;
+	int i, id;
+
+	for (i=0; i<fake->queue_count && strcmp(fake->queues[i].name, client->queue) != 0; i++);
+	consumer = i < fake->queue_count ? fake->queues[i].consumer : NULL;
+	if (consumer == NULL) {
+		addCmd(client->out, RQ_CMD_CLEAR);
+		addCmdLargeInt(client->out, RQ_CMD_ID, client->id);
+		addCmd(client->out, RQ_CMD_UNDELIVERED);
+		fake_send(client);
+		return;
+	}
+
+	id = fake->next_route;
+	while (fake->routes[id].active) { id = (id + 1) % BENCH_MAX_IDS; }
+	fake->next_route = (id + 1) % BENCH_MAX_IDS;
+	fake->routes[id].active = client->noreply ? 0 : 1;
+	fake->routes[id].producer = client;
+	fake->routes[id].src_id = client->id;
+
+	addCmd(consumer->out, RQ_CMD_CLEAR);
+	addCmdLargeInt(consumer->out, RQ_CMD_ID, id);
+	addCmdInt(consumer->out, RQ_CMD_QUEUEID, i + 1);
+	if (client->noreply) { addCmd(consumer->out, RQ_CMD_NOREPLY); }
+	addCmdLargeStr(consumer->out, RQ_CMD_PAYLOAD, BUF_LENGTH(client->payload), BUF_DATA(client->payload));
+	addCmd(consumer->out, RQ_CMD_REQUEST);
+	fake_send(consumer);
+
+	addCmd(client->out, RQ_CMD_CLEAR);
+	addCmdLargeInt(client->out, RQ_CMD_ID, client->id);
+	addCmd(client->out, RQ_CMD_DELIVERED);
+	fake_send(client);
+}
+
+static void fakeReply(void *ptr)
+{
+	fake_client_t *client = ptr;
+	fake_route_t *route;
+
+	assert(client->id >= 0 && client->id < BENCH_MAX_IDS);
+	route = &client->fake->routes[client->id];
+	if (route->active) {
+		route->active = 0;
+		addCmd(route->producer->out, RQ_CMD_CLEAR);
+		addCmdLargeInt(route->producer->out, RQ_CMD_ID, route->src_id);
+		if (BUF_LENGTH(client->payload) > 0) {
+			addCmdLargeStr(route->producer->out, RQ_CMD_PAYLOAD, BUF_LENGTH(client->payload), BUF_DATA(client->payload));
+		}
+		addCmd(route->producer->out, RQ_CMD_REPLY);
+		fake_send(route->producer);
+	}
+}
+
+
+static fake_t * fake_start(struct event_base *evbase, int port)
+{
+	fake_t *fake;
+	struct sockaddr_in sin;
+	int opt = 1;
+
+	fake = calloc(1, sizeof(*fake));
+	assert(fake);
+	fake->evbase = evbase;
+
+	fake->risp = risp_init(NULL);
+	risp_add_command(fake->risp, RQ_CMD_CLEAR,       &fakeClear);
+	risp_add_command(fake->risp, RQ_CMD_PING,        &fakePing);
+	risp_add_command(fake->risp, RQ_CMD_PONG,        &fakeNothing);
+	risp_add_command(fake->risp, RQ_CMD_CLOSING,     &fakeClosing);
+	risp_add_command(fake->risp, RQ_CMD_EXCLUSIVE,   &fakeNothing);
+	risp_add_command(fake->risp, RQ_CMD_CONSUME,     &fakeConsume);
+	risp_add_command(fake->risp, RQ_CMD_REQUEST,     &fakeRequest);
+	risp_add_command(fake->risp, RQ_CMD_REPLY,       &fakeReply);
+	risp_add_command(fake->risp, RQ_CMD_DELIVERED,   &fakeNothing);
+	risp_add_command(fake->risp, RQ_CMD_UNDELIVERED, &fakeNothing);
+	risp_add_command(fake->risp, RQ_CMD_NOREPLY,     &fakeNoreply);
+	risp_add_command(fake->risp, RQ_CMD_ID,          &fakeID);
+	risp_add_command(fake->risp, RQ_CMD_QUEUEID,     &fakeQueueID);
+	risp_add_command(fake->risp, RQ_CMD_MAX,         &fakeInt);
+	risp_add_command(fake->risp, RQ_CMD_PRIORITY,    &fakeInt);
+	risp_add_command(fake->risp, RQ_CMD_TIMEOUT,     &fakeInt);
+	risp_add_command(fake->risp, RQ_CMD_QUEUE,       &fakeQueue);
+	risp_add_command(fake->risp, RQ_CMD_PAYLOAD,     &fakePayload);
+
+	fake->listener = socket(AF_INET, SOCK_STREAM, 0);
+	assert(fake->listener >= 0);
+	setsockopt(fake->listener, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(port);
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(fake->listener, (struct sockaddr *) &sin, sizeof(sin)) != 0 || listen(fake->listener, 16) != 0) {
+		perror("rq-bench: unable to listen for the loopback controller");
+		exit(1);
+	}
+	evutil_make_socket_nonblocking(fake->listener);
+
+	fake->accept_event = event_new(evbase, fake->listener, EV_READ | EV_PERSIST, fake_accept_handler, fake);
+	event_add(fake->accept_event, NULL);
+
+	return(fake);
+}
+
+static void fake_stop(fake_t *fake)
+{
+	assert(fake);
+	event_free(fake->accept_event);
+	close(fake->listener);
+	fake->risp = risp_shutdown(fake->risp);
+	free(fake);
+}
+
+
+
+//-----------------------------------------------------------------------------
+// The producer and consumer.
+
+static void bench_send(bench_t *bench);
+
+//-----------------------------------------------------------------------------
+// Everything has been replied to, so shut down.  The event loop will exit once
+// the connections have been closed.
+static void bench_finish(bench_t *bench)
+{
+	bench->finish = bench_now();
+	rq_shutdown(&bench->producer);
+	rq_shutdown(&bench->consumer);
+	if (bench->fake) { event_del(bench->fake->accept_event); }
+}
+
+static void bench_reply(rq_message_t *msg)
+{
+	bench_t *bench = msg->arg;
+
+	assert(msg->id >= 0 && msg->id < BENCH_MAX_IDS);
+	bench->latency[bench->replied] = bench_now() - bench->sendtime[msg->id];
+	bench->replied ++;
+
+	assert(msg->data);
+	if (BUF_LENGTH(msg->data) != bench->size || memcmp(BUF_DATA(msg->data), bench->payload, bench->size) != 0) {
+		bench->mismatched ++;
+	}
+
+	if (bench->sent < bench->count) { bench_send(bench); }
+	else if (bench->replied + bench->failed == bench->count) { bench_finish(bench); }
+}
+
+static void bench_fail(rq_message_t *msg)
+{
+	bench_t *bench = msg->arg;
+
+	bench->failed ++;
+	if (bench->sent < bench->count) { bench_send(bench); }
+	else if (bench->replied + bench->failed == bench->count) { bench_finish(bench); }
+}
+
+static void bench_send(bench_t *bench)
+{
+	rq_message_t *msg;
+
+	assert(bench->sent < bench->count);
+
+	msg = rq_msg_new(&bench->producer, NULL);
+	assert(msg);
+	rq_msg_setqueue(msg, bench->queues[bench->sent % bench->queue_count]);
+	rq_msg_setdata(msg, bench->size, bench->payload);
+	assert(msg->id >= 0 && msg->id < BENCH_MAX_IDS);
+	bench->sendtime[msg->id] = bench_now();
+	bench->sent ++;
+	rq_send(msg, bench_reply, bench_fail, bench);
+}
+
+static void bench_handler(rq_message_t *msg, void *arg)
+{
+	assert(msg);
+	assert(msg->data);
+	rq_reply(msg, BUF_LENGTH(msg->data), BUF_DATA(msg->data));
+}
+
+static void bench_accepted(char *queue, queue_id_t qid, void *arg)
+{
+	bench_t *bench = arg;
+	int i;
+
+	bench->accepted ++;
+	if (bench->accepted == bench->queue_count && bench->started == 0) {
+		bench->started = 1;
+		bench->start = bench_now();
+		for (i=0; i<bench->window && bench->sent < bench->count; i++) {
+			bench_send(bench);
+		}
+	}
+}
+
+
+static int bench_compare(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a;
+	uint64_t y = *(const uint64_t *) b;
+	return(x < y ? -1 : (x > y ? 1 : 0));
+}
+
+static double bench_percentile(bench_t *bench, double p)
+{
+	int i;
+	if (bench->replied == 0) return(0);
+	i = (int) (p * (bench->replied - 1));
+	return(bench->latency[i] / 1000.0);
+}
+
+static void bench_report(bench_t *bench)
+{
+	double secs;
+
+	secs = (bench->finish - bench->start) / 1000000000.0;
+	qsort(bench->latency, bench->replied, sizeof(uint64_t), bench_compare);
+
+	printf("librq %s\n", LIBRQ_VERSION_NAME);
+	printf("payload %d bytes, %d queues, window %d\n", bench->size, bench->queue_count, bench->window);
+	printf("requests:   %d replied, %d failed in %.3f s\n", bench->replied, bench->failed, secs);
+	if (bench->mismatched > 0) {
+		printf("ERROR:      %d replies did not match the payload sent\n", bench->mismatched);
+	}
+	printf("throughput: %.0f msgs/sec, %.2f MB/sec\n",
+		bench->replied / secs,
+		((double) bench->replied * bench->size * 2) / secs / (1024*1024));
+	printf("latency:    p50 %.1f us, p99 %.1f us, p999 %.1f us\n",
+		bench_percentile(bench, 0.50),
+		bench_percentile(bench, 0.99),
+		bench_percentile(bench, 0.999));
+}
+
+
+static void usage(void)
+{
+	printf(
+		"Usage: rq-bench [options]\n"
+		"  -c <ip:port>  controller to connect to.\n"
+		"  -l <port>     run a loopback fake controller on this port (default %d).\n"
+		"  -n <count>    number of requests to send (default %d).\n"
+		"  -s <bytes>    payload size (default %d).\n"
+		"  -q <queues>   number of queues (default %d).\n"
+		"  -w <window>   requests in flight (default %d).\n"
+		"  -z            enable zero-copy delivery.\n"
+		"  -u            use the io_uring I/O backend.\n"
+		"  -h            show this help.\n",
+		BENCH_DEFAULT_PORT, BENCH_DEFAULT_COUNT, BENCH_DEFAULT_SIZE, BENCH_DEFAULT_QUEUES, BENCH_DEFAULT_WINDOW);
+}
+
+
+int main(int argc, char **argv)
+{
+	bench_t bench;
+	char *controller = NULL;
+	char loopback[32];
+	int port = BENCH_DEFAULT_PORT;
+	int zerocopy = 0;
+	int iobackend = RQ_IO_LIBEVENT;
+	int c, i;
+
+	memset(&bench, 0, sizeof(bench));
+	bench.count = BENCH_DEFAULT_COUNT;
+	bench.size = BENCH_DEFAULT_SIZE;
+	bench.queue_count = BENCH_DEFAULT_QUEUES;
+	bench.window = BENCH_DEFAULT_WINDOW;
+
+	while ((c = getopt(argc, argv, "c:l:n:s:q:w:zuh")) != -1) {
+		switch (c) {
+			case 'c': controller = optarg; break;
+			case 'l': port = atoi(optarg); break;
+			case 'n': bench.count = atoi(optarg); break;
+			case 's': bench.size = atoi(optarg); break;
+			case 'q': bench.queue_count = atoi(optarg); break;
+			case 'w': bench.window = atoi(optarg); break;
+			case 'z': zerocopy = 1; break;
+			case 'u': iobackend = RQ_IO_URING; break;
+			case 'h': usage(); return(0);
+			default: usage(); return(1);
+		}
+	}
+
+	if (bench.count <= 0 || bench.size <= 0 || bench.queue_count <= 0 || bench.queue_count > 255 || bench.window <= 0 || bench.window >= BENCH_MAX_IDS) {
+		fprintf(stderr, "rq-bench: invalid parameters.\n");
+		usage();
+		return(1);
+	}
+
+	bench.payload = malloc(bench.size);
+	bench.latency = calloc(bench.count, sizeof(uint64_t));
+	// message ids are re-used, so we keep the send times in a table that is
+	// indexed by the message id.
+	bench.sendtime = calloc(BENCH_MAX_IDS, sizeof(uint64_t));
+	assert(bench.payload && bench.latency && bench.sendtime);
+	// use every byte value, so that payload bytes that look like protocol
+	// commands get through the parser too.
+	for (i=0; i<bench.size; i++) { bench.payload[i] = (char) (i * 7); }
+
+	bench.queues = calloc(bench.queue_count, sizeof(char *));
+	assert(bench.queues);
+	for (i=0; i<bench.queue_count; i++) {
+		bench.queues[i] = malloc(32);
+		sprintf(bench.queues[i], "rq-bench-%d", i);
+	}
+
+	bench.evbase = event_base_new();
+	assert(bench.evbase);
+
+	if (controller == NULL) {
+		bench.fake = fake_start(bench.evbase, port);
+		sprintf(loopback, "127.0.0.1:%d", port);
+		controller = loopback;
+	}
+
+	rq_init(&bench.consumer);
+	rq_setevbase(&bench.consumer, bench.evbase);
+	rq_setzerocopy(&bench.consumer, zerocopy);
+	if (rq_setio(&bench.consumer, iobackend) != 0) {
+		fprintf(stderr, "rq-bench: I/O backend not available.\n");
+		return(1);
+	}
+	rq_addcontroller(&bench.consumer, controller, NULL, NULL, NULL);
+	for (i=0; i<bench.queue_count; i++) {
+		rq_consume(&bench.consumer, bench.queues[i], bench.window, RQ_PRIORITY_NORMAL, 0, bench_handler, bench_accepted, NULL, &bench);
+	}
+
+	rq_init(&bench.producer);
+	rq_setevbase(&bench.producer, bench.evbase);
+	rq_setzerocopy(&bench.producer, zerocopy);
+	if (rq_setio(&bench.producer, iobackend) != 0) {
+		fprintf(stderr, "rq-bench: I/O backend not available.\n");
+		return(1);
+	}
+	rq_addcontroller(&bench.producer, controller, NULL, NULL, NULL);
+
+	event_base_loop(bench.evbase, 0);
+
+	bench_report(&bench);
+
+	if (bench.fake) { fake_stop(bench.fake); }
+	rq_cleanup(&bench.producer);
+	rq_cleanup(&bench.consumer);
+	event_base_free(bench.evbase);
+
+	for (i=0; i<bench.queue_count; i++) { free(bench.queues[i]); }
+	free(bench.queues);
+	free(bench.payload);
+	free(bench.latency);
+	free(bench.sendtime);
+
+	return(bench.mismatched > 0 ? 1 : 0);
+}
@@ -9,6 +9,7 @@
 #include <errno.h>
 #include <event.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <pwd.h>
 #include <rispbuf.h>
 #include <signal.h>
@@ -17,10 +18,34 @@
 #include <string.h>
 #include <sys/resource.h>
 #include <sys/time.h>
+#include <time.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <netinet/tcp.h>
+#include <stddef.h>
+#include <sys/eventfd.h>
+#include <sched.h>
 #include <unistd.h>
 
+#ifndef LIBEVENT_OLD_VER
+#include <event2/dns.h>
+#endif
+
+#ifdef RQ_WITH_LZ4
+#include <lz4.h>
+#endif
+#ifdef RQ_WITH_ZSTD
+#include <zstd.h>
+#endif
+#ifdef RQ_WITH_URING
+#include <liburing.h>
+#endif
+#ifdef RQ_WITH_USDT
+#include <sys/sdt.h>
+#endif
 
-#if (LIBRQ_VERSION != 0x00010910)
+
+#if (LIBRQ_VERSION != 0x00010939)
 	#error "Incorrect rq.h header version."
 #endif
 
@@ -28,6 +53,40 @@
 	#error "Need rq-proto.h v1.0 or higher"
 #endif
 
+// commands used to agree on payload compression, for when rq-proto.h doesnt
+// have them yet.  COMPRESS is sent with the methods we support when we
+// connect, and the controller answers with the one it picked.  A frame with a
+// compressed payload has COMPRESSED (the method) and RAWSIZE.
+#ifndef RQ_CMD_COMPRESS
+	#define RQ_CMD_COMPRESS     65
+	#define RQ_CMD_COMPRESSED   66
+	#define RQ_CMD_RAWSIZE      129
+#endif
+
+// compression level used for zstd.
+#define RQ_ZSTD_LEVEL  3
+
+// the trace id of a traced request (or reply), for when rq-proto.h doesnt
+// have it yet.
+#ifndef RQ_CMD_TRACEID
+	#define RQ_CMD_TRACEID      130
+#endif
+
+// Trace points.  If built with USDT probes, each point is a 'librq' probe
+// with the message id, trace id and bytes as arguments.  If a trace handler
+// has been set, it is called as well.  When neither is used, all it costs is
+// the test of the handler.
+#ifdef RQ_WITH_USDT
+	#define RQ_PROBE(name, id, trace, bytes)  DTRACE_PROBE3(librq, name, id, trace, bytes)
+#else
+	#define RQ_PROBE(name, id, trace, bytes)
+#endif
+
+#define RQ_TRACE(rq, point, name, id, trace, bytes)  do { \
+		RQ_PROBE(name, (id), (trace), (bytes)); \
+		if ((rq)->trace_handler) { rq_trace((rq), (point), (id), (trace), (bytes)); } \
+	} while (0)
+
 
 // libevent compatability.   If libevent1.x is used, it doesnt have as much stuff as libevent2.0
 #ifdef LIBEVENT_OLD_VER  
@@ -35,7 +94,7 @@
 	// event_new is a 2.0 function that creates a new event, sets it and then returns the pointer to the new event structure.   1.4 does not have that function, so we wrap an event_set here instead.
 	struct event * event_new(struct event_base *evbase, evutil_socket_t sfd, short flags, void (*fn)(int, short, void *), void *arg) {
 		struct event *ev;
-		assert(evbase && sfd >= 0 && flags != 0 && fn);
+		assert(evbase && (sfd >= 0 || (flags & (EV_READ|EV_WRITE)) == 0) && fn);
 		ev = calloc(1, sizeof(*ev));
 		assert(ev);
 		event_set(ev, sfd, flags, fn, arg);
@@ -132,7 +191,196 @@
 static void rq_read_handler(int fd, short int flags, void *arg);
 static void rq_write_handler(int fd, short int flags, void *arg);
 static void rq_connect_handler(int fd, short int flags, void *arg);
+static void rq_data_settle(rq_t *rq, rq_data_t *data);
+static void rq_send_msg(rq_conn_t *conn, rq_message_t *msg);
+static void rq_pending_flush(rq_conn_t *conn);
+static void rq_pending_requeue(rq_t *rq);
+static void rq_pending_failall(rq_t *rq);
+static void rq_pending_add(rq_t *rq, rq_message_t *msg, int head);
+static void rq_pending_remove(rq_t *rq, rq_message_t *msg);
+static void rq_msg_fail(rq_message_t *msg);
+static void rq_msglist_release(rq_t *rq, msg_id_t id);
+static void rq_msglist_release_expired(rq_t *rq);
+static void rq_wheel_handler(int fd, short int flags, void *arg);
+static void rq_timer_add(rq_message_t *msg);
+static void rq_timer_remove(rq_message_t *msg);
+static void rq_reply_send(rq_message_t *msg, int length, char *data);
+static void rq_workers_stop(rq_t *rq);
+static void rq_conn_resolve(rq_conn_t *conn, int connect);
+static void rq_ack_flush(rq_conn_t *conn);
+static void rq_conn_sockopts(rq_conn_t *conn, int reading);
+static const rq_io_t rq_io_libevent;
+static uint32_t rq_trace_newid(rq_t *rq);
+static void rq_connect(rq_t *rq);
+static void rq_drain_wake(rq_t *rq);
+static void rq_budget_check(rq_t *rq);
+static int  rq_pool_over(rq_t *rq, int adding);
+static void rq_queue_cancel(rq_t *rq, rq_queue_t *queue);
+static void rq_template_encode(rq_template_t *tmpl);
+static void rq_encode_header(expbuf_t *buf, const char *queue, int qlen, queue_id_t qid, int timeout, char noreply);
+#ifdef RQ_RISP_INLINE
+static int rq_risp_process(rq_conn_t *conn, int length, const unsigned char *data);
+#endif
+
+
+
+//-----------------------------------------------------------------------------
+// Return the current monotonic time in microseconds.
+static uint64_t rq_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return(((uint64_t) ts.tv_sec * 1000000) + (ts.tv_nsec / 1000));
+}
+
+
+//-----------------------------------------------------------------------------
+// Let the trace handler know we have reached a trace point.
+static void rq_trace(rq_t *rq, int point, msg_id_t id, uint32_t trace_id, int bytes)
+{
+	rq_trace_t trace;
+
+	assert(rq);
+	assert(rq->trace_handler);
+
+	trace.point = point;
+	trace.id = id;
+	trace.trace_id = trace_id;
+	trace.when = rq_now();
+	trace.bytes = bytes;
+	rq->trace_handler(rq, &trace, rq->trace_arg);
+}
+
+
+//-----------------------------------------------------------------------------
+// Initialise the buffer pool.  The free-lists are allocated up-front to the
+// size of the high-water mark, so that returning a buffer to the pool never
+// needs an allocation.
+static void rq_bufpool_init(rq_bufpool_t *pool, int max)
+{
+	int i;
+
+	assert(pool);
+	assert(max >= 0);
+
+	pool->max = max;
+	pool->bytes = 0;
+	pool->hits = 0;
+	pool->misses = 0;
+	for (i=0; i<RQ_BUFPOOL_CLASSES; i++) {
+		pool->count[i] = 0;
+		if (max > 0) {
+			pool->free[i] = (expbuf_t **) malloc(sizeof(expbuf_t *) * max);
+			assert(pool->free[i]);
+		}
+		else {
+			pool->free[i] = NULL;
+		}
+	}
+}
+
+static void rq_bufpool_free(rq_bufpool_t *pool)
+{
+	int i;
+
+	assert(pool);
+
+	for (i=0; i<RQ_BUFPOOL_CLASSES; i++) {
+		while (pool->count[i] > 0) {
+			pool->count[i] --;
+			pool->free[i][pool->count[i]] = expbuf_free(pool->free[i][pool->count[i]]);
+			assert(pool->free[i][pool->count[i]] == NULL);
+		}
+		if (pool->free[i]) {
+			free(pool->free[i]);
+			pool->free[i] = NULL;
+		}
+	}
+	pool->max = 0;
+	pool->bytes = 0;
+}
+
+//-----------------------------------------------------------------------------
+// Get a buffer that can hold at least 'size' bytes.  If there is one in the
+// pool we use that, otherwise we create one the size of the class so that it
+// can be returned to the pool later.
+static expbuf_t * rq_buf_get(rq_t *rq, int size)
+{
+	rq_bufpool_t *pool;
+	expbuf_t *buf;
+	int i, classsize;
+
+	assert(rq);
+	assert(size >= 0);
+	pool = &rq->bufpool;
+
+	classsize = RQ_BUFPOOL_MINSIZE;
+	for (i=0; i<RQ_BUFPOOL_CLASSES && classsize < size; i++) {
+		classsize *= 2;
+	}
+
+	if (i >= RQ_BUFPOOL_CLASSES) {
+		// too big to be pooled.
+		pool->misses ++;
+		buf = expbuf_init(NULL, size);
+	}
+	else if (pool->count[i] > 0) {
+		pool->hits ++;
+		pool->count[i] --;
+		buf = pool->free[i][pool->count[i]];
+		assert(BUF_LENGTH(buf) == 0);
+		assert(BUF_MAX(buf) >= size);
+		pool->bytes -= BUF_MAX(buf);
+		assert(pool->bytes >= 0);
+	}
+	else {
+		pool->misses ++;
+		buf = expbuf_init(NULL, classsize);
+	}
 
+	assert(buf);
+	return(buf);
+}
+
+//-----------------------------------------------------------------------------
+// Return a buffer to the pool.  It is put in the largest class that it can
+// fully satisfy.  If that class is already at the high-water mark, the pool
+// budget would be exceeded, or the buffer is too small or too big for any
+// class, then it is freed.  Always returns NULL so that it can be used the same way as
+// expbuf_free.
+static expbuf_t * rq_buf_return(rq_t *rq, expbuf_t *buf)
+{
+	rq_bufpool_t *pool;
+	int i, classsize;
+
+	assert(rq);
+	assert(buf);
+	pool = &rq->bufpool;
+
+	expbuf_clear(buf);
+
+	i = -1;
+	if (BUF_MAX(buf) < (RQ_BUFPOOL_MINSIZE << RQ_BUFPOOL_CLASSES)) {
+		classsize = RQ_BUFPOOL_MINSIZE;
+		while (i+1 < RQ_BUFPOOL_CLASSES && classsize <= BUF_MAX(buf)) {
+			i++;
+			classsize *= 2;
+		}
+	}
+
+	if (i >= 0 && pool->count[i] < pool->max && rq_pool_over(rq, BUF_MAX(buf)) == 0) {
+		pool->free[i][pool->count[i]] = buf;
+		pool->count[i] ++;
+		pool->bytes += BUF_MAX(buf);
+	}
+	else {
+		buf = expbuf_free(buf);
+		assert(buf == NULL);
+	}
+
+	return(NULL);
+}
 
 
 static void rq_data_init(rq_data_t *data)
@@ -151,15 +399,21 @@ static void rq_data_init(rq_data_t *data)
 	// the message processing it.
 	data->payload = NULL;
 	data->queue = expbuf_init(NULL, 0);
+
+	data->payload_ptr = NULL;
+	data->compressed = RQ_COMPRESS_NONE;
+	data->rawsize = 0;
+	data->trace_id = 0;
+	data->payload_len = 0;
 }
 
-static void rq_data_free(rq_data_t *data)
+static void rq_data_free(rq_t *rq, rq_data_t *data)
 {
+	assert(rq);
 	assert(data);
 
 	if (data->payload) {
-		expbuf_clear(data->payload);
-		data->payload = expbuf_free(data->payload);
+		data->payload = rq_buf_return(rq, data->payload);
 		assert(data->payload == NULL);
 	}
 
@@ -181,6 +435,13 @@ void rq_queue_init(rq_queue_t *queue)
 	queue->accepted = NULL;
 	queue->dropped = NULL;
 	queue->arg = NULL;
+	queue->hash_next = NULL;
+	queue->inflight = 0;
+	queue->backlog_head = NULL;
+	queue->backlog_tail = NULL;
+	queue->held = 0;
+	memset(&queue->stats, 0, sizeof(queue->stats));
+	queue->cancelled = 0;
 }
 
 void rq_queue_free(rq_queue_t *queue)
@@ -199,1471 +460,6040 @@ void rq_queue_free(rq_queue_t *queue)
 
 
 
+//-----------------------------------------------------------------------------
+// Simple string hash used to find the bucket a queue name lives in.
+static unsigned int rq_queue_hash(const char *name)
+{
+	unsigned int hash = 5381;
 
+	assert(name);
+	while (*name) {
+		hash = ((hash << 5) + hash) + (unsigned char) *name;
+		name++;
+	}
 
-
+	return(hash & (RQ_QUEUE_HASH_SIZE - 1));
+}
 
 //-----------------------------------------------------------------------------
-// Assuming that the rq structure has been properlly filled out, this function
-// will initiate the connection process to a specified IP address.   Since the
-// application may be using the event loop for other things, and since we need
-// to support primary and secondary controllers, we need to connect in
-// non-blocking mode.
-//
-// This function will ONLY attempt to connect to the connection at the top of
-// the list.  To cycle through to a different controller, some other
-// functionality will need to move the top conn to the tail.  This would either
-// be because the controller sent a CLOSING instruction, or the socket
-// connection failed.   This means that if the connection is dropped, that
-// functionality should move the current conn to the tail, and the next connect
-// attempt would be against the alternate controller.
-static void rq_connect(rq_t *rq)
+// Find a queue that we are consuming by its name.  Returns NULL if we are not
+// consuming that queue.
+static rq_queue_t * rq_queue_find(rq_t *rq, const char *name)
 {
-	rq_conn_t *conn;
-	struct sockaddr saddr;
-	int result;
-	int len;
+	rq_queue_t *q;
 
-	assert(rq != NULL);
+	assert(rq);
+	assert(name);
 
-	assert(rq->evbase != NULL);
-	assert(ll_count(&rq->connlist) > 0);
+	q = rq->queue_hash[rq_queue_hash(name)];
+	while (q && strcmp(q->queue, name) != 0) {
+		q = q->hash_next;
+	}
 
-	// make a note of the first connection in the list.
-	conn = ll_get_head(&rq->connlist);
+	return(q);
+}
 
-	if (conn->shutdown == 0 && conn->closing == 0 && conn->connect_event == NULL && conn->active == 0) {
-	
-		assert(conn->hostname != NULL);
-		assert(conn->hostname[0] != 0);
-		assert(conn->read_event == NULL);
-		assert(conn->write_event == NULL);
-		assert(conn->connect_event == NULL);
-		assert(conn->handle == INVALID_HANDLE);
-		
-		len = sizeof(saddr);
-		if (evutil_parse_sockaddr_port(conn->hostname, &saddr, &len) != 0) {
-			// unable to parse the detail.  What do we need to do?
-			assert(0);
-		}
-		else {
-			// create the socket, and set to non-blocking mode.
-									
-			conn->handle = socket(AF_INET,SOCK_STREAM,0);
-			assert(conn->handle >= 0);
-			evutil_make_socket_nonblocking(conn->handle);
-
-			result = connect(conn->handle, &saddr, sizeof(saddr));
-			assert(result < 0);
-			assert(errno == EINPROGRESS);
-	
-			assert(conn->inbuf == NULL);
-			assert(conn->outbuf);
-			assert(conn->readbuf == NULL);
+//-----------------------------------------------------------------------------
+// Find a queue that we are consuming by the queue-id that the controller has
+// assigned to it.  Returns NULL if the controller has not assigned that id to
+// any of our queues.
+static rq_queue_t * rq_queue_find_qid(rq_t *rq, queue_id_t qid)
+{
+	assert(rq);
+	assert(qid > 0);
 
-			assert(conn->data == NULL);
-	
-			// connect process has been started.  Now we need to create an event so that we know when the connect has completed.
-			assert(conn->rq);
-			assert(conn->rq->evbase);
-			conn->connect_event = event_new(conn->rq->evbase, conn->handle, EV_WRITE, rq_connect_handler, conn);
-			assert(conn->connect_event);
-			event_add(conn->connect_event, NULL);	// TODO: Should we set a timeout on the connect?
-		}
+	if (qid < rq->queue_index_max) {
+		return(rq->queue_index[qid]);
+	}
+	else {
+		return(NULL);
 	}
 }
 
+//-----------------------------------------------------------------------------
+// Add a queue to the name hash.  The queue must not already be in there.
+static void rq_queue_addhash(rq_t *rq, rq_queue_t *queue)
+{
+	unsigned int hash;
+
+	assert(rq);
+	assert(queue);
+	assert(queue->queue);
+	assert(queue->hash_next == NULL);
 
+	hash = rq_queue_hash(queue->queue);
+	queue->hash_next = rq->queue_hash[hash];
+	rq->queue_hash[hash] = queue;
+}
 
 //-----------------------------------------------------------------------------
-// This function is called only when we lose a connection to the controller.
-// Since the connection to the controller has failed in some way, we need to
-// move that connection to the tail of the list.
-static void rq_conn_closed(rq_conn_t *conn)
+// When the controller tells us the id of a queue we are consuming, we add it
+// to the dense index.  The index is grown in powers of 2 so that we only need
+// to grow it a few times, even if the controller is handing out large ids.
+static void rq_queue_setqid(rq_t *rq, rq_queue_t *queue, queue_id_t qid)
 {
-	int i;
-	rq_message_t *msg;
-	
-	assert(conn);
-	assert(conn->rq);
+	int max;
 
-	assert(conn->handle != INVALID_HANDLE);
-	close(conn->handle);
-	conn->handle = INVALID_HANDLE;
+	assert(rq);
+	assert(queue);
+	assert(qid > 0);
+	assert(queue->qid == 0);
+
+	if (qid >= rq->queue_index_max) {
+		max = rq->queue_index_max > 0 ? rq->queue_index_max : 16;
+		while (max <= qid) { max *= 2; }
+		rq->queue_index = (rq_queue_t **) realloc(rq->queue_index, sizeof(rq_queue_t *) * max);
+		assert(rq->queue_index);
+		memset(&rq->queue_index[rq->queue_index_max], 0, sizeof(rq_queue_t *) * (max - rq->queue_index_max));
+		rq->queue_index_max = max;
+	}
 
-	// free all the buffers.
-	assert(conn->readbuf);
-	assert(BUF_LENGTH(conn->readbuf) == 0);
-	conn->readbuf = expbuf_free(conn->readbuf);
-	assert(conn->readbuf == NULL);
+	assert(rq->queue_index[qid] == NULL);
+	rq->queue_index[qid] = queue;
+	queue->qid = qid;
+}
 
-	assert(conn->sendbuf);
-	assert(BUF_LENGTH(conn->sendbuf) == 0);
-	conn->sendbuf = expbuf_free(conn->sendbuf);
-	assert(conn->sendbuf == NULL);
+//-----------------------------------------------------------------------------
+// The queue-ids are only valid for the connection that they were assigned on.
+// When that connection is lost, we need to clear them so that the new
+// controller can assign its own.
+static void rq_queue_clearqids(rq_t *rq)
+{
+	rq_queue_t *q;
 
-	if (conn->inbuf) {
-		expbuf_clear(conn->inbuf);
-		conn->inbuf = expbuf_free(conn->inbuf);
-		assert(conn->inbuf == NULL);
-	}
-	
-	assert(conn->outbuf);
-	expbuf_clear(conn->outbuf);
+	assert(rq);
 
-	// cleanup the data structure.
-	if (conn->data) {
-		rq_data_free(conn->data);
-		free(conn->data);
-		conn->data = NULL;
+	ll_start(&rq->queues);
+	while ((q = ll_next(&rq->queues))) {
+		q->qid = 0;
 	}
+	ll_finish(&rq->queues);
 
-	// remove the conn from the connlist.  It should actually be the highest one in the list, and then put it at the tail of the list.
-	assert(conn->rq);
-	assert(ll_count(&conn->rq->connlist) > 0);
-	if (ll_count(&conn->rq->connlist) > 1) {
-		ll_remove(&conn->rq->connlist, conn);
-		ll_push_tail(&conn->rq->connlist, conn);
+	if (rq->queue_index_max > 0) {
+		assert(rq->queue_index);
+		memset(rq->queue_index, 0, sizeof(rq_queue_t *) * rq->queue_index_max);
 	}
+}
 
-	// clear the events
-	if (conn->read_event) {
-		event_free(conn->read_event);
-		conn->read_event = NULL;
+
+//-----------------------------------------------------------------------------
+// Find the queue-id for a queue name on the current connection.  Returns 0 if
+// we dont know it.
+static queue_id_t rq_qidcache_find(rq_t *rq, const char *name)
+{
+	rq_qidname_t *entry;
+
+	assert(rq);
+	assert(name);
+
+	entry = rq->qid_cache[rq_queue_hash(name)];
+	while (entry && strcmp(entry->name, name) != 0) {
+		entry = entry->next;
 	}
-	if (conn->write_event) {
-		event_free(conn->write_event);
-		conn->write_event = NULL;
+
+	return(entry ? entry->qid : 0);
+}
+
+//-----------------------------------------------------------------------------
+// The controller has told us the id of a queue.
+static void rq_qidcache_add(rq_t *rq, const char *name, queue_id_t qid)
+{
+	rq_qidname_t *entry;
+	unsigned int hash;
+
+	assert(rq);
+	assert(name);
+	assert(qid > 0);
+
+	if (rq_qidcache_find(rq, name) == 0) {
+		entry = (rq_qidname_t *) malloc(sizeof(rq_qidname_t));
+		assert(entry);
+		entry->name = strdup(name);
+		entry->qid = qid;
+
+		hash = rq_queue_hash(name);
+		entry->next = rq->qid_cache[hash];
+		rq->qid_cache[hash] = entry;
+		rq->qid_gen ++;
 	}
-	assert(conn->connect_event == NULL);
+}
 
-	// timeout all the pending messages, if there are any.
-	if (conn->rq->msg_used > 0) {
-		for (i=0; i<conn->rq->msg_max; i++) {
-			if (conn->rq->msg_list[i]) {
-				msg = conn->rq->msg_list[i];
-				if (msg->conn == conn) {
-					assert(0);
-				}
-			}
+//-----------------------------------------------------------------------------
+// The ids were only valid on the connection that told us about them.
+static void rq_qidcache_clear(rq_t *rq)
+{
+	rq_qidname_t *entry;
+	int i;
+
+	assert(rq);
+
+	for (i=0; i<RQ_QUEUE_HASH_SIZE; i++) {
+		while ((entry = rq->qid_cache[i])) {
+			rq->qid_cache[i] = entry->next;
+			free(entry->name);
+			free(entry);
 		}
 	}
-	
-	conn->active = 0;
-	conn->closing = 0;
+	rq->qid_gen ++;
+}
 
-	// initiate a connect on the head of the list.
-	assert(conn->rq);
-	rq_connect(conn->rq);
+
+
+
+
+
+
+//-----------------------------------------------------------------------------
+// Prepare an empty outbound queue.
+static void rq_outq_init(rq_outq_t *outq)
+{
+	assert(outq);
+
+	outq->head = 0;
+	outq->count = 0;
+	outq->bytes = 0;
 }
 
 //-----------------------------------------------------------------------------
-// this function is used internally to send the data to the connected RQ
-// controller.  It will put the data in the outbuffer, and if the outbuffer was previously empty, then we will set the write event.
-static void rq_senddata(rq_conn_t *conn, char *data, int length)
+// Return the last segment of the outbound queue, making sure that it is a
+// segment we own and that it can take another 'length' bytes.  If it cant,
+// then a new segment is taken from the bufpool.  If the ring is full, the
+// last segment will just grow.  The caller can add data to the buffer
+// directly, but must then call rq_outq_commit() with the length of the buffer
+// from before it started.
+static expbuf_t * rq_outq_tail(rq_t *rq, rq_outq_t *outq, int length)
 {
-	assert(conn);
-	assert(data);
+	rq_outseg_t *seg;
+	int size;
+
+	assert(rq);
+	assert(outq);
 	assert(length > 0);
-	assert(conn->handle != INVALID_HANDLE);
 
-	// add the new data to the buffer.
-	assert(conn->outbuf);
-	expbuf_add(conn->outbuf, data, length);
+	seg = NULL;
+	if (outq->count > 0) {
+		seg = &outq->seg[(outq->head + outq->count - 1) % RQ_OUTQ_SIZE];
+		if (seg->buf == NULL) {
+			// references are never put in the last slot of the ring.
+			assert(outq->count < RQ_OUTQ_SIZE);
+			seg = NULL;
+		}
+		else if (outq->count < RQ_OUTQ_SIZE && BUF_LENGTH(seg->buf) + length > RQ_OUT_SEGSIZE) {
+			seg = NULL;
+		}
+	}
 
-	// if we dont already have a write event set, then create one.
-	if (conn->write_event == NULL) {
-		assert(conn->rq);
-		assert(conn->rq->evbase);
-		conn->write_event = event_new(conn->rq->evbase, conn->handle, EV_WRITE | EV_PERSIST, rq_write_handler, conn);
-		assert(conn->write_event);
-		event_add(conn->write_event, NULL);
-		
-// 		printf("rq_senddata: created WRITE event for socket:%d.\n", conn->handle);
+	if (seg == NULL) {
+		assert(outq->count < RQ_OUTQ_SIZE);
+		seg = &outq->seg[(outq->head + outq->count) % RQ_OUTQ_SIZE];
+		size = length > RQ_OUT_SEGSIZE ? length : RQ_OUT_SEGSIZE;
+		seg->buf = rq_buf_get(rq, size);
+		seg->ref = NULL;
+		seg->reflen = 0;
+		seg->offset = 0;
+		outq->count ++;
 	}
+
+	assert(seg->buf);
+	return(seg->buf);
 }
 
+static void rq_outq_commit(rq_outq_t *outq, expbuf_t *buf, int before)
+{
+	assert(outq);
+	assert(buf);
+	assert(BUF_LENGTH(buf) >= before);
+
+	outq->bytes += BUF_LENGTH(buf) - before;
+}
 
 //-----------------------------------------------------------------------------
-// Send a message to the controller that basically states that this client is
-// closing its connection.  Since we are sending a single command we dont need
-// to go through the expence of gettng a buffer from the bufpool.
-static void rq_send_closing(rq_conn_t *conn)
+// Add data to the outbound queue.  It is appended to the last segment if that
+// segment still has room, otherwise a new segment is taken from the bufpool.
+static void rq_outq_add(rq_t *rq, rq_outq_t *outq, char *data, int length)
 {
-	char buf[1];
-	
-	buf[0] = RQ_CMD_CLOSING;
-	assert(conn);
-	rq_senddata(conn, buf, 1);
-}
+	expbuf_t *buf;
+	int before;
 
+	assert(data);
+	assert(length > 0);
 
+	buf = rq_outq_tail(rq, outq, length);
+	before = BUF_LENGTH(buf);
+	expbuf_add(buf, data, length);
+	rq_outq_commit(outq, buf, before);
+}
 
 //-----------------------------------------------------------------------------
-// Used to tell the library that it needs to start shutting down connections so
-// that the application can exit the loop.
-void rq_shutdown(rq_t *rq)
+// Add a reference to data that we dont own to the outbound queue.  The data
+// must not be changed or released until it has been sent (or the queue is
+// cleared).  Returns 0 if there is not enough room in the ring, in which case
+// the caller should copy the data instead.  We always leave the last slot of
+// the ring free for an owned segment, so that there is somewhere to put the
+// frames that follow.
+static int rq_outq_addref(rq_outq_t *outq, const char *data, int length)
 {
-	rq_conn_t *conn;
-	int pending;
-	
-	assert(rq);
+	rq_outseg_t *seg;
 
-	// go thru the connect list, and tell each one that it is shutting down.
-	ll_start(&rq->connlist);
-	while ((conn = ll_next(&rq->connlist))) {
+	assert(outq);
+	assert(data);
+	assert(length > 0);
 
-		// Because the list entries may move around while being processed, we may
-		// need to restart the list from the head again.  Therefore we need to
-		// check to see if we have already processed this connection.
-		if (conn->shutdown == 0) {
-			conn->shutdown ++;
-	
-			if (conn->handle != INVALID_HANDLE) {
-	
-				// if we have a handle, but not marked as active, then we must still be connecting.
-				if (conn->active == 0) {
-					assert(conn->closing == 0);
-					
-					// need to close the connection, and remove the connect event.
-					assert(conn->connect_event);
-					event_free(conn->connect_event);
-					conn->connect_event = NULL;
-					rq_conn_closed(conn);
-					assert(conn->closing == 0);
+	if (outq->count >= RQ_OUTQ_SIZE - 1) {
+		return(0);
+	}
 
-					// closing the connection would have moved the conns around in the
-					// list, so we need to reset the 'next'.  This means the loop will
-					// restart again, but we wont process the ones that we have already
-					// marked as 'shutdown'
-					ll_finish(&rq->connlist);
-					ll_start(&rq->connlist);
-				}
-				else {
-					assert(conn->active > 0);
-					assert(conn->connect_event == NULL);
-					assert(conn->read_event);
-					
-					// send 'closing' message to each connected controller.  This should remove the node from any queues it is consuming.
-					rq_send_closing(conn);
-	
-					assert(conn->closing == 0);
-					conn->closing ++;
-				
-					// we need to wait if we are still processing some messages from a queue being consumed.
-					pending = rq->msg_used;
+	seg = &outq->seg[(outq->head + outq->count) % RQ_OUTQ_SIZE];
+	seg->buf = NULL;
+	seg->ref = data;
+	seg->reflen = length;
+	seg->offset = 0;
+	outq->count ++;
+	outq->bytes += length;
 
-					// close connections if there are no messages waiting to be processed on it.
-					if (pending == 0) {
-						rq_conn_closed(conn);
-						assert(conn->closing == 0);
-						
-						// closing the connection would have moved the conns around in the
-						// list, so we need to reset the 'next'.  This means the loop will
-						// restart again, but we wont process the ones that we have already
-						// marked as 'shutdown'
-						ll_finish(&rq->connlist);
-						ll_start(&rq->connlist);
-					}
-				}
+	return(1);
+}
+
+//-----------------------------------------------------------------------------
+// Remove 'length' bytes from the front of the queue, because they have been
+// sent.  Segments that are completely sent are returned to the bufpool.
+static void rq_outq_consume(rq_t *rq, rq_outq_t *outq, int length)
+{
+	rq_outseg_t *seg;
+	int avail;
+
+	assert(rq);
+	assert(outq);
+	assert(length >= 0 && length <= outq->bytes);
+
+	outq->bytes -= length;
+	while (length > 0) {
+		assert(outq->count > 0);
+		seg = &outq->seg[outq->head];
+		avail = (seg->buf ? BUF_LENGTH(seg->buf) : seg->reflen) - seg->offset;
+		if (length < avail) {
+			seg->offset += length;
+			length = 0;
+		}
+		else {
+			length -= avail;
+			if (seg->buf) {
+				seg->buf = rq_buf_return(rq, seg->buf);
 			}
+			seg->ref = NULL;
+			seg->reflen = 0;
+			seg->offset = 0;
+			outq->head = (outq->head + 1) % RQ_OUTQ_SIZE;
+			outq->count --;
 		}
 	}
-	ll_finish(&rq->connlist);
+
+	if (outq->count == 0) { outq->head = 0; }
 }
 
+//-----------------------------------------------------------------------------
+// Throw away everything in the queue, returning the buffers to the bufpool.
+static void rq_outq_clear(rq_t *rq, rq_outq_t *outq)
+{
+	assert(rq);
+	assert(outq);
 
-void rq_cleanup(rq_t *rq)
+	rq_outq_consume(rq, outq, outq->bytes);
+	assert(outq->count == 0);
+	assert(outq->bytes == 0);
+}
+
+//-----------------------------------------------------------------------------
+// Fill out the iovec array (which must have room for RQ_OUTQ_SIZE entries)
+// for everything in the queue.  Returns the number of entries.
+static int rq_outq_iov(rq_outq_t *outq, struct iovec *iov)
 {
-	rq_queue_t *q;
-	rq_conn_t *conn;
-	
-	assert(rq != NULL);
+	rq_outseg_t *seg;
+	int i;
 
-	// cleanup the risp object.
-	assert(rq->risp != NULL);
-	rq->risp = risp_shutdown(rq->risp);
-	assert(rq->risp == NULL);
+	assert(outq);
+	assert(iov);
+	assert(outq->count > 0 && outq->bytes > 0);
 
-	// free the resources allocated for the connlist.
-	while ((conn = ll_pop_head(&rq->connlist))) {
-		assert(conn->handle == INVALID_HANDLE);
-		assert(conn->active == 0);
-		assert(conn->closing == 0);
-		assert(conn->shutdown > 0);
+	for (i=0; i<outq->count; i++) {
+		seg = &outq->seg[(outq->head + i) % RQ_OUTQ_SIZE];
+		if (seg->buf) {
+			assert(BUF_LENGTH(seg->buf) > seg->offset);
+			iov[i].iov_base = BUF_DATA(seg->buf) + seg->offset;
+			iov[i].iov_len = BUF_LENGTH(seg->buf) - seg->offset;
+		}
+		else {
+			assert(seg->ref && seg->reflen > seg->offset);
+			iov[i].iov_base = (char *) seg->ref + seg->offset;
+			iov[i].iov_len = seg->reflen - seg->offset;
+		}
+	}
 
-		assert(conn->read_event == NULL);
-		assert(conn->write_event == NULL);
-		assert(conn->connect_event == NULL);
+	return(outq->count);
+}
 
-		assert(conn->outbuf);
-		conn->outbuf = expbuf_free(conn->outbuf);
-		assert(conn->outbuf == NULL);
-		
-		conn->rq = NULL;
-		conn->risp = NULL;
-	
-		assert(conn->hostname);
-		free(conn->hostname);
-		conn->hostname = NULL;
+#ifdef RQ_WITH_URING
+//-----------------------------------------------------------------------------
+// Move everything in one queue to another (empty) one.  Used when the data is
+// handed to the kernel and must not be touched until it has been sent.
+static void rq_outq_move(rq_outq_t *to, rq_outq_t *from)
+{
+	int i;
 
-		assert(conn->inbuf == NULL);
-		assert(conn->readbuf == NULL);
-		assert(conn->data == NULL);
-	}
-	assert(ll_count(&rq->connlist) == 0);
-	ll_free(&rq->connlist);
+	assert(to);
+	assert(from);
+	assert(to->count == 0 && to->bytes == 0);
 
-	// cleanup all the queues that we have.
-	while ((q = ll_pop_head(&rq->queues))) {
-		rq_queue_free(q);
-		free(q);
+	for (i=0; i<from->count; i++) {
+		to->seg[i] = from->seg[(from->head + i) % RQ_OUTQ_SIZE];
 	}
+	to->head = 0;
+	to->count = from->count;
+	to->bytes = from->bytes;
 
-	assert(rq->msg_list);
-	assert(rq->msg_used == 0);
-	while (rq->msg_max > 0) {
-		rq->msg_max --;
-		assert(rq->msg_list[rq->msg_max] == NULL);
-	}
-	free(rq->msg_list);
-	rq->msg_list = NULL;
+	rq_outq_init(from);
+}
+#endif
 
+//-----------------------------------------------------------------------------
+// Send as much of the outbound queue as the socket will take, using a single
+// writev for all the segments.  Returns the result of the writev.
+static int rq_outq_flush(rq_t *rq, rq_outq_t *outq, evutil_socket_t handle)
+{
+	struct iovec iov[RQ_OUTQ_SIZE];
+	int count, res;
 
-	// cleanup the msgpool
-	assert(rq->msg_pool);
-	while ((ll_pop_head(rq->msg_pool)));
-	ll_free(rq->msg_pool);
-	free(rq->msg_pool);
-	rq->msg_pool = NULL;
+	assert(rq);
+	assert(outq);
+	assert(handle != INVALID_HANDLE);
+
+	count = rq_outq_iov(outq, iov);
+	res = writev(handle, iov, count);
+	if (res > 0) {
+		assert(res <= outq->bytes);
+		rq_outq_consume(rq, outq, res);
+	}
+
+	return(res);
 }
 
 
-void rq_setevbase(rq_t *rq, struct event_base *base)
+//-----------------------------------------------------------------------------
+// Flush the outbound queue of a connection, keeping count of what was sent.
+static int rq_conn_flush(rq_conn_t *conn)
 {
-	assert(rq);
+	int res;
 
-	if (base) {
-		assert(rq->evbase == NULL);
-		rq->evbase = base;
+	assert(conn);
+	assert(conn->rq);
+
+	if (conn->outbuf.bytes > conn->stats.outbuf_peak) {
+		conn->stats.outbuf_peak = conn->outbuf.bytes;
 	}
-	else {
-		assert(rq->evbase);
-		rq->evbase = NULL;
+
+	res = rq_outq_flush(conn->rq, &conn->outbuf, conn->handle);
+	if (res > 0) {
+		conn->stats.bytes_out += res;
+		RQ_TRACE(conn->rq, RQ_TRACE_FLUSH, flush, -1, 0, res);
+		if (conn->rq->unwritable) {
+			rq_budget_check(conn->rq);
+		}
 	}
+	return(res);
 }
 
 
+//-----------------------------------------------------------------------------
+// Add the header of a RISP large-string command (the command and the length)
+// without the data, so that the data can be added separately.  This must
+// produce the same bytes as addCmdLargeStr().
+static void rq_addlargestr_header(expbuf_t *buf, risp_command_t cmd, int length)
+{
+	unsigned char c;
+	uint32_t nlen;
+
+	assert(buf);
+	assert(length >= 0);
+
+	c = cmd;
+	nlen = htonl(length);
+	expbuf_add(buf, &c, 1);
+	expbuf_add(buf, &nlen, sizeof(nlen));
+}
 
 
 
 //-----------------------------------------------------------------------------
-// this function is an internal one that is used to read data from the socket.
-// It is assumed that we are pretty sure that there is data to be read (or the
-// socket has been closed).
-static void rq_process_read(rq_conn_t *conn)
+// Apply the socket options for the connection.  The buffer sizes (and
+// TCP_NODELAY) are set before the connect.  TCP_QUICKACK is not sticky, so if
+// it is wanted, it is set again after every read ('reading').
+static void rq_conn_sockopts(rq_conn_t *conn, int reading)
 {
-	int res, empty;
-	
+	rq_t *rq;
+	int opt;
+
 	assert(conn);
 	assert(conn->rq);
-	assert(conn->risp);
-	assert(conn->readbuf);
-	
-	assert(BUF_LENGTH(conn->readbuf) == 0);
-	assert(BUF_MAX(conn->readbuf) >= RQ_DEFAULT_BUFFSIZE);
+	assert(conn->handle != INVALID_HANDLE);
+	rq = conn->rq;
 
-	empty = 0;
-	while (empty == 0) {
-		assert(BUF_LENGTH(conn->readbuf) == 0);
-		assert(conn->handle != INVALID_HANDLE && conn->handle > 0);
-		assert(BUF_DATA(conn->readbuf) != NULL  && BUF_MAX(conn->readbuf) > 0);
-		
-		res = read(conn->handle, BUF_DATA(conn->readbuf), BUF_MAX(conn->readbuf));
-		if (res > 0) {
-			BUF_LENGTH(conn->readbuf) = res;
-			assert(BUF_LENGTH(conn->readbuf) <= BUF_MAX(conn->readbuf));
-
-			// if we pulled out the max we had avail in our buffer, that means we
-			// can pull out more at a time, so we should increase our buffer size by
-			// RQ_DEFAULT_BUFFSIZE amount.  This will increase the size of the
-			// buffer in rather small chunks, which might not be optimal.
-			if (res == BUF_MAX(conn->readbuf)) {
-				expbuf_shrink(conn->readbuf, RQ_DEFAULT_BUFFSIZE);
-				assert(empty == 0);
-			}
-			else { empty = 1; }
-			
-			// if there is no data in the in-buffer, then we will process the common buffer by itself.
-			if (conn->inbuf == NULL) {
-				res = risp_process(conn->risp, conn, BUF_LENGTH(conn->readbuf), (unsigned char *) BUF_DATA(conn->readbuf));
-				assert(res <= BUF_LENGTH(conn->readbuf));
-				assert(res >= 0);
-				if (res > 0) { expbuf_purge(conn->readbuf, res); }
-
-				// if there is data left over, then we need to add it to our in-buffer.
-				if (BUF_LENGTH(conn->readbuf) > 0) {
-					assert(conn->inbuf == NULL);
-					conn->inbuf = expbuf_init(NULL, BUF_LENGTH(conn->readbuf));
-					assert(conn->inbuf);
-					
-					expbuf_add(conn->inbuf, BUF_DATA(conn->readbuf), BUF_LENGTH(conn->readbuf));
-					expbuf_clear(conn->readbuf);
-				}
-			}
-			else {
-				// we have data left in the in-buffer, so we add the content of the common buffer
-				assert(BUF_LENGTH(conn->readbuf) > 0);
-				assert(conn->inbuf);
-				assert(BUF_LENGTH(conn->inbuf) > 0);
-				expbuf_add(conn->inbuf, BUF_DATA(conn->readbuf), BUF_LENGTH(conn->readbuf));
-				expbuf_clear(conn->readbuf);
-				assert(BUF_LENGTH(conn->readbuf) == 0);
-				assert(BUF_LENGTH(conn->inbuf) > 0 && BUF_DATA(conn->inbuf) != NULL);
-
-				// and then process what is there.
-				res = risp_process(conn->risp, conn, BUF_LENGTH(conn->inbuf), (unsigned char *) BUF_DATA(conn->inbuf));
-				assert(res <= BUF_LENGTH(conn->inbuf));
-				assert(res >= 0);
-				if (res > 0) { expbuf_purge(conn->inbuf, res); }
-
-				if (BUF_LENGTH(conn->inbuf) == 0) {
-					// the in buffer is now empty, so we should free it.
-					conn->inbuf = expbuf_free(conn->inbuf);
-					assert(conn->inbuf == NULL);
-				}
-			}
-			
-			assert(conn->readbuf);
-			assert(BUF_LENGTH(conn->readbuf) == 0);
+	if (reading == 0) {
+		if (rq->sock_sndbuf > 0) {
+			opt = rq->sock_sndbuf;
+			setsockopt(conn->handle, SOL_SOCKET, SO_SNDBUF, &opt, sizeof(opt));
 		}
-		else {
-			assert(empty == 0);
-			empty = 1;
-			
-			if (res == 0) {
-				rq_conn_closed(conn);
-				assert(conn->readbuf == NULL);
-			}
-			else {
-				assert(res == -1);
-				if (errno != EAGAIN && errno != EWOULDBLOCK) {
-					rq_conn_closed(conn);
-					assert(conn->readbuf == NULL);
-				}
-				else {
-					assert(conn->readbuf);
-				}
-			}
+		if (rq->sock_rcvbuf > 0) {
+			opt = rq->sock_rcvbuf;
+			setsockopt(conn->handle, SOL_SOCKET, SO_RCVBUF, &opt, sizeof(opt));
 		}
 	}
 
+	if (conn->addr.ss_family == AF_INET || conn->addr.ss_family == AF_INET6) {
+		opt = 1;
+		if (reading == 0 && (rq->sock_flags & RQ_SOCKET_NODELAY)) {
+			setsockopt(conn->handle, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+		}
+#ifdef TCP_QUICKACK
+		if (rq->sock_flags & RQ_SOCKET_QUICKACK) {
+			setsockopt(conn->handle, IPPROTO_TCP, TCP_QUICKACK, &opt, sizeof(opt));
+		}
+#endif
+	}
 }
 
 
+//-----------------------------------------------------------------------------
+// Create a socket suitable for connecting to the address, and set it to
+// non-blocking mode.  Returns INVALID_HANDLE if the socket could not be
+// created.
+int rq_new_socket(struct addrinfo *ai)
+{
+	int sfd;
 
+	assert(ai);
 
-static void rq_write_handler(int fd, short int flags, void *arg)
+	sfd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+	if (sfd >= 0) {
+		if (evutil_make_socket_nonblocking(sfd) != 0) {
+			close(sfd);
+			sfd = INVALID_HANDLE;
+		}
+	}
+
+	return(sfd);
+}
+
+
+//-----------------------------------------------------------------------------
+// Start a non-blocking connect to a controller.  The connect event is given
+// the connect timeout, so the handler will be called either when the connect
+// completes (or fails), or when we've waited long enough.  If we dont have an
+// address for the controller yet, the connect is started once it has been
+// resolved.
+static void rq_conn_connect(rq_conn_t *conn)
 {
-	rq_conn_t *conn = (rq_conn_t *) arg;
-	int res;
+	struct addrinfo ai;
+	struct timeval tv;
+	int result;
 
-	assert(fd >= 0);
-	assert(flags != 0);
 	assert(conn);
 	assert(conn->rq);
-	assert(conn->handle == fd);
-	assert(conn->active > 0);
-	assert(flags & EV_WRITE);
-	assert(conn->write_event);
-
-	assert(conn->outbuf);
-	assert(BUF_LENGTH(conn->outbuf) > 0);
-	assert(conn->active > 0);
-	
-// 	printf("rq_write_handler: attempting to send %d bytes for socket: %d\n", BUF_LENGTH(conn->outbuf), fd);
+	assert(conn->shutdown == 0);
+	assert(conn->closing == 0);
+	assert(conn->active == 0);
+	assert(conn->hostname != NULL);
+	assert(conn->hostname[0] != 0);
+	assert(conn->read_event == NULL);
+	assert(conn->write_event == NULL);
+	assert(conn->connect_event == NULL);
+	assert(conn->handle == INVALID_HANDLE);
 	
-	// send the data that is waiting in the outbuffer.
-	res = send(conn->handle, BUF_DATA(conn->outbuf), BUF_LENGTH(conn->outbuf), 0);
-	if (res > 0) {
-		assert(res <= BUF_LENGTH(conn->outbuf));
-		expbuf_purge(conn->outbuf, res);
-// 		printf("rq_write_handler: sent %d bytes for socket: %d\n", res, fd);
+	if (conn->addrlen == 0) {
+		assert(conn->dnshost);
+		rq_conn_resolve(conn, 1);
+		return;
 	}
-	else if (res == 0 || (res == -1 && errno != EAGAIN && errno != EWOULDBLOCK)) {
-// 		printf("rq_write_handler: closing socket %d.\n", fd);
-		assert(conn);
-		rq_conn_closed(conn);
+
+	// if the address we have is getting old, we look it up again for next
+	// time, but we dont wait for it.
+	if (conn->dnshost && conn->rq->dns_ttl > 0 && rq_now() - conn->resolved_at > (uint64_t) conn->rq->dns_ttl * 1000000) {
+		rq_conn_resolve(conn, 0);
 	}
 
-	// if we dont have any more to send, then we need to remove the WRITE event, and return the outbuffer.
-	assert(conn->outbuf);
-	if (BUF_LENGTH(conn->outbuf) == 0) {
-		// clear the write event
-		event_free(conn->write_event);
-		conn->write_event = NULL;
+	// create the socket, and set to non-blocking mode.
+	memset(&ai, 0, sizeof(ai));
+	ai.ai_family = conn->addr.ss_family;
+	ai.ai_socktype = SOCK_STREAM;
+	ai.ai_protocol = 0;
+	conn->handle = rq_new_socket(&ai);
+	assert(conn->handle >= 0);
+
+	rq_conn_sockopts(conn, 0);
+
+	// a unix socket will normally connect (or fail) straight away, a tcp socket
+	// will be in progress.
+	conn->connect_error = 0;
+	result = connect(conn->handle, (struct sockaddr *) &conn->addr, conn->addrlen);
+	if (result < 0 && errno != EINPROGRESS) {
+		conn->connect_error = errno;
+		assert(conn->connect_error != 0);
 	}
-}	
 
+	assert(conn->readbuf == NULL);
+
+	assert(conn->data == NULL);
+
+	// connect process has been started.  Now we need to create an event so that we know when the connect has completed.
+	assert(conn->rq->evbase);
+	if (conn->connect_error != 0) {
+		// it has already failed, but we let the handler deal with it from the
+		// event loop, the same as a connect that was refused.
+		conn->connect_event = event_new(conn->rq->evbase, conn->handle, 0, rq_connect_handler, conn);
+		assert(conn->connect_event);
+		tv.tv_sec = 0;
+		tv.tv_usec = 0;
+		event_add(conn->connect_event, &tv);
+		return;
+	}
+	conn->connect_event = event_new(conn->rq->evbase, conn->handle, EV_WRITE, rq_connect_handler, conn);
+	assert(conn->connect_event);
+	if (conn->rq->connect_timeout > 0) {
+		tv.tv_sec = conn->rq->connect_timeout / 1000;
+		tv.tv_usec = (conn->rq->connect_timeout % 1000) * 1000;
+		event_add(conn->connect_event, &tv);
+	}
+	else {
+		event_add(conn->connect_event, NULL);
+	}
+}
 
 
 //-----------------------------------------------------------------------------
-// This internal function is used to actually send a queue consume request 
-static void rq_send_consume(rq_conn_t *conn, rq_queue_t *queue)
+// We have waited long enough after failing to resolve a controller address,
+// so it is treated the same as a failed connect, and we move on to the next
+// controller (or try this one again).
+static void rq_dns_retry_handler(int fd, short int flags, void *arg)
 {
+	rq_conn_t *conn = (rq_conn_t *) arg;
+	rq_t *rq;
+
+	assert(fd == -1);
 	assert(conn);
-	assert(queue);
+	assert(conn->rq);
+	assert(conn->dns_connect);
+	rq = conn->rq;
+
+	conn->dns_connect = 0;
+	if (conn->shutdown == 0) {
+		conn->stats.connect_fails ++;
+		if (ll_count(&rq->connlist) > 1) {
+			ll_remove(&rq->connlist, conn);
+			ll_push_tail(&rq->connlist, conn);
+		}
+		rq_connect(rq);
+	}
+}
 
-	assert(queue->queue);
-	assert(queue->max >= 0);
-	assert(strlen(queue->queue) > 0 && strlen(queue->queue) < 256);
 
-	// get a buffer from the bufpool.
-	assert(conn->sendbuf);
-	assert(BUF_LENGTH(conn->sendbuf) == 0);
-	
+//-----------------------------------------------------------------------------
+// A lookup of a controller hostname has finished.  If it worked, we keep the
+// first address.  If a connect was waiting for it, then we start it now, or
+// if it failed, we wait a while and then treat it the same as a failed
+// connect.
+static void rq_conn_resolved(rq_conn_t *conn, int result, struct evutil_addrinfo *res)
+{
+	struct timeval tv;
+	rq_conn_t *head;
+	rq_t *rq;
 
-	// send consume request to controller.
-	addCmd(conn->sendbuf, RQ_CMD_CLEAR);
-	if (queue->exclusive != 0)
-		addCmd(conn->sendbuf, RQ_CMD_EXCLUSIVE);
-	addCmdShortStr(conn->sendbuf, RQ_CMD_QUEUE, strlen(queue->queue), queue->queue);
-	addCmdInt(conn->sendbuf, RQ_CMD_MAX, queue->max);
-	addCmdShortInt(conn->sendbuf, RQ_CMD_PRIORITY, queue->priority);
-	addCmd(conn->sendbuf, RQ_CMD_CONSUME);
-
-	rq_senddata(conn, BUF_DATA(conn->sendbuf), BUF_LENGTH(conn->sendbuf));
-	expbuf_clear(conn->sendbuf);
-}
-
-
-static void rq_connect_handler(int fd, short int flags, void *arg)
-{
-	rq_conn_t *conn = (rq_conn_t *) arg;
-	rq_queue_t *q;
-	socklen_t foo;
-	int error;
-
-	assert(fd >= 0);
-	assert(flags != 0);
 	assert(conn);
 	assert(conn->rq);
-	assert(conn->handle == fd);
-	assert(flags & EV_WRITE);
-	assert(conn->rq->evbase != NULL);
-
-	// remove the connect handler
-	assert(conn->connect_event);
-	event_free(conn->connect_event);
-	conn->connect_event = NULL;
+	rq = conn->rq;
 
-	foo = sizeof(error);
-	getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &foo);
-	if (error == ECONNREFUSED) {
-		// connect failed...  we need to move this conn object from the list and put it at the tail.
-	
-		assert(conn->active == 0);
-		assert(conn->closing == 0);
-		assert(conn->connect_event == NULL);
-		assert(conn->data == NULL);
+	conn->resolving = 0;
+	conn->dns_req = NULL;
 
-		rq_conn_closed(conn);
+	if (result == 0 && res) {
+		assert(res->ai_addrlen <= sizeof(conn->addr));
+		memcpy(&conn->addr, res->ai_addr, res->ai_addrlen);
+		conn->addrlen = res->ai_addrlen;
+		conn->resolved_at = rq_now();
+		conn->dns_backoff = 0;
 	}
-	else {
-
-		assert(conn->active == 0);
-		conn->active ++;
-
-		// now that we have connected, we should get a buffer to handle read data.
-		assert(conn->readbuf == NULL);
-		conn->readbuf = expbuf_init(NULL, RQ_DEFAULT_BUFFSIZE);
-		assert(conn->readbuf);
 
-		// we should also prepare the 'sendbuf' even though it wont be needed until we send something.
-		// better to create it now, rather than having to test for it and create it later.
-		assert(conn->sendbuf == NULL);
-		conn->sendbuf = expbuf_init(NULL, RQ_DEFAULT_BUFFSIZE);
-		assert(conn->sendbuf);
-		
-		// make sure our other buffers are empty, but keep in mind that our outbuf
-		// may have something in it by now.
-		assert(conn->inbuf == NULL);
+	if (conn->dns_connect) {
+		conn->dns_connect = 0;
 
-		// initialise the data portion of the 'conn' object.
-		assert(conn->rq);
-		assert(conn->data == NULL);
-		conn->data = (rq_data_t *) malloc(sizeof(rq_data_t));
-		assert(conn->data);
-		rq_data_init(conn->data);
+		// we might have connected to another controller in the meantime.
+		head = ll_get_head(&rq->connlist);
+		assert(head);
+		if (conn->shutdown == 0 && head->active == 0) {
+			if (conn->addrlen > 0) {
+				rq_conn_connect(conn);
+			}
+			else {
+				// connecting again straight away would just resolve it again, over
+				// and over, so the connect keeps waiting for a while first.
+				if (conn->dns_backoff == 0) { conn->dns_backoff = RQ_DNS_BACKOFF_MIN; }
+				else if (conn->dns_backoff < RQ_DNS_BACKOFF_MAX) {
+					conn->dns_backoff *= 2;
+					if (conn->dns_backoff > RQ_DNS_BACKOFF_MAX) { conn->dns_backoff = RQ_DNS_BACKOFF_MAX; }
+				}
 
-		// apply the regular read handler now.
-		assert(conn->read_event == NULL);
-		assert(conn->handle > 0);
-		conn->read_event = event_new(conn->rq->evbase, conn->handle, EV_READ | EV_PERSIST, rq_read_handler, conn);
-		event_add(conn->read_event, NULL);
-	
-		// if we have data in our out buffer, we need to create the WRITE event.
-		assert(conn->outbuf);
-		if (BUF_LENGTH(conn->outbuf) > 0) {
-			assert(conn->handle != INVALID_HANDLE && conn->handle > 0);
-			assert(conn->write_event == NULL);
-			assert(conn->rq->evbase);
-			conn->write_event = event_new(conn->rq->evbase, conn->handle, EV_WRITE | EV_PERSIST, rq_write_handler, conn);
-			event_add(conn->write_event, NULL);
-		}
-		
-		// now that we have an active connection, we need to send our queue requests.
-		assert(conn);
-		assert(conn->rq);
-		ll_start(&conn->rq->queues);
-		while ((q = ll_next(&conn->rq->queues))) {
-			rq_send_consume(conn, q);
+				if (conn->dns_event == NULL) {
+					assert(rq->evbase);
+					conn->dns_event = evtimer_new(rq->evbase, rq_dns_retry_handler, conn);
+					assert(conn->dns_event);
+				}
+				tv.tv_sec = conn->dns_backoff / 1000;
+				tv.tv_usec = (conn->dns_backoff % 1000) * 1000;
+				evtimer_add(conn->dns_event, &tv);
+				conn->dns_connect = 1;
+			}
 		}
-		ll_finish(&conn->rq->queues);
-	
-		// just in case there is some data there already.
-		rq_process_read(conn);
 	}
 }
 
 
-
-static void rq_read_handler(int fd, short int flags, void *arg)
+#ifndef LIBEVENT_OLD_VER
+static void rq_dns_handler(int result, struct evutil_addrinfo *res, void *arg)
 {
 	rq_conn_t *conn = (rq_conn_t *) arg;
 
-	assert(fd >= 0);
-	assert(flags != 0);
 	assert(conn);
-	assert(conn->rq);
-	assert(conn->active > 0);
-	assert(flags & EV_READ);
-	
-	rq_process_read(conn);
-}
-
 
+	if (result == EVUTIL_EAI_CANCEL) {
+		// we cancelled it because we are shutting down.
+		conn->resolving = 0;
+		conn->dns_req = NULL;
+		conn->dns_connect = 0;
+	}
+	else {
+		rq_conn_resolved(conn, result, res);
+	}
 
+	if (res) {
+		evutil_freeaddrinfo(res);
+	}
+}
+#endif
 
 
 //-----------------------------------------------------------------------------
-// add a controller to the end of the connection list.   If this is the first
-// controller, then we need to attempt to connect to it, and setup the socket
-// on the event queue.
-void rq_addcontroller(
-	rq_t *rq,
-	char *host,
-	void *connect_handler,
-	void *dropped_handler,
-	void *arg)
+// Look up the address of a controller.  If 'connect' is set, then a connect
+// will be started when it is done.  With the old libevent (which has no
+// asynchronous getaddrinfo) the lookup blocks, so it is best to use
+// addresses rather than names.
+static void rq_conn_resolve(rq_conn_t *conn, int connect)
 {
-	
-	// *(connect_handler)(rq_service_t *service, void *arg)
-	
-	rq_conn_t *conn;
-	
-	assert(rq != NULL);
-	assert(host != NULL);
-	assert(host[0] != 0);
-	assert((arg != NULL && (connect_handler || dropped_handler)) || (arg == NULL));
-
-	// dont currently have it coded to handle these, so we will fail for now
-	// until we find a need to use them.
-	assert(connect_handler == NULL);
-	assert(dropped_handler == NULL);
-	assert(arg == NULL);
+	struct evutil_addrinfo hints;
+#ifndef LIBEVENT_OLD_VER
+	struct evdns_getaddrinfo_request *req;
+#else
+	struct evutil_addrinfo *res;
+	int result;
+#endif
 
-	conn = calloc(1, sizeof(rq_conn_t));
 	assert(conn);
-	
-	conn->hostname = strdup(host);
+	assert(conn->rq);
+	assert(conn->dnshost);
+	assert(conn->dnsport);
 
-	conn->handle = INVALID_HANDLE;		// socket handle to the connected controller.
-	assert(conn->read_event == NULL);
-	assert(conn->write_event == NULL);
-	assert(conn->connect_event == NULL);
+	if (connect) { conn->dns_connect = 1; }
+	if (conn->resolving) {
+		return;
+	}
 
-	assert(conn->readbuf == NULL);
-	assert(conn->inbuf == NULL);
-	conn->outbuf = expbuf_init(NULL, 512);
-	assert(conn->outbuf);
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
 
-	assert(rq->risp);
-	conn->risp = rq->risp;
+	conn->resolving = 1;
 
-	conn->rq = rq;
-	conn->active = 0;
-	conn->shutdown = 0;
-	conn->closing = 0;
-	conn->data = NULL;
+#ifndef LIBEVENT_OLD_VER
+	if (conn->rq->dns == NULL) {
+		assert(conn->rq->evbase);
+#ifdef EVDNS_BASE_DISABLE_WHEN_INACTIVE
+		// the nameserver events are only added while a lookup is outstanding, so
+		// an idle resolver doesnt keep the event loop going.
+		conn->rq->dns = evdns_base_new(conn->rq->evbase, EVDNS_BASE_INITIALIZE_NAMESERVERS | EVDNS_BASE_DISABLE_WHEN_INACTIVE);
+#else
+		conn->rq->dns = evdns_base_new(conn->rq->evbase, 1);
+#endif
+		if (conn->rq->dns == NULL) {
+			// we couldnt set up a resolver (there might not be a resolv.conf), so
+			// it is treated the same as a lookup that failed, and tried again
+			// next time.
+			rq_conn_resolved(conn, EVUTIL_EAI_FAIL, NULL);
+			return;
+		}
+		conn->rq->dns_owned = 1;
+	}
 
-	ll_push_tail(&rq->connlist, conn);
+	hints.ai_flags = EVUTIL_AI_ADDRCONFIG;
+	req = evdns_getaddrinfo(conn->rq->dns, conn->dnshost, conn->dnsport, &hints, rq_dns_handler, conn);
 
-	// if this is the only controller we have so far, then we need to attempt the
-	// connect (non-blocking)
-	if (ll_count(&rq->connlist) == 1) {
-		rq_connect(rq);
+	// the handler might have been called already (if the answer was cached).
+	if (conn->resolving) {
+		conn->dns_req = req;
 	}
+#else
+	res = NULL;
+	result = getaddrinfo(conn->dnshost, conn->dnsport, &hints, &res);
+	rq_conn_resolved(conn, result, res);
+	if (res) {
+		freeaddrinfo(res);
+	}
+#endif
 }
 
 
+//-----------------------------------------------------------------------------
+// Abandon a connect attempt that is still in progress.  The conn stays where
+// it is in the list.
+static void rq_conn_connectabort(rq_conn_t *conn)
+{
+	assert(conn);
+	assert(conn->active == 0);
+	assert(conn->handle != INVALID_HANDLE);
+	assert(conn->connect_event);
+	assert(conn->readbuf == NULL);
+	assert(conn->data == NULL);
 
+	event_free(conn->connect_event);
+	conn->connect_event = NULL;
 
-
-
-
-
+	close(conn->handle);
+	conn->handle = INVALID_HANDLE;
+}
 
 
 //-----------------------------------------------------------------------------
-// Send a request to the controller indicating a desire to consume a particular
-// queue.  We will add queue information to our RQ structure.  If we are
-// already connected to a controller, then the queue request will be sent
-// straight away.  If not, then the request will be made as soon as a
-// connection is made.  
-void rq_consume(
-	rq_t *rq,
-	char *queue,
-	int max,
-	int priority,
-	int exclusive,
-	void (*handler)(rq_message_t *msg, void *arg),
-	void (*accepted)(char *queue, queue_id_t qid, void *arg),
-	void (*dropped)(char *queue, queue_id_t qid, void *arg),
-	void *arg)
+// Assuming that the rq structure has been properlly filled out, this function
+// will initiate the connection process to a specified IP address.   Since the
+// application may be using the event loop for other things, and since we need
+// to support primary and secondary controllers, we need to connect in
+// non-blocking mode.
+//
+// This function will attempt to connect to the first 'connect_parallel'
+// connections at the top of the list, and does nothing while we are connected
+// or still have connect attempts in progress.  To cycle through to a different
+// controller, some other functionality will need to move the top conn to the
+// tail.  This would either be because the controller sent a CLOSING
+// instruction, or the socket connection failed.   This means that if the
+// connection is dropped, that functionality should move the current conn to
+// the tail, and the next connect attempt would be against the alternate
+// controller.
+static void rq_connect(rq_t *rq)
 {
-	int found;
-	rq_queue_t *q;
 	rq_conn_t *conn;
-	
-	assert(rq);
-	assert(queue);
-	assert(strlen(queue) < 256);
-	assert(max >= 0);
-	assert(priority == RQ_PRIORITY_NONE || priority == RQ_PRIORITY_LOW || priority == RQ_PRIORITY_NORMAL || priority == RQ_PRIORITY_HIGH);
-	assert(handler);
+	int busy;
+	int started;
 
-	// check that we are connected to a controller.
+	assert(rq != NULL);
+
+	assert(rq->evbase != NULL);
 	assert(ll_count(&rq->connlist) > 0);
+	assert(rq->connect_parallel > 0);
 
-	// check that we are not already consuming this queue.
-	found = 0;
-	ll_start(&rq->queues);
-	q = ll_next(&rq->queues);
-	while (q && found == 0) {
-		if (strcmp(q->queue, queue) == 0) {
-			// the queue is already in our list...
-			found ++;
-		}
-		else {
-			q = ll_next(&rq->queues);
+	busy = 0;
+	ll_start(&rq->connlist);
+	while (busy == 0 && (conn = ll_next(&rq->connlist))) {
+		if (conn->active > 0 || conn->connect_event || conn->dns_connect) {
+			busy ++;
 		}
 	}
-	ll_finish(&rq->queues);
-
-	if (found == 0) {
-		q = (rq_queue_t *) malloc(sizeof(rq_queue_t));
-		assert(q != NULL);
-
-		rq_queue_init(q);
-		q->queue = strdup(queue);
-		q->handler = handler;
-		q->accepted = accepted;
-		q->dropped = dropped;
-		q->arg = arg;
-		q->exclusive = exclusive;
-		q->max = max;
-		q->priority = priority;
-
-		ll_push_tail(&rq->queues, q);
+	ll_finish(&rq->connlist);
 
-		// check to see if the top connection is active.  If so, send the consume request.
-		conn = ll_get_head(&rq->connlist);
-		assert(conn);
-		if (conn->active > 0 && conn->closing == 0) {
-			rq_send_consume(conn, q);
+	if (busy == 0) {
+		started = 0;
+		ll_start(&rq->connlist);
+		while (started < rq->connect_parallel && (conn = ll_next(&rq->connlist))) {
+			if (conn->shutdown == 0 && conn->closing == 0 && conn->handle == INVALID_HANDLE && conn->dns_connect == 0) {
+				rq_conn_connect(conn);
+				started ++;
+			}
 		}
+		ll_finish(&rq->connlist);
 	}
 }
 
 
 
+//-----------------------------------------------------------------------------
+// This function is called only when we lose a connection to the controller.
+// Since the connection to the controller has failed in some way, we need to
+// move that connection to the tail of the list.
+static void rq_conn_closed(rq_conn_t *conn)
+{
+	rq_message_t *msg;
+	
+	assert(conn);
+	assert(conn->rq);
 
+	// the I/O backend needs to let go of the socket before it is closed.
+	assert(conn->rq->io);
+	conn->rq->io->detach(conn);
+	assert(conn->read_event == NULL);
+	assert(conn->write_event == NULL);
 
+	assert(conn->handle != INVALID_HANDLE);
+	close(conn->handle);
+	conn->handle = INVALID_HANDLE;
+	conn->stats.drops ++;
+	conn->proto_error = 0;
 
+	// free all the buffers.
+	// a partial frame might still be in the read buffer, but it is of no use
+	// now.  (if the backend still had a read outstanding on it, it will have
+	// taken the buffer, and it will be returned when the read finishes)
+	if (conn->readbuf) {
+		conn->readbuf = rq_buf_return(conn->rq, conn->readbuf);
+		assert(conn->readbuf == NULL);
+	}
+	conn->readpos = 0;
 
+	assert(conn->sendbuf);
+	assert(BUF_LENGTH(conn->sendbuf) == 0);
+	conn->sendbuf = rq_buf_return(conn->rq, conn->sendbuf);
+	assert(conn->sendbuf == NULL);
 
+	// acks that didnt get sent dont matter now, the controller will give the
+	// requests to someone else.
+	assert(conn->ackbuf);
+	expbuf_clear(conn->ackbuf);
+	conn->ackbuf = rq_buf_return(conn->rq, conn->ackbuf);
+	assert(conn->ackbuf == NULL);
 
-
-static void cmdClear(void *ptr)
-{
-	rq_conn_t *conn = (rq_conn_t *) ptr;
-	assert(conn);
-	assert(conn->data);
-	
-	conn->data->mask = 0;
-	conn->data->flags = 0;
 	
-	conn->data->id = 0;
-	conn->data->qid = 0;
-	conn->data->timeout = 0;
-	conn->data->priority = 0;
-
-	expbuf_clear(conn->data->queue);
+	rq_outq_clear(conn->rq, &conn->outbuf);
+	if (conn->rq->unwritable) {
+		rq_budget_check(conn->rq);
+	}
 
-	if (conn->data->payload) {
-		expbuf_clear(conn->data->payload);
+	// cleanup the data structure.
+	if (conn->data) {
+		rq_data_free(conn->rq, conn->data);
+		free(conn->data);
+		conn->data = NULL;
+	}
+
+	// remove the conn from the connlist.  It should actually be the highest one in the list, and then put it at the tail of the list.
+	assert(conn->rq);
+	assert(ll_count(&conn->rq->connlist) > 0);
+	if (ll_count(&conn->rq->connlist) > 1) {
+		ll_remove(&conn->rq->connlist, conn);
+		ll_push_tail(&conn->rq->connlist, conn);
+	}
+
+	// clear the events
+	assert(conn->connect_event == NULL);
+	if (conn->hb_event) {
+		event_free(conn->hb_event);
+		conn->hb_event = NULL;
+	}
+	conn->ping_time = 0;
+
+	// the queue-ids were assigned by the controller on this connection, so they
+	// are no longer valid.
+	rq_queue_clearqids(conn->rq);
+	rq_qidcache_clear(conn->rq);
+
+	// any messages that we received on this connection can no longer be
+	// replied to.  The controller will give them to another consumer, so we
+	// detach them from the connection and any reply will be discarded.
+	for (msg = conn->rq->msg_live; msg; msg = msg->live_next) {
+		assert(msg->id >= 0);
+		if (msg->conn == conn) {
+			msg->conn = NULL;
+		}
+	}
+
+	// the late replies for requests that have timed out will never arrive now,
+	// so their ids can be used again.
+	rq_msglist_release_expired(conn->rq);
+
+	// and any requests that we sent on this connection, are either sent again
+	// when we have a new connection, or failed.
+	rq_pending_requeue(conn->rq);
+	
+	conn->active = 0;
+	conn->closing = 0;
+
+	// compression has to be agreed again on the next connection.
+	conn->compress = RQ_COMPRESS_NONE;
+
+	// initiate a connect on the head of the list.
+	assert(conn->rq);
+	rq_connect(conn->rq);
+}
+
+//-----------------------------------------------------------------------------
+// Once something has been added to the outbuffer, this makes sure that it
+// will be sent.  How that happens is up to the I/O backend.  Until the
+// connection is established, the data just waits in the outbuf.
+static void rq_conn_armwrite(rq_conn_t *conn)
+{
+	assert(conn);
+	assert(conn->rq);
+	assert(conn->rq->io);
+	assert(conn->handle != INVALID_HANDLE);
+
+	if (conn->active > 0) {
+		conn->rq->io->armwrite(conn);
 	}
+	rq_budget_check(conn->rq);
 }
 
 
-static void cmdPing(void *ptr)
+//-----------------------------------------------------------------------------
+// libevent backend: If the write event isn't already added, we add it.  Frames
+// queued during the same pass of the event loop are sent together when the
+// write event fires, unless the queue gets large enough that we send it
+// straight away.  While received data is being processed, we dont bother,
+// because it will be flushed when that is done.
+static void rq_levent_armwrite(rq_conn_t *conn)
 {
-	rq_conn_t *conn = (rq_conn_t *) ptr;
-	char buf;
+	assert(conn);
+	assert(conn->rq);
+	assert(conn->handle != INVALID_HANDLE);
+
+	if (conn->active > 0 && conn->write_armed == 0 && conn->in_input == 0) {
+		assert(conn->write_event);
+		event_add(conn->write_event, NULL);
+		conn->write_armed = 1;
+	}
+
+	// if a lot of data has built up, then we dont wait for the write event.  Any
+	// error will be picked up and handled by the write event.
+	if (conn->active > 0 && conn->outbuf.bytes >= RQ_OUT_FLUSH_THRESHOLD) {
+		rq_conn_flush(conn);
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Add an ack for a request to the ones waiting to be sent.  'cmd' is either
+// DELIVERED or UNDELIVERED.  The protocol has no way to ack several ids in
+// one command, so each is still its own frame, but they are all added to the
+// outbuf in one go.
+static void rq_ack_add(rq_conn_t *conn, msg_id_t msgid, risp_command_t cmd)
+{
+	assert(conn);
+	assert(msgid >= 0);
+	assert(cmd == RQ_CMD_DELIVERED || cmd == RQ_CMD_UNDELIVERED);
+	assert(conn->ackbuf);
+
+	addCmd(conn->ackbuf, RQ_CMD_CLEAR);
+	addCmdLargeInt(conn->ackbuf, RQ_CMD_ID, (short int)msgid);
+	addCmd(conn->ackbuf, cmd);
+	conn->stats.frames_out ++;
+}
+
+
+//-----------------------------------------------------------------------------
+// Move the acks that have been collected into the outbuf.  This is done when
+// the read buffer has been processed, and before anything else is added to
+// the outbuf so that the controller always gets the DELIVERED for a request
+// before its REPLY.
+static void rq_ack_flush(rq_conn_t *conn)
+{
+	assert(conn);
+
+	if (conn->ackbuf && BUF_LENGTH(conn->ackbuf) > 0) {
+		assert(conn->rq);
+		assert(conn->handle != INVALID_HANDLE);
+		rq_outq_add(conn->rq, &conn->outbuf, BUF_DATA(conn->ackbuf), BUF_LENGTH(conn->ackbuf));
+		expbuf_clear(conn->ackbuf);
+		rq_conn_armwrite(conn);
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// this function is used internally to send the data to the connected RQ
+// controller.  It will put the data in the outbuffer, and make sure the write
+// event is set.
+static void rq_senddata(rq_conn_t *conn, char *data, int length)
+{
+	assert(conn);
+	assert(data);
+	assert(length > 0);
+	assert(conn->handle != INVALID_HANDLE);
+
+	// any acks that are waiting need to go first.
+	rq_ack_flush(conn);
+
+	// add the new data to the buffer.
+	assert(conn->rq);
+	rq_outq_add(conn->rq, &conn->outbuf, data, length);
+	conn->stats.frames_out ++;
+	rq_conn_armwrite(conn);
+}
+
+
+//-----------------------------------------------------------------------------
+// Send a message to the controller that basically states that this client is
+// closing its connection.  Since we are sending a single command we dont need
+// to go through the expence of gettng a buffer from the bufpool.
+static void rq_send_closing(rq_conn_t *conn)
+{
+	char buf[1];
 	
+	buf[0] = RQ_CMD_CLOSING;
 	assert(conn);
+	rq_senddata(conn, buf, 1);
+}
 
-	// since we only need to send one char, its a bit silly to get an expanding buffer for it... so we'll do this one slightly different.
-	buf = RQ_CMD_PONG;
 
-	rq_senddata(conn, &buf, 1);
+
+//-----------------------------------------------------------------------------
+// Used to tell the library that it needs to start shutting down connections so
+// that the application can exit the loop.
+void rq_shutdown(rq_t *rq)
+{
+	rq_conn_t *conn;
+	int pending;
+	
+	assert(rq);
+
+	rq->shutdown = 1;
+
+	// if we were draining, then we aren't any more.
+	if (rq->draining) {
+		rq->draining = 0;
+		evtimer_del(rq->drain_event);
+	}
+
+	// go thru the connect list, and tell each one that it is shutting down.
+	ll_start(&rq->connlist);
+	while ((conn = ll_next(&rq->connlist))) {
+
+		// Because the list entries may move around while being processed, we may
+		// need to restart the list from the head again.  Therefore we need to
+		// check to see if we have already processed this connection.
+		if (conn->shutdown == 0) {
+			conn->shutdown ++;
+
+			// any lookup of the controller address is no longer needed.
+			conn->dns_connect = 0;
+			if (conn->dns_event) {
+				evtimer_del(conn->dns_event);
+			}
+#ifndef LIBEVENT_OLD_VER
+			if (conn->dns_req) {
+				evdns_getaddrinfo_cancel(conn->dns_req);
+				assert(conn->dns_req == NULL);
+			}
+#endif
+	
+			if (conn->handle != INVALID_HANDLE) {
+	
+				// if we have a handle, but not marked as active, then we must still be connecting.
+				if (conn->active == 0) {
+					assert(conn->closing == 0);
+					
+					// need to close the connection, and remove the connect event.  The
+					// conn doesn't get moved in the list, so we can just carry on.
+					rq_conn_connectabort(conn);
+					assert(conn->closing == 0);
+				}
+				else {
+					assert(conn->active > 0);
+					assert(conn->connect_event == NULL);
+					
+					// send 'closing' message to each connected controller.  This should remove the node from any queues it is consuming.
+					rq_send_closing(conn);
+	
+					assert(conn->closing == 0);
+					conn->closing ++;
+				
+					// we need to wait if we are still processing some messages from a queue being consumed.
+					pending = rq->msg_used;
+
+					// close connections if there are no messages waiting to be processed on it.
+					if (pending == 0) {
+						rq_conn_closed(conn);
+						assert(conn->closing == 0);
+						
+						// closing the connection would have moved the conns around in the
+						// list, so we need to reset the 'next'.  This means the loop will
+						// restart again, but we wont process the ones that we have already
+						// marked as 'shutdown'
+						ll_finish(&rq->connlist);
+						ll_start(&rq->connlist);
+					}
+				}
+			}
+		}
+	}
+	ll_finish(&rq->connlist);
+
+#ifndef LIBEVENT_OLD_VER
+	// nothing else will be looked up now, and the resolver we created has
+	// events of its own that would keep the event loop going.
+	if (rq->dns && rq->dns_owned) {
+		evdns_base_free(rq->dns, 0);
+		rq->dns = NULL;
+		rq->dns_owned = 0;
+	}
+#endif
+
+	// since we are shutting down, anything that hasn't been sent yet never
+	// will be.
+	rq_pending_failall(rq);
+	if (rq->full_paused) {
+		evtimer_del(rq->full_event);
+		rq->full_paused = 0;
+	}
+
+	// the worker event is persistent, so the event loop cant exit while it is
+	// added.  It is removed once the workers have nothing left.
+	if (rq->workers > 0 && rq->worker_inflight == 0 && rq->worker_backlog == 0) {
+		event_del(rq->worker_event);
+	}
+
+	// the same goes for any events the I/O backend has of its own.
+	if (rq->io->shutdown) {
+		rq->io->shutdown(rq);
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Draining.
+//
+// rq_drain() is a gentler rq_shutdown().  All the queues are cancelled, so we
+// stop getting new requests, but the ones we already have are given until
+// the deadline to be replied to, and the requests we have sent are given the
+// same time to get their replies.  Once that has all been written to the
+// controller (or the deadline has passed), the connections are closed the
+// same as rq_shutdown(), except that we dont wait for the controller to drop
+// them.  The handler is given the progress every RQ_DRAIN_INTERVAL, and once
+// more when it is done.
+//
+// Requests that were still unreplied when the connection was closed can
+// still be given to rq_reply() (the reply goes nowhere), and anything left is
+// released by rq_cleanup().
+
+
+//-----------------------------------------------------------------------------
+// Work out what we are still waiting for.
+static void rq_drain_progress(rq_t *rq, rq_drain_t *drain)
+{
+	rq_message_t *msg;
+	rq_conn_t *conn;
+
+	assert(rq);
+	assert(drain);
+
+	memset(drain, 0, sizeof(*drain));
+	for (msg = rq->msg_live; msg; msg = msg->live_next) {
+		if (msg->src_id >= 0) { drain->inflight ++; }
+		else if (msg->state != rq_msgstate_new) { drain->outstanding ++; }
+	}
+
+	ll_start(&rq->connlist);
+	while ((conn = ll_next(&rq->connlist))) {
+		if (conn->active > 0) {
+			drain->outbound += conn->outbuf.bytes;
+			if (conn->ackbuf) { drain->outbound += BUF_LENGTH(conn->ackbuf); }
+			if (rq->io->unsent) { drain->outbound += rq->io->unsent(conn); }
+		}
+	}
+	ll_finish(&rq->connlist);
+
+	drain->elapsed = (rq_now() - rq->drain_start) / 1000;
+}
+
+
+//-----------------------------------------------------------------------------
+// rq_shutdown() will leave a connection open if it still has messages, for
+// the controller to close.  At the end of a drain there is nothing more we
+// are going to wait for, so we close them ourselves.  We try to get the
+// CLOSING out first, unless the I/O backend is still in the middle of a
+// write.
+static void rq_drain_close(rq_t *rq)
+{
+	rq_conn_t *conn;
+
+	assert(rq);
+	assert(rq->io);
+
+	ll_start(&rq->connlist);
+	while ((conn = ll_next(&rq->connlist))) {
+		if (conn->handle != INVALID_HANDLE && conn->closing > 0) {
+			if (conn->outbuf.bytes > 0 && (rq->io->unsent == NULL || rq->io->unsent(conn) == 0)) {
+				rq_conn_flush(conn);
+			}
+			rq_conn_closed(conn);
+			assert(conn->closing == 0);
+
+			// the conns will have moved around in the list.
+			ll_finish(&rq->connlist);
+			ll_start(&rq->connlist);
+		}
+	}
+	ll_finish(&rq->connlist);
+
+	// the requests we had sent were put back on the pending list when their
+	// connection closed, but they will never be sent now.
+	rq_pending_failall(rq);
+}
+
+
+static void rq_drain_handler(int fd, short int flags, void *arg)
+{
+	rq_t *rq = (rq_t *) arg;
+	rq_drain_t drain;
+	struct timeval tv;
+	uint64_t now, wait;
+
+	assert(rq);
+	assert(rq->draining);
+	assert(rq->drain_event);
+
+	rq_drain_progress(rq, &drain);
+	now = rq_now();
+
+	if (drain.inflight == 0 && drain.outstanding == 0 && drain.outbound == 0) {
+		drain.done = 1;
+	}
+	else if (rq->drain_deadline > 0 && now >= rq->drain_deadline) {
+		drain.done = 1;
+		drain.timedout = 1;
+		drain.abandoned = drain.inflight + drain.outstanding;
+	}
+
+	if (drain.done) {
+		rq->draining = 0;
+		if (rq->drain_handler) {
+			rq->drain_handler(rq, &drain, rq->drain_arg);
+		}
+		if (rq->shutdown == 0) {
+			rq_shutdown(rq);
+		}
+		rq_drain_close(rq);
+		return;
+	}
+
+	if (now >= rq->drain_report) {
+		rq->drain_report = now + (RQ_DRAIN_INTERVAL * 1000);
+		if (rq->drain_handler) {
+			rq->drain_handler(rq, &drain, rq->drain_arg);
+
+			// the handler might have shut us down itself.
+			if (rq->draining == 0) {
+				return;
+			}
+		}
+	}
+
+	// if all we are waiting for is the data to be written, it wont be long.
+	if (drain.inflight == 0 && drain.outstanding == 0) { wait = RQ_DRAIN_FLUSH_INTERVAL * 1000; }
+	else { wait = RQ_DRAIN_INTERVAL * 1000; }
+	if (rq->drain_deadline > 0 && rq->drain_deadline - now < wait) {
+		wait = rq->drain_deadline - now;
+	}
+	tv.tv_sec = wait / 1000000;
+	tv.tv_usec = wait % 1000000;
+	evtimer_add(rq->drain_event, &tv);
+}
+
+
+//-----------------------------------------------------------------------------
+// Something we might have been waiting for has finished, so have a look now
+// rather than waiting for the timer.  This is called from deep inside the
+// processing, so we dont do it directly.
+static void rq_drain_wake(rq_t *rq)
+{
+	assert(rq);
+	assert(rq->draining);
+	assert(rq->drain_event);
+
+	event_active(rq->drain_event, EV_TIMEOUT, 1);
+}
+
+
+//-----------------------------------------------------------------------------
+// Start draining.  'timeout' is the most (in milliseconds) we will wait for
+// the requests to finish (0 to wait as long as it takes).  The handler can be
+// NULL.
+void rq_drain(rq_t *rq, int timeout, void (*handler)(rq_t *rq, const rq_drain_t *drain, void *arg), void *arg)
+{
+	rq_queue_t *q;
+	struct timeval tv;
+
+	assert(rq);
+	assert(rq->evbase);
+	assert(timeout >= 0);
+	assert(rq->draining == 0);
+	assert(rq->shutdown == 0);
+
+	ll_start(&rq->queues);
+	while ((q = ll_next(&rq->queues))) {
+		rq_queue_cancel(rq, q);
+	}
+	ll_finish(&rq->queues);
+
+	rq->draining = 1;
+	rq->drain_start = rq_now();
+	rq->drain_deadline = (timeout > 0) ? rq->drain_start + ((uint64_t) timeout * 1000) : 0;
+	rq->drain_report = rq->drain_start + (RQ_DRAIN_INTERVAL * 1000);
+	rq->drain_handler = handler;
+	rq->drain_arg = arg;
+
+	if (rq->drain_event == NULL) {
+		rq->drain_event = evtimer_new(rq->evbase, rq_drain_handler, rq);
+		assert(rq->drain_event);
+	}
+
+	// there might not be anything to wait for.
+	tv.tv_sec = 0;
+	tv.tv_usec = 0;
+	evtimer_add(rq->drain_event, &tv);
+}
+
+
+void rq_cleanup(rq_t *rq)
+{
+	rq_queue_t *q;
+	rq_conn_t *conn;
+	rq_message_t *msg;
+	
+	assert(rq != NULL);
+
+	if (rq->workers > 0) {
+		rq_workers_stop(rq);
+	}
+
+	// anything left in the message table is released.  These are requests we
+	// received that were never replied to (eg, a drain that timed out), or
+	// messages that were never sent.  They must not be used after this.
+	while ((msg = rq->msg_live)) {
+		assert(msg->conn == NULL);
+		if (msg->state == rq_msgstate_pending) {
+			rq_pending_remove(rq, msg);
+		}
+		if (msg->reply) {
+			msg->reply = expbuf_free(msg->reply);
+			assert(msg->reply == NULL);
+		}
+		rq_msg_clear(msg);
+	}
+
+	if (rq->drain_event) {
+		event_free(rq->drain_event);
+		rq->drain_event = NULL;
+	}
+
+	// cleanup the risp object.
+	assert(rq->risp != NULL);
+	rq->risp = risp_shutdown(rq->risp);
+	assert(rq->risp == NULL);
+
+	// free the resources allocated for the connlist.
+	while ((conn = ll_pop_head(&rq->connlist))) {
+		assert(conn->handle == INVALID_HANDLE);
+		assert(conn->active == 0);
+		assert(conn->closing == 0);
+		assert(conn->shutdown > 0);
+
+		assert(conn->read_event == NULL);
+		assert(conn->write_event == NULL);
+		assert(conn->connect_event == NULL);
+
+		rq_outq_clear(conn->rq, &conn->outbuf);
+		
+		conn->rq = NULL;
+		conn->risp = NULL;
+	
+		assert(conn->hostname);
+		free(conn->hostname);
+		conn->hostname = NULL;
+
+		assert(conn->dns_req == NULL);
+		if (conn->dns_event) {
+			event_free(conn->dns_event);
+			conn->dns_event = NULL;
+		}
+		if (conn->dnshost) {
+			free(conn->dnshost);
+			free(conn->dnsport);
+			conn->dnshost = NULL;
+			conn->dnsport = NULL;
+		}
+
+		assert(conn->readbuf == NULL);
+		assert(conn->data == NULL);
+	}
+	assert(ll_count(&rq->connlist) == 0);
+	ll_free(&rq->connlist);
+
+	// the I/O backend might still be holding some buffers, so it needs to be
+	// done with before the bufpool.
+	assert(rq->io);
+	if (rq->io->cleanup) {
+		rq->io->cleanup(rq);
+	}
+	rq->io = &rq_io_libevent;
+	rq->io_data = NULL;
+
+#ifndef LIBEVENT_OLD_VER
+	if (rq->dns && rq->dns_owned) {
+		evdns_base_free(rq->dns, 0);
+	}
+#endif
+	rq->dns = NULL;
+
+	rq_setcompressdict(rq, NULL, 0);
+#ifdef RQ_WITH_ZSTD
+	if (rq->zstd_cctx) { ZSTD_freeCCtx(rq->zstd_cctx); }
+	if (rq->zstd_dctx) { ZSTD_freeDCtx(rq->zstd_dctx); }
+#endif
+	rq->zstd_cctx = NULL;
+	rq->zstd_dctx = NULL;
+	if (rq->compress_buf) {
+		rq->compress_buf = expbuf_free(rq->compress_buf);
+		assert(rq->compress_buf == NULL);
+	}
+
+	// cleanup all the queues that we have.
+	while ((q = ll_pop_head(&rq->queues))) {
+		rq_queue_free(q);
+		free(q);
+	}
+
+	if (rq->queue_index) {
+		free(rq->queue_index);
+		rq->queue_index = NULL;
+	}
+	rq->queue_index_max = 0;
+	memset(rq->queue_hash, 0, sizeof(rq->queue_hash));
+	rq_qidcache_clear(rq);
+
+	assert(rq->msg_list);
+	assert(rq->msg_used == 0);
+	assert(rq->msg_live == NULL);
+	assert(rq->pending_head == NULL);
+	assert(rq->wheel_count == 0);
+	rq_msglist_release_expired(rq);
+	if (rq->wheel_event) {
+		event_free(rq->wheel_event);
+		rq->wheel_event = NULL;
+	}
+	if (rq->full_event) {
+		event_free(rq->full_event);
+		rq->full_event = NULL;
+	}
+	rq_setlatency(rq, 0);
+	while (rq->msg_max > 0) {
+		rq->msg_max --;
+		assert(rq->msg_list[rq->msg_max].msg == NULL);
+	}
+	free(rq->msg_list);
+	rq->msg_list = NULL;
+	rq->msg_next = -1;
+
+
+	// cleanup the msgpool
+	assert(rq->msg_pool);
+	while ((msg = ll_pop_head(rq->msg_pool))) {
+		free(msg);
+	}
+	ll_free(rq->msg_pool);
+	free(rq->msg_pool);
+	rq->msg_pool = NULL;
+
+	// cleanup the bufpool
+	rq_bufpool_free(&rq->bufpool);
+}
+
+
+void rq_setevbase(rq_t *rq, struct event_base *base)
+{
+	assert(rq);
+
+	if (base) {
+		assert(rq->evbase == NULL);
+		rq->evbase = base;
+	}
+	else {
+		assert(rq->evbase);
+		rq->evbase = NULL;
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Enable or disable zero-copy delivery of incoming payloads.  When enabled,
+// the data of a message given to a queue handler or a reply handler points
+// directly into the read buffer of the connection, and is only valid until
+// the handler returns.  A handler that wants to reply later, and still needs
+// the payload, must call rq_msg_retain() before it returns.
+void rq_setzerocopy(rq_t *rq, int enabled)
+{
+	assert(rq);
+	assert(enabled == 0 || enabled == 1);
+	rq->zerocopy = enabled;
+}
+
+
+//-----------------------------------------------------------------------------
+// Set the high-water mark of the buffer pool.  This is the maximum number of
+// free buffers that will be kept for each size class.  Any buffers already in
+// the pool are released.
+void rq_setbufpool(rq_t *rq, int max)
+{
+	assert(rq);
+	assert(max >= 0);
+
+	rq_bufpool_free(&rq->bufpool);
+	rq_bufpool_init(&rq->bufpool, max);
+}
+
+//-----------------------------------------------------------------------------
+// Return the number of buffer requests that were satisfied from the pool, and
+// the number that needed a new allocation.
+void rq_bufpool_stats(rq_t *rq, unsigned int *hits, unsigned int *misses)
+{
+	assert(rq);
+
+	if (hits)   { *hits = rq->bufpool.hits; }
+	if (misses) { *misses = rq->bufpool.misses; }
+}
+
+
+//-----------------------------------------------------------------------------
+// Would adding 'adding' bytes to the message or buffer pool put them over the
+// pool budget?
+static int rq_pool_over(rq_t *rq, int adding)
+{
+	assert(rq);
+	assert(adding > 0);
+
+	if (rq->budget_pool == 0) {
+		return(0);
+	}
+
+	assert(rq->msg_pool);
+	return((rq->bufpool.bytes + (ll_count(rq->msg_pool) * sizeof(rq_message_t)) + adding) > rq->budget_pool);
+}
+
+
+//-----------------------------------------------------------------------------
+// See if we have gone over (or come back under) the conn or send budget, and
+// if so, tell the writable handler.  The budget is the high watermark, and we
+// are writable again once we are down to half of it.
+static void rq_budget_check(rq_t *rq)
+{
+	rq_conn_t *conn;
+	int queued, held, over, under;
+
+	assert(rq);
+
+	if (rq->budget_conn == 0 && rq->budget_send == 0) {
+		return;
+	}
+
+	// only the connection at the head of the list is used for sending.
+	queued = 0;
+	conn = ll_get_head(&rq->connlist);
+	if (conn && conn->handle != INVALID_HANDLE) {
+		queued = conn->outbuf.bytes;
+		assert(rq->io);
+		if (rq->io->unsent) {
+			queued += rq->io->unsent(conn);
+		}
+	}
+	held = rq->held_bytes + queued;
+
+	over = (rq->budget_conn > 0 && queued >= rq->budget_conn) || (rq->budget_send > 0 && held >= rq->budget_send);
+	under = (rq->budget_conn == 0 || queued <= rq->budget_conn / 2) && (rq->budget_send == 0 || held <= rq->budget_send / 2);
+
+	if (rq->unwritable == 0 && over) {
+		rq->unwritable = 1;
+		if (rq->writable_handler) {
+			rq->writable_handler(rq, 0, rq->writable_arg);
+		}
+	}
+	else if (rq->unwritable && under) {
+		rq->unwritable = 0;
+		if (rq->writable_handler) {
+			rq->writable_handler(rq, 1, rq->writable_arg);
+		}
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Set the memory budgets (in bytes, 0 for no limit).
+//
+//	conn_bytes - data queued to be written to the controller.
+//	send_bytes - the payloads of the requests we have sent (which are kept
+//	             until the reply arrives, or they fail), plus the data queued
+//	             on the connection.
+//	pool_bytes - free messages and buffers kept in the pools for re-use.
+//
+// The conn and send budgets are not hard limits.  Going over either one makes
+// us 'unwritable' (see rq_setwritable), and rq_trysend() will refuse requests
+// until we are back down to half of it.  rq_send() still takes them.  The
+// pool budget is a hard limit, memory which would go over it is freed instead.
+void rq_setbudget(rq_t *rq, int conn_bytes, int send_bytes, int pool_bytes)
+{
+	assert(rq);
+	assert(conn_bytes >= 0);
+	assert(send_bytes >= 0);
+	assert(pool_bytes >= 0);
+
+	rq->budget_conn = conn_bytes;
+	rq->budget_send = send_bytes;
+	rq->budget_pool = pool_bytes;
+
+	if (conn_bytes == 0 && send_bytes == 0 && rq->unwritable) {
+		rq->unwritable = 0;
+		if (rq->writable_handler) {
+			rq->writable_handler(rq, 1, rq->writable_arg);
+		}
+	}
+	else {
+		rq_budget_check(rq);
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Set the handler that is called with 'writable' set to 0 when we go over
+// the conn or send budget, and 1 when we are back under it.  The handler is
+// called from inside the library, so it should only note the change (or use
+// rq_trysend), and not shutdown or cleanup the rq_t.
+void rq_setwritable(rq_t *rq, void (*handler)(rq_t *rq, int writable, void *arg), void *arg)
+{
+	assert(rq);
+	assert((arg == NULL) || handler);
+
+	rq->writable_handler = handler;
+	rq->writable_arg = arg;
+}
+
+
+//-----------------------------------------------------------------------------
+// Get the counters for a queue being consumed.  'held' is the number of
+// requests currently being handled, and 'refused' is the number that were
+// given back because we were already handling 'max'.  Returns -1 if we are not
+// consuming the queue.
+int rq_queue_stats(rq_t *rq, char *queue, rq_queuestats_t *stats)
+{
+	rq_queue_t *q;
+
+	assert(rq);
+	assert(queue);
+	assert(stats);
+
+	q = rq_queue_find(rq, queue);
+	if (q == NULL) {
+		return(-1);
+	}
+
+	*stats = q->stats;
+	stats->held = q->held;
+	return(0);
+}
+
+
+//-----------------------------------------------------------------------------
+// Return the queue-id the controller has given the queue on the current
+// connection, or 0 if it hasn't.  Requests to queues with a known id are sent
+// with the id instead of the name.
+queue_id_t rq_queue_lookup(rq_t *rq, const char *queue)
+{
+	assert(rq);
+	assert(queue);
+
+	return(rq_qidcache_find(rq, queue));
+}
+
+
+//-----------------------------------------------------------------------------
+// Take a snapshot of the statistics for the rq_t.  Like everything else, this
+// needs to be called from the thread running the event loop.
+void rq_stats(rq_t *rq, rq_stats_t *stats)
+{
+	rq_conn_t *conn;
+
+	assert(rq);
+	assert(stats);
+
+	*stats = rq->stats;
+	memset(&stats->conn, 0, sizeof(stats->conn));
+
+	ll_start(&rq->connlist);
+	while ((conn = ll_next(&rq->connlist))) {
+		stats->conn.bytes_in += conn->stats.bytes_in;
+		stats->conn.bytes_out += conn->stats.bytes_out;
+		stats->conn.frames_in += conn->stats.frames_in;
+		stats->conn.frames_out += conn->stats.frames_out;
+		stats->conn.connects += conn->stats.connects;
+		stats->conn.connect_fails += conn->stats.connect_fails;
+		stats->conn.drops += conn->stats.drops;
+		if (conn->stats.outbuf_peak > stats->conn.outbuf_peak) {
+			stats->conn.outbuf_peak = conn->stats.outbuf_peak;
+		}
+	}
+	ll_finish(&rq->connlist);
+
+	conn = ll_get_head(&rq->connlist);
+	stats->outbuf_bytes = conn ? conn->outbuf.bytes : 0;
+	stats->pending_bytes = rq->pending_bytes;
+
+	stats->msg_used = rq->msg_used;
+	stats->msg_max = rq->msg_max;
+	stats->bufpool_hits = rq->bufpool.hits;
+	stats->bufpool_misses = rq->bufpool.misses;
+
+	stats->held_bytes = rq->held_bytes;
+	stats->pool_bytes = rq->bufpool.bytes + (ll_count(rq->msg_pool) * sizeof(rq_message_t));
+}
+
+
+//-----------------------------------------------------------------------------
+// Get the counters for one of the controllers, in the order they are
+// currently in.  The first one is the one we are connected to (or trying to
+// connect to).  Returns -1 if there aren't that many controllers.
+int rq_stats_controller(rq_t *rq, int index, const char **host, rq_connstats_t *stats)
+{
+	rq_conn_t *conn;
+	int i;
+
+	assert(rq);
+	assert(index >= 0);
+	assert(stats);
+
+	i = 0;
+	ll_start(&rq->connlist);
+	while ((conn = ll_next(&rq->connlist)) && i < index) {
+		i++;
+	}
+	ll_finish(&rq->connlist);
+
+	if (conn == NULL) {
+		return(-1);
+	}
+
+	if (host) { *host = conn->hostname; }
+	*stats = conn->stats;
+	return(0);
+}
+
+
+//-----------------------------------------------------------------------------
+// Turn on (or off) measuring the time from rq_send() until the reply is
+// received.  Turning it on again starts a new histogram.
+void rq_setlatency(rq_t *rq, int enabled)
+{
+	assert(rq);
+
+	if (enabled) {
+		if (rq->latency == NULL) {
+			rq->latency = (rq_hist_t *) malloc(sizeof(rq_hist_t));
+			assert(rq->latency);
+		}
+		memset(rq->latency, 0, sizeof(rq_hist_t));
+	}
+	else if (rq->latency) {
+		free(rq->latency);
+		rq->latency = NULL;
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Copy the latency histogram.  Returns -1 if latency isn't being measured.
+int rq_latency(rq_t *rq, rq_hist_t *hist)
+{
+	assert(rq);
+	assert(hist);
+
+	if (rq->latency == NULL) {
+		return(-1);
+	}
+
+	*hist = *rq->latency;
+	return(0);
+}
+
+
+//-----------------------------------------------------------------------------
+// Return the bucket of the histogram that a value belongs in.
+static int rq_hist_index(uint64_t value)
+{
+	int bits, index;
+
+	if (value < RQ_HIST_SUB) {
+		return((int) value);
+	}
+
+	// the position of the top bit decides the power of 2, and the next 3 bits
+	// decide which of the linear buckets within it.
+	bits = 63 - __builtin_clzll(value);
+	index = ((bits - 2) * RQ_HIST_SUB) + (int) ((value >> (bits - 3)) & (RQ_HIST_SUB - 1));
+	if (index >= RQ_HIST_BUCKETS) {
+		index = RQ_HIST_BUCKETS - 1;
+	}
+	return(index);
+}
+
+//-----------------------------------------------------------------------------
+// Return the lowest value that goes in a bucket of the histogram.
+static uint64_t rq_hist_value(int index)
+{
+	int bits;
+
+	assert(index >= 0 && index < RQ_HIST_BUCKETS);
+
+	if (index < RQ_HIST_SUB) {
+		return(index);
+	}
+
+	bits = (index / RQ_HIST_SUB) + 2;
+	return(((uint64_t) RQ_HIST_SUB + (index % RQ_HIST_SUB)) << (bits - 3));
+}
+
+static void rq_hist_add(rq_hist_t *hist, uint64_t value)
+{
+	assert(hist);
+
+	hist->count[rq_hist_index(value)] ++;
+	hist->total ++;
+	hist->sum += value;
+	if (value > hist->max) { hist->max = value; }
+}
+
+
+//-----------------------------------------------------------------------------
+// Return the value (in microseconds) that 'percentile' percent of the
+// entries in the histogram are below.  The value is the start of the bucket,
+// so it can be up to 12.5% lower than the actual values.
+uint64_t rq_hist_percentile(const rq_hist_t *hist, double percentile)
+{
+	uint64_t want, seen;
+	int i;
+
+	assert(hist);
+	assert(percentile >= 0 && percentile <= 100);
+
+	if (hist->total == 0) {
+		return(0);
+	}
+
+	want = (uint64_t) ((percentile / 100.0) * hist->total);
+	if (want >= hist->total) { want = hist->total - 1; }
+
+	seen = 0;
+	for (i=0; i<RQ_HIST_BUCKETS; i++) {
+		seen += hist->count[i];
+		if (seen > want) {
+			return(rq_hist_value(i));
+		}
+	}
+
+	return(hist->max);
+}
+
+
+
+
+
+//-----------------------------------------------------------------------------
+// Look at the partial frame that is left in the buffer after processing.  If
+// it starts with a PAYLOAD command that we have the length header for, then
+// we know how big the command will be when it has all arrived, and can size
+// the buffers for it.  Returns 0 if we dont know.  The header is the same as
+// produced by rq_addlargestr_header().
+static int rq_partial_size(const char *data, int length)
+{
+	uint32_t nlen;
+
+	assert(data);
+	assert(length > 0);
+
+	if ((unsigned char) data[0] == RQ_CMD_PAYLOAD && length >= 1 + (int) sizeof(nlen)) {
+		memcpy(&nlen, data + 1, sizeof(nlen));
+		return(1 + sizeof(nlen) + ntohl(nlen));
+	}
+	else {
+		return(0);
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Make sure the read buffer can hold at least 'size' bytes in total.
+static void rq_readbuf_reserve(rq_conn_t *conn, int size)
+{
+	assert(conn);
+	assert(conn->readbuf);
+
+	if (size > BUF_MAX(conn->readbuf)) {
+		expbuf_shrink(conn->readbuf, size - BUF_LENGTH(conn->readbuf));
+		assert(BUF_MAX(conn->readbuf) >= size);
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Move the unprocessed data to the front of the read buffer.  We only do this
+// when we have run out of room at the tail, so most of the time a partial
+// frame is never moved.
+static void rq_readbuf_compact(rq_conn_t *conn)
+{
+	int leftover;
+
+	assert(conn);
+	assert(conn->readbuf);
+	assert(conn->readpos >= 0 && conn->readpos <= BUF_LENGTH(conn->readbuf));
+
+	if (conn->readpos > 0) {
+		leftover = BUF_LENGTH(conn->readbuf) - conn->readpos;
+		if (leftover > 0) {
+			memmove(BUF_DATA(conn->readbuf), BUF_DATA(conn->readbuf) + conn->readpos, leftover);
+		}
+		BUF_LENGTH(conn->readbuf) = leftover;
+		conn->readpos = 0;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// After a read has been processed, get the read buffer ready for the next read.
+// There must always be some room at the tail when we are done.
+//
+//  * If the read filled the buffer, we double it (up to readbuf_max).
+//  * If a partial frame is left, and we know how big it will be, we make sure
+//    it will fit without being moved again.  Otherwise, if we are out of room
+//    at the tail, we move it to the front, and grow the buffer if it still
+//    doesnt fit.
+//  * If we've had a lot of small reads in a row and there is nothing left
+//    over, we shrink it back down.
+static void rq_readbuf_adjust(rq_conn_t *conn, int res, int avail)
+{
+	rq_t *rq;
+	int leftover, needed, size;
+
+	assert(conn);
+	assert(conn->rq);
+	assert(conn->readbuf);
+	assert(res > 0 && res <= avail);
+	rq = conn->rq;
+
+	leftover = BUF_LENGTH(conn->readbuf) - conn->readpos;
+	assert(leftover >= 0);
+	if (leftover == 0) {
+		// everything has been processed, so we can start at the front again.
+		BUF_LENGTH(conn->readbuf) = 0;
+		conn->readpos = 0;
+	}
+
+	if (res == avail) {
+		conn->read_small = 0;
+		if (BUF_MAX(conn->readbuf) < rq->readbuf_max) {
+			size = BUF_MAX(conn->readbuf) * 2;
+			if (size > rq->readbuf_max) { size = rq->readbuf_max; }
+			rq_readbuf_reserve(conn, size);
+		}
+	}
+	else if (leftover == 0 && BUF_MAX(conn->readbuf) > rq->readbuf_init && res < BUF_MAX(conn->readbuf) / 4) {
+		conn->read_small ++;
+		if (conn->read_small >= rq->readbuf_shrink) {
+			conn->read_small = 0;
+			conn->readbuf = rq_buf_return(rq, conn->readbuf);
+			conn->readbuf = rq_buf_get(rq, rq->readbuf_init);
+			assert(conn->readbuf);
+		}
+	}
+	else {
+		conn->read_small = 0;
+	}
+
+	if (leftover > 0) {
+		needed = rq_partial_size(BUF_DATA(conn->readbuf) + conn->readpos, leftover);
+		if (needed > 0) {
+			// we know how big the frame is, so make sure all of it will fit.
+			if (conn->readpos + needed > BUF_MAX(conn->readbuf)) {
+				rq_readbuf_compact(conn);
+				rq_readbuf_reserve(conn, needed);
+			}
+		}
+		else if (BUF_LENGTH(conn->readbuf) == BUF_MAX(conn->readbuf)) {
+			rq_readbuf_compact(conn);
+			if (BUF_LENGTH(conn->readbuf) == BUF_MAX(conn->readbuf)) {
+				rq_readbuf_reserve(conn, BUF_MAX(conn->readbuf) * 2);
+			}
+		}
+	}
+
+	assert(BUF_MAX(conn->readbuf) > BUF_LENGTH(conn->readbuf));
+}
+
+
+//-----------------------------------------------------------------------------
+// 'res' bytes have been read into the tail of the read buffer (where there
+// was room for 'avail').  Process everything that we have, and get the buffer
+// ready for the next read.
+static void rq_conn_input(rq_conn_t *conn, int res, int avail)
+{
+	int processed;
+
+	assert(conn);
+	assert(conn->rq);
+	assert(conn->risp);
+	assert(conn->readbuf);
+	assert(res > 0 && res <= avail);
+
+	if (conn->rq->sock_flags & RQ_SOCKET_QUICKACK) { rq_conn_sockopts(conn, 1); }
+	BUF_LENGTH(conn->readbuf) += res;
+	conn->stats.bytes_in += res;
+	assert(BUF_LENGTH(conn->readbuf) <= BUF_MAX(conn->readbuf));
+
+	// process everything that hasn't been processed yet.
+	assert(conn->in_input == 0);
+	conn->in_input = 1;
+#ifdef RQ_RISP_INLINE
+	processed = rq_risp_process(conn, BUF_LENGTH(conn->readbuf) - conn->readpos, (unsigned char *) BUF_DATA(conn->readbuf) + conn->readpos);
+#else
+	processed = risp_process(conn->risp, conn, BUF_LENGTH(conn->readbuf) - conn->readpos, (unsigned char *) BUF_DATA(conn->readbuf) + conn->readpos);
+#endif
+	assert(processed >= 0);
+	assert(processed <= BUF_LENGTH(conn->readbuf) - conn->readpos);
+	conn->readpos += processed;
+
+	// if the controller sent us something we cant read, then we cant trust the
+	// rest of what it sends either.
+	if (conn->proto_error) {
+		conn->in_input = 0;
+		rq_conn_closed(conn);
+		assert(conn->readbuf == NULL);
+		return;
+	}
+
+	// send the acks for all the requests we just got, along with any replies
+	// that the handlers have already given us.
+	rq_ack_flush(conn);
+	conn->in_input = 0;
+	if (conn->outbuf.bytes > 0 && conn->rq->io->flush) {
+		conn->rq->io->flush(conn);
+	}
+
+	// the buffer is about to be re-used, so any payload that is still
+	// pointing into it needs to be copied.
+	if (conn->data) { rq_data_settle(conn->rq, conn->data); }
+
+	rq_readbuf_adjust(conn, res, avail);
+}
+
+
+//-----------------------------------------------------------------------------
+// this function is an internal one that is used to read data from the socket.
+// It is assumed that we are pretty sure that there is data to be read (or the
+// socket has been closed).  Data is read straight into the tail of the read
+// buffer, and processed from there.
+static void rq_process_read(rq_conn_t *conn)
+{
+	int res, empty, avail;
+	
+	assert(conn);
+	assert(conn->rq);
+	assert(conn->risp);
+	assert(conn->readbuf);
+	
+	empty = 0;
+	while (empty == 0) {
+		assert(conn->handle != INVALID_HANDLE && conn->handle > 0);
+		assert(BUF_DATA(conn->readbuf) != NULL  && BUF_MAX(conn->readbuf) > 0);
+		assert(conn->readpos >= 0 && conn->readpos <= BUF_LENGTH(conn->readbuf));
+
+		avail = BUF_MAX(conn->readbuf) - BUF_LENGTH(conn->readbuf);
+		assert(avail > 0);
+		
+		res = read(conn->handle, BUF_DATA(conn->readbuf) + BUF_LENGTH(conn->readbuf), avail);
+		if (res > 0) {
+			// if we filled the space we had avail in our buffer, that means there
+			// is probably more waiting.
+			if (res < avail) { empty = 1; }
+
+			// the connection is closed if what we read couldnt be processed.
+			rq_conn_input(conn, res, avail);
+			if (conn->readbuf == NULL) { empty = 1; }
+		}
+		else {
+			empty = 1;
+			
+			if (res == 0) {
+				rq_conn_closed(conn);
+				assert(conn->readbuf == NULL);
+			}
+			else {
+				assert(res == -1);
+				if (errno != EAGAIN && errno != EWOULDBLOCK) {
+					rq_conn_closed(conn);
+					assert(conn->readbuf == NULL);
+				}
+				else {
+					assert(conn->readbuf);
+				}
+			}
+		}
+	}
+
+}
+
+
+
+
+static void rq_write_handler(int fd, short int flags, void *arg)
+{
+	rq_conn_t *conn = (rq_conn_t *) arg;
+	int res;
+
+	assert(fd >= 0);
+	assert(flags != 0);
+	assert(conn);
+	assert(conn->rq);
+	assert(conn->handle == fd);
+	assert(conn->active > 0);
+	assert(flags & EV_WRITE);
+	assert(conn->write_event);
+
+	// the queue may have already been flushed if it got large.
+	if (conn->outbuf.bytes > 0) {
+		
+// 		printf("rq_write_handler: attempting to send %d bytes for socket: %d\n", conn->outbuf.bytes, fd);
+	
+		// send the data that is waiting in the outbuffer.
+		res = rq_conn_flush(conn);
+		if (res == 0 || (res == -1 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+// 			printf("rq_write_handler: closing socket %d.\n", fd);
+			rq_conn_closed(conn);
+			assert(conn->write_event == NULL);
+			assert(conn->write_armed == 0);
+			return;
+		}
+	}
+
+	// if we dont have any more to send, then we need to remove the WRITE event.
+	// It is kept for the next time.
+	if (conn->outbuf.bytes == 0) {
+		assert(conn->write_armed);
+		event_del(conn->write_event);
+		conn->write_armed = 0;
+	}
+}	
+
+
+
+//-----------------------------------------------------------------------------
+// libevent backend: the connection has been established.  The read and write
+// events are created once, and kept until the connection is closed.  The
+// write event is only added while there is something to send.
+static void rq_levent_attach(rq_conn_t *conn)
+{
+	assert(conn);
+	assert(conn->rq);
+	assert(conn->rq->evbase);
+	assert(conn->handle != INVALID_HANDLE && conn->handle > 0);
+
+	assert(conn->read_event == NULL);
+	conn->read_event = event_new(conn->rq->evbase, conn->handle, EV_READ | EV_PERSIST, rq_read_handler, conn);
+	assert(conn->read_event);
+	event_add(conn->read_event, NULL);
+
+	assert(conn->write_event == NULL);
+	conn->write_event = event_new(conn->rq->evbase, conn->handle, EV_WRITE | EV_PERSIST, rq_write_handler, conn);
+	assert(conn->write_event);
+	conn->write_armed = 0;
+
+	if (conn->outbuf.bytes > 0) {
+		rq_levent_armwrite(conn);
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// libevent backend: the data that was read has been processed, and there is
+// something to send (usually the acks and replies for the requests we just
+// got).  If the write event isn't waiting already, then nothing is ahead of
+// it, so we try to send it straight away rather than going around the event
+// loop again.  Whatever the socket doesn't take is left for the write event.
+// Errors are left for the write event to find, because the connection cant
+// be closed while it is still being read.
+static void rq_levent_flush(rq_conn_t *conn)
+{
+	assert(conn);
+	assert(conn->in_input == 0);
+	assert(conn->outbuf.bytes > 0);
+
+	if (conn->active > 0 && conn->write_armed == 0) {
+		rq_conn_flush(conn);
+		if (conn->outbuf.bytes > 0) {
+			rq_levent_armwrite(conn);
+		}
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// libevent backend: the connection is being closed.
+static void rq_levent_detach(rq_conn_t *conn)
+{
+	assert(conn);
+
+	if (conn->read_event) {
+		event_free(conn->read_event);
+		conn->read_event = NULL;
+	}
+	if (conn->write_event) {
+		event_free(conn->write_event);
+		conn->write_event = NULL;
+	}
+	conn->write_armed = 0;
+	conn->in_input = 0;
+}
+
+
+static const rq_io_t rq_io_libevent = {
+	"libevent",
+	NULL,
+	rq_levent_attach,
+	rq_levent_detach,
+	rq_levent_armwrite,
+	rq_levent_flush,
+	NULL,
+	NULL,
+	NULL
+};
+
+
+
+#ifdef RQ_WITH_URING
+
+// io_uring backend.  Each connection has at most one recv (straight into the
+// tail of the read buffer, the same as the libevent backend) and one writev
+// (of the whole outbuf) outstanding.  Anything that needs to be submitted is
+// collected during the pass of the event loop, and submitted together.  The
+// ring signals an eventfd when there are completions, which is watched with a
+// normal libevent event, so the rest of librq doesnt know the difference.
+
+#define RQ_URING_ENTRIES  256
+
+struct __rq_uring_conn_t;
+
+typedef struct {
+	struct __rq_uring_conn_t *uconn;
+	char write;
+} rq_uring_op_t;
+
+typedef struct __rq_uring_conn_t {
+	rq_t *rq;
+	rq_conn_t *conn;
+
+	rq_uring_op_t read_op;
+	rq_uring_op_t write_op;
+	char reading;
+	char writing;
+	char busy;
+	int avail;
+
+	// segments that have been moved out of the outbuf and handed to the kernel.
+	rq_outq_t sending;
+	struct iovec iov[RQ_OUTQ_SIZE];
+
+	// once the connection has been closed, we have to wait for the outstanding
+	// operations to complete (or be cancelled) before the buffers can be
+	// released.  A read buffer is kept here for that.
+	expbuf_t *readbuf;
+	struct __rq_uring_conn_t *next;
+} rq_uring_conn_t;
+
+typedef struct {
+	struct io_uring ring;
+	int efd;
+	struct event *efd_event;
+	struct event *submit_event;
+	int queued;
+	rq_uring_conn_t *detached;
+
+	// the eventfd event is persistent, so once rq_shutdown() has been called
+	// it is removed as soon as there are no connections attached, and nothing
+	// outstanding for the ones that have been detached.
+	int attached;
+	char shutdown;
+} rq_uring_t;
+
+
+//-----------------------------------------------------------------------------
+// Get a submission entry.  If the ring is full, submit what we have to make
+// room.
+static struct io_uring_sqe * rq_uring_sqe(rq_uring_t *ur)
+{
+	struct io_uring_sqe *sqe;
+
+	assert(ur);
+
+	sqe = io_uring_get_sqe(&ur->ring);
+	if (sqe == NULL) {
+		io_uring_submit(&ur->ring);
+		ur->queued = 0;
+		sqe = io_uring_get_sqe(&ur->ring);
+	}
+	assert(sqe);
+	return(sqe);
+}
+
+
+//-----------------------------------------------------------------------------
+// Something has been queued, so make sure it gets submitted at the end of
+// this pass of the event loop.
+static void rq_uring_queued(rq_uring_t *ur)
+{
+	assert(ur);
+
+	if (ur->queued == 0) {
+		event_active(ur->submit_event, EV_TIMEOUT, 0);
+	}
+	ur->queued ++;
+}
+
+static void rq_uring_submit_handler(int fd, short int flags, void *arg)
+{
+	rq_uring_t *ur = (rq_uring_t *) arg;
+
+	assert(ur);
+
+	if (ur->queued > 0) {
+		io_uring_submit(&ur->ring);
+		ur->queued = 0;
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Queue a recv into the tail of the read buffer.
+static void rq_uring_read(rq_uring_conn_t *uconn)
+{
+	rq_uring_t *ur;
+	rq_conn_t *conn;
+	struct io_uring_sqe *sqe;
+
+	assert(uconn);
+	assert(uconn->reading == 0);
+	assert(uconn->conn);
+	conn = uconn->conn;
+	assert(conn->readbuf);
+	ur = (rq_uring_t *) uconn->rq->io_data;
+	assert(ur);
+
+	uconn->avail = BUF_MAX(conn->readbuf) - BUF_LENGTH(conn->readbuf);
+	assert(uconn->avail > 0);
+
+	sqe = rq_uring_sqe(ur);
+	io_uring_prep_recv(sqe, conn->handle, BUF_DATA(conn->readbuf) + BUF_LENGTH(conn->readbuf), uconn->avail, 0);
+	io_uring_sqe_set_data(sqe, &uconn->read_op);
+	uconn->reading = 1;
+	rq_uring_queued(ur);
+}
+
+
+//-----------------------------------------------------------------------------
+// Queue a writev of whatever is waiting to be sent.  If a previous write only
+// sent part of what it had, the rest of that goes first.
+static void rq_uring_write(rq_uring_conn_t *uconn)
+{
+	rq_uring_t *ur;
+	rq_conn_t *conn;
+	struct io_uring_sqe *sqe;
+	int count;
+
+	assert(uconn);
+	assert(uconn->writing == 0);
+	assert(uconn->conn);
+	conn = uconn->conn;
+	ur = (rq_uring_t *) uconn->rq->io_data;
+	assert(ur);
+
+	if (uconn->sending.bytes == 0) {
+		if (conn->outbuf.bytes == 0) {
+			return;
+		}
+		if (conn->outbuf.bytes > conn->stats.outbuf_peak) {
+			conn->stats.outbuf_peak = conn->outbuf.bytes;
+		}
+		rq_outq_move(&uconn->sending, &conn->outbuf);
+	}
+
+	count = rq_outq_iov(&uconn->sending, uconn->iov);
+	sqe = rq_uring_sqe(ur);
+	io_uring_prep_writev(sqe, conn->handle, uconn->iov, count, 0);
+	io_uring_sqe_set_data(sqe, &uconn->write_op);
+	uconn->writing = 1;
+	rq_uring_queued(ur);
+}
+
+
+//-----------------------------------------------------------------------------
+// If we are shutting down and the ring has nothing left to do, remove the
+// events so that the event loop can exit.
+static void rq_uring_idle(rq_uring_t *ur)
+{
+	assert(ur);
+
+	if (ur->shutdown && ur->attached == 0 && ur->detached == NULL) {
+		event_del(ur->efd_event);
+		event_del(ur->submit_event);
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Release a connection's state once it has been detached and nothing is
+// outstanding any more.
+static void rq_uring_free(rq_uring_conn_t *uconn)
+{
+	assert(uconn);
+	assert(uconn->conn == NULL);
+	assert(uconn->reading == 0 && uconn->writing == 0);
+
+	if (uconn->readbuf) {
+		uconn->readbuf = rq_buf_return(uconn->rq, uconn->readbuf);
+	}
+	rq_outq_clear(uconn->rq, &uconn->sending);
+	free(uconn);
+}
+
+
+static void rq_uring_process(rq_uring_conn_t *uconn, rq_conn_t *conn, int write, int res);
+
+//-----------------------------------------------------------------------------
+// A recv or writev has completed.
+static void rq_uring_complete(rq_uring_t *ur, rq_uring_op_t *op, int res)
+{
+	rq_uring_conn_t *uconn, **prev;
+	rq_conn_t *conn;
+
+	assert(ur);
+	assert(op);
+	uconn = op->uconn;
+	assert(uconn);
+
+	if (op->write) {
+		assert(uconn->writing);
+		uconn->writing = 0;
+		if (res > 0) {
+			rq_outq_consume(uconn->rq, &uconn->sending, res);
+			if (uconn->rq->unwritable) {
+				rq_budget_check(uconn->rq);
+			}
+		}
+	}
+	else {
+		assert(uconn->reading);
+		uconn->reading = 0;
+	}
+
+	// processing the data can result in the connection being closed, so we
+	// need to make sure it isnt released from under us.
+	conn = uconn->conn;
+	if (conn) {
+		uconn->busy = 1;
+		rq_uring_process(uconn, conn, op->write, res);
+		uconn->busy = 0;
+	}
+
+	if (uconn->conn == NULL && uconn->reading == 0 && uconn->writing == 0) {
+		// the connection has been closed, and nothing is outstanding.
+		prev = &ur->detached;
+		while (*prev != uconn) {
+			assert(*prev);
+			prev = &(*prev)->next;
+		}
+		*prev = uconn->next;
+		rq_uring_free(uconn);
+		rq_uring_idle(ur);
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Handle the result of a recv or writev on a connection that is still open.
+static void rq_uring_process(rq_uring_conn_t *uconn, rq_conn_t *conn, int write, int res)
+{
+	assert(uconn);
+	assert(conn);
+	assert(conn->active > 0);
+
+	if (write) {
+		if (res > 0) {
+			conn->stats.bytes_out += res;
+			RQ_TRACE(conn->rq, RQ_TRACE_FLUSH, flush, -1, 0, res);
+			rq_uring_write(uconn);
+		}
+		else if (res == -EAGAIN || res == -EINTR) {
+			rq_uring_write(uconn);
+		}
+		else {
+			rq_conn_closed(conn);
+		}
+	}
+	else {
+		if (res > 0) {
+			rq_conn_input(conn, res, uconn->avail);
+			if (uconn->conn) {
+				rq_uring_read(uconn);
+			}
+		}
+		else if (res == -EAGAIN || res == -EINTR) {
+			rq_uring_read(uconn);
+		}
+		else {
+			rq_conn_closed(conn);
+		}
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// The ring has told us there are completions.
+static void rq_uring_handler(int fd, short int flags, void *arg)
+{
+	rq_uring_t *ur = (rq_uring_t *) arg;
+	struct io_uring_cqe *cqe;
+	rq_uring_op_t *op;
+	uint64_t value;
+	int res;
+
+	assert(ur);
+	assert(fd == ur->efd);
+
+	if (read(ur->efd, &value, sizeof(value)) < 0) {
+		assert(errno == EAGAIN);
+	}
+
+	while (io_uring_peek_cqe(&ur->ring, &cqe) == 0) {
+		op = (rq_uring_op_t *) io_uring_cqe_get_data(cqe);
+		res = cqe->res;
+		io_uring_cqe_seen(&ur->ring, cqe);
+
+		// cancel requests dont have any data.
+		if (op) {
+			rq_uring_complete(ur, op, res);
+		}
+	}
+
+	// submit whatever the completions caused, rather than waiting.
+	if (ur->queued > 0) {
+		io_uring_submit(&ur->ring);
+		ur->queued = 0;
+	}
+}
+
+
+static int rq_uring_init(rq_t *rq)
+{
+	rq_uring_t *ur;
+
+	assert(rq);
+	assert(rq->evbase);
+	assert(rq->io_data == NULL);
+
+	ur = calloc(1, sizeof(*ur));
+	assert(ur);
+
+	if (io_uring_queue_init(RQ_URING_ENTRIES, &ur->ring, 0) != 0) {
+		free(ur);
+		return(-1);
+	}
+
+	ur->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (ur->efd < 0 || io_uring_register_eventfd(&ur->ring, ur->efd) != 0) {
+		if (ur->efd >= 0) { close(ur->efd); }
+		io_uring_queue_exit(&ur->ring);
+		free(ur);
+		return(-1);
+	}
+
+	ur->efd_event = event_new(rq->evbase, ur->efd, EV_READ | EV_PERSIST, rq_uring_handler, ur);
+	assert(ur->efd_event);
+	event_add(ur->efd_event, NULL);
+
+	ur->submit_event = event_new(rq->evbase, -1, 0, rq_uring_submit_handler, ur);
+	assert(ur->submit_event);
+
+	ur->queued = 0;
+	ur->detached = NULL;
+	ur->attached = 0;
+	ur->shutdown = 0;
+	rq->io_data = ur;
+	return(0);
+}
+
+
+static void rq_uring_attach(rq_conn_t *conn)
+{
+	rq_uring_conn_t *uconn;
+	rq_uring_t *ur;
+
+	assert(conn);
+	assert(conn->rq);
+	assert(conn->io_data == NULL);
+	ur = (rq_uring_t *) conn->rq->io_data;
+	assert(ur);
+	ur->attached ++;
+
+	uconn = calloc(1, sizeof(*uconn));
+	assert(uconn);
+	uconn->rq = conn->rq;
+	uconn->conn = conn;
+	uconn->read_op.uconn = uconn;
+	uconn->read_op.write = 0;
+	uconn->write_op.uconn = uconn;
+	uconn->write_op.write = 1;
+	rq_outq_init(&uconn->sending);
+	conn->io_data = uconn;
+
+	rq_uring_read(uconn);
+	rq_uring_write(uconn);
+}
+
+
+//-----------------------------------------------------------------------------
+// The connection is being closed.  Anything still outstanding is cancelled
+// (and submitted now, because the socket is about to be closed), and the
+// state is kept until the cancellations complete.
+static void rq_uring_detach(rq_conn_t *conn)
+{
+	rq_uring_conn_t *uconn;
+	struct io_uring_sqe *sqe;
+	rq_uring_t *ur;
+
+	assert(conn);
+	assert(conn->rq);
+	uconn = (rq_uring_conn_t *) conn->io_data;
+	if (uconn == NULL) {
+		return;
+	}
+	ur = (rq_uring_t *) conn->rq->io_data;
+	assert(ur);
+
+	conn->io_data = NULL;
+	uconn->conn = NULL;
+	assert(ur->attached > 0);
+	ur->attached --;
+
+	if (uconn->reading == 0 && uconn->writing == 0 && uconn->busy == 0) {
+		rq_uring_free(uconn);
+		rq_uring_idle(ur);
+	}
+	else {
+		if (uconn->reading) {
+			// the kernel might still write into the read buffer.
+			uconn->readbuf = conn->readbuf;
+			conn->readbuf = NULL;
+			sqe = rq_uring_sqe(ur);
+			io_uring_prep_cancel(sqe, &uconn->read_op, 0);
+			io_uring_sqe_set_data(sqe, NULL);
+		}
+		if (uconn->writing) {
+			sqe = rq_uring_sqe(ur);
+			io_uring_prep_cancel(sqe, &uconn->write_op, 0);
+			io_uring_sqe_set_data(sqe, NULL);
+		}
+		if (uconn->reading || uconn->writing) {
+			io_uring_submit(&ur->ring);
+			ur->queued = 0;
+		}
+
+		uconn->next = ur->detached;
+		ur->detached = uconn;
+	}
+}
+
+
+static void rq_uring_armwrite(rq_conn_t *conn)
+{
+	rq_uring_conn_t *uconn;
+
+	assert(conn);
+	uconn = (rq_uring_conn_t *) conn->io_data;
+	assert(uconn);
+
+	if (uconn->writing == 0) {
+		rq_uring_write(uconn);
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// The bytes that have been handed to the kernel, but not written yet.
+static int rq_uring_unsent(rq_conn_t *conn)
+{
+	rq_uring_conn_t *uconn;
+
+	assert(conn);
+	uconn = (rq_uring_conn_t *) conn->io_data;
+	return(uconn ? uconn->sending.bytes : 0);
+}
+
+
+static void rq_uring_shutdown(rq_t *rq)
+{
+	rq_uring_t *ur;
+
+	assert(rq);
+	ur = (rq_uring_t *) rq->io_data;
+	assert(ur);
+
+	ur->shutdown = 1;
+	rq_uring_idle(ur);
+}
+
+
+static void rq_uring_cleanup(rq_t *rq)
+{
+	rq_uring_t *ur;
+	rq_uring_conn_t *uconn;
+
+	assert(rq);
+	ur = (rq_uring_t *) rq->io_data;
+	assert(ur);
+
+	event_free(ur->efd_event);
+	event_free(ur->submit_event);
+
+	// anything still outstanding is abandoned with the ring.
+	io_uring_queue_exit(&ur->ring);
+	close(ur->efd);
+
+	while ((uconn = ur->detached)) {
+		ur->detached = uconn->next;
+		uconn->reading = 0;
+		uconn->writing = 0;
+		rq_uring_free(uconn);
+	}
+
+	free(ur);
+	rq->io_data = NULL;
+}
+
+
+static const rq_io_t rq_io_uring = {
+	"io_uring",
+	rq_uring_init,
+	rq_uring_attach,
+	rq_uring_detach,
+	rq_uring_armwrite,
+	NULL,
+	rq_uring_unsent,
+	rq_uring_shutdown,
+	rq_uring_cleanup
+};
+
+#endif
+
+
+
+
+
+
+//-----------------------------------------------------------------------------
+// Compress a payload that is about to be sent on the connection.  The result
+// is left in the compress buffer, and the length of it is returned.  If the
+// payload is too small, or doesnt get any smaller, then 0 is returned and it
+// should be sent as it is.
+static int rq_compress(rq_conn_t *conn, char *data, int length)
+{
+	rq_t *rq;
+	int clen;
+
+	assert(conn);
+	assert(conn->rq);
+	assert(length >= 0);
+
+	rq = conn->rq;
+	if (conn->compress == RQ_COMPRESS_NONE || length < rq->compress_threshold || length == 0) {
+		return(0);
+	}
+
+	assert(data);
+	assert(rq->compress_buf);
+	expbuf_clear(rq->compress_buf);
+	clen = 0;
+
+#ifdef RQ_WITH_LZ4
+	if (conn->compress == RQ_COMPRESS_LZ4) {
+		int bound = LZ4_compressBound(length);
+		expbuf_shrink(rq->compress_buf, bound);
+		clen = LZ4_compress_default(data, BUF_DATA(rq->compress_buf), length, bound);
+	}
+#endif
+#ifdef RQ_WITH_ZSTD
+	if (conn->compress == RQ_COMPRESS_ZSTD) {
+		size_t result;
+		int bound = ZSTD_compressBound(length);
+		expbuf_shrink(rq->compress_buf, bound);
+		assert(rq->zstd_cctx);
+		if (rq->zstd_cdict) {
+			result = ZSTD_compress_usingCDict(rq->zstd_cctx, BUF_DATA(rq->compress_buf), bound, data, length, rq->zstd_cdict);
+		}
+		else {
+			result = ZSTD_compressCCtx(rq->zstd_cctx, BUF_DATA(rq->compress_buf), bound, data, length, RQ_ZSTD_LEVEL);
+		}
+		clen = ZSTD_isError(result) ? 0 : (int) result;
+	}
+#endif
+
+	// only worth it if it actually saved something.
+	if (clen <= 0 || clen >= length) {
+		return(0);
+	}
+
+	BUF_LENGTH(rq->compress_buf) = clen;
+	return(clen);
+}
+
+
+//-----------------------------------------------------------------------------
+// Uncompress a payload that was received into 'out'.  Returns 0 if it worked,
+// or -1 if the payload could not be uncompressed to the size we were told.
+static int rq_decompress(rq_t *rq, int method, char *data, int length, unsigned int rawsize, expbuf_t *out)
+{
+	int result = -1;
+
+	assert(rq);
+	assert(data);
+	assert(length > 0);
+	assert(out);
+
+	expbuf_clear(out);
+	expbuf_shrink(out, rawsize);
+
+#ifdef RQ_WITH_LZ4
+	if (method == RQ_COMPRESS_LZ4) {
+		if (LZ4_decompress_safe(data, BUF_DATA(out), length, rawsize) == (int) rawsize) {
+			result = 0;
+		}
+	}
+#endif
+#ifdef RQ_WITH_ZSTD
+	if (method == RQ_COMPRESS_ZSTD) {
+		size_t len;
+		assert(rq->zstd_dctx);
+		if (rq->zstd_ddict) {
+			len = ZSTD_decompress_usingDDict(rq->zstd_dctx, BUF_DATA(out), rawsize, data, length, rq->zstd_ddict);
+		}
+		else {
+			len = ZSTD_decompressDCtx(rq->zstd_dctx, BUF_DATA(out), rawsize, data, length);
+		}
+		if (ZSTD_isError(len) == 0 && len == rawsize) {
+			result = 0;
+		}
+	}
+#endif
+
+	if (result == 0) {
+		BUF_LENGTH(out) = rawsize;
+	}
+	return(result);
+}
+
+
+//-----------------------------------------------------------------------------
+// Offer the compression methods we support to the controller.  Until it
+// answers, payloads are sent uncompressed.
+static void rq_send_compress(rq_conn_t *conn)
+{
+	assert(conn);
+	assert(conn->rq);
+	assert(conn->rq->compress_methods != RQ_COMPRESS_NONE);
+	assert(conn->compress == RQ_COMPRESS_NONE);
+
+	assert(conn->sendbuf);
+	assert(BUF_LENGTH(conn->sendbuf) == 0);
+
+	addCmd(conn->sendbuf, RQ_CMD_CLEAR);
+	addCmdShortInt(conn->sendbuf, RQ_CMD_COMPRESS, conn->rq->compress_methods);
+
+	rq_senddata(conn, BUF_DATA(conn->sendbuf), BUF_LENGTH(conn->sendbuf));
+	expbuf_clear(conn->sendbuf);
+}
+
+
+//-----------------------------------------------------------------------------
+// This internal function is used to actually send a queue consume request 
+static void rq_send_consume(rq_conn_t *conn, rq_queue_t *queue)
+{
+	assert(conn);
+	assert(queue);
+
+	assert(queue->queue);
+	assert(queue->max >= 0);
+	assert(strlen(queue->queue) > 0 && strlen(queue->queue) < 256);
+
+	// get a buffer from the bufpool.
+	assert(conn->sendbuf);
+	assert(BUF_LENGTH(conn->sendbuf) == 0);
+	
+
+	// send consume request to controller.
+	addCmd(conn->sendbuf, RQ_CMD_CLEAR);
+	if (queue->exclusive != 0)
+		addCmd(conn->sendbuf, RQ_CMD_EXCLUSIVE);
+	addCmdShortStr(conn->sendbuf, RQ_CMD_QUEUE, strlen(queue->queue), queue->queue);
+	addCmdInt(conn->sendbuf, RQ_CMD_MAX, queue->max);
+	addCmdShortInt(conn->sendbuf, RQ_CMD_PRIORITY, queue->priority);
+	addCmd(conn->sendbuf, RQ_CMD_CONSUME);
+
+	rq_senddata(conn, BUF_DATA(conn->sendbuf), BUF_LENGTH(conn->sendbuf));
+	expbuf_clear(conn->sendbuf);
+}
+
+
+//-----------------------------------------------------------------------------
+// Tell the controller that we dont want any more requests for a queue.
+static void rq_send_cancel(rq_conn_t *conn, rq_queue_t *queue)
+{
+	assert(conn);
+	assert(queue);
+	assert(queue->queue);
+	assert(strlen(queue->queue) > 0 && strlen(queue->queue) < 256);
+
+	assert(conn->sendbuf);
+	assert(BUF_LENGTH(conn->sendbuf) == 0);
+
+	addCmd(conn->sendbuf, RQ_CMD_CLEAR);
+	addCmdShortStr(conn->sendbuf, RQ_CMD_QUEUE, strlen(queue->queue), queue->queue);
+	addCmd(conn->sendbuf, RQ_CMD_CANCEL_QUEUE);
+
+	rq_senddata(conn, BUF_DATA(conn->sendbuf), BUF_LENGTH(conn->sendbuf));
+	expbuf_clear(conn->sendbuf);
+}
+
+
+//-----------------------------------------------------------------------------
+// Time for a heartbeat.  If the last PING still hasn't been answered, we
+// count it as missed, and after too many we give up on the connection, which
+// will fail-over to the next controller.
+static void rq_heartbeat_handler(int fd, short int flags, void *arg)
+{
+	rq_conn_t *conn = (rq_conn_t *) arg;
+	char buf;
+
+	assert(conn);
+	assert(conn->rq);
+	assert(conn->active > 0);
+	assert(conn->hb_event);
+
+	if (conn->ping_time > 0) {
+		conn->hb_missed ++;
+		if (conn->hb_missed >= conn->rq->heartbeat_missed) {
+			conn->stats.heartbeat_drops ++;
+			rq_conn_closed(conn);
+		}
+	}
+	else {
+		buf = RQ_CMD_PING;
+		conn->ping_time = rq_now();
+		rq_senddata(conn, &buf, 1);
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Start sending heartbeats on a connection that has just been established.
+static void rq_heartbeat_start(rq_conn_t *conn)
+{
+	struct timeval tv;
+
+	assert(conn);
+	assert(conn->rq);
+	assert(conn->rq->evbase);
+	assert(conn->rq->heartbeat_interval > 0);
+	assert(conn->hb_event == NULL);
+
+	conn->ping_time = 0;
+	conn->hb_missed = 0;
+
+	conn->hb_event = event_new(conn->rq->evbase, -1, EV_PERSIST, rq_heartbeat_handler, conn);
+	assert(conn->hb_event);
+	tv.tv_sec = conn->rq->heartbeat_interval / 1000;
+	tv.tv_usec = (conn->rq->heartbeat_interval % 1000) * 1000;
+	event_add(conn->hb_event, &tv);
+}
+
+
+static void rq_connect_handler(int fd, short int flags, void *arg)
+{
+	rq_conn_t *conn = (rq_conn_t *) arg;
+	rq_conn_t *other;
+	rq_t *rq;
+	rq_queue_t *q;
+	socklen_t foo;
+	int error;
+
+	assert(fd >= 0);
+	assert(flags != 0);
+	assert(conn);
+	assert(conn->rq);
+	assert(conn->handle == fd);
+	assert(flags & (EV_WRITE | EV_TIMEOUT));
+	assert(conn->rq->evbase != NULL);
+
+	rq = conn->rq;
+
+	// if we timed out, then the connect didn't complete in time, which we
+	// treat the same as any other failure.
+	error = conn->connect_error ? conn->connect_error : ETIMEDOUT;
+	if ((flags & EV_TIMEOUT) == 0) {
+		foo = sizeof(error);
+		if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &foo) != 0) {
+			error = errno;
+		}
+	}
+	
+	if (error != 0) {
+		// connect failed...  we need to move this conn object from the list and
+		// put it at the tail, and then try the next one (if there are no other
+		// connects still in progress).
+	
+		assert(conn->active == 0);
+		assert(conn->closing == 0);
+		assert(conn->data == NULL);
+
+		conn->stats.connect_fails ++;
+		rq_conn_connectabort(conn);
+		if (ll_count(&rq->connlist) > 1) {
+			ll_remove(&rq->connlist, conn);
+			ll_push_tail(&rq->connlist, conn);
+		}
+		rq_connect(rq);
+	}
+	else {
+
+		// remove the connect handler
+		assert(conn->connect_event);
+		event_free(conn->connect_event);
+		conn->connect_event = NULL;
+
+		// we might have been racing connects to other controllers as well.  This
+		// one won, so the others are abandoned, and this becomes the head of the
+		// list, which is the one that gets used.
+		ll_start(&rq->connlist);
+		while ((other = ll_next(&rq->connlist))) {
+			if (other != conn && other->connect_event) {
+				rq_conn_connectabort(other);
+			}
+		}
+		ll_finish(&rq->connlist);
+		if (ll_get_head(&rq->connlist) != conn) {
+			ll_remove(&rq->connlist, conn);
+			ll_push_head(&rq->connlist, conn);
+		}
+
+		assert(conn->active == 0);
+		conn->active ++;
+		conn->stats.connects ++;
+
+		// now that we have connected, we should get a buffer to handle read data.
+		assert(conn->readbuf == NULL);
+		conn->readbuf = rq_buf_get(conn->rq, conn->rq->readbuf_init);
+		conn->readpos = 0;
+		conn->read_small = 0;
+		assert(conn->readbuf);
+
+		// we should also prepare the 'sendbuf' even though it wont be needed until we send something.
+		// better to create it now, rather than having to test for it and create it later.
+		assert(conn->sendbuf == NULL);
+		conn->sendbuf = rq_buf_get(conn->rq, RQ_DEFAULT_BUFFSIZE);
+		assert(conn->sendbuf);
+
+		assert(conn->ackbuf == NULL);
+		conn->ackbuf = rq_buf_get(conn->rq, RQ_DEFAULT_BUFFSIZE);
+		assert(conn->ackbuf);
+		
+		// initialise the data portion of the 'conn' object.
+		assert(conn->rq);
+		assert(conn->data == NULL);
+		conn->data = (rq_data_t *) malloc(sizeof(rq_data_t));
+		assert(conn->data);
+		rq_data_init(conn->data);
+
+		// hand the socket to the I/O backend, which will start reading from it
+		// (and sending anything that is already in the outbuf).
+		assert(conn->handle > 0);
+		assert(rq->io);
+		rq->io->attach(conn);
+		
+		// if we want compression, we need to agree on it with the controller
+		// before anything else is sent.
+		if (rq->compress_methods != RQ_COMPRESS_NONE) {
+			rq_send_compress(conn);
+		}
+
+		// now that we have an active connection, we need to send our queue requests.
+		assert(conn);
+		assert(conn->rq);
+		ll_start(&conn->rq->queues);
+		while ((q = ll_next(&conn->rq->queues))) {
+			if (q->cancelled == 0) {
+				rq_send_consume(conn, q);
+			}
+		}
+		ll_finish(&conn->rq->queues);
+
+		if (rq->heartbeat_interval > 0) {
+			rq_heartbeat_start(conn);
+		}
+
+		// and then the requests that were waiting for a connection.
+		rq_pending_flush(conn);
+	}
+}
+
+
+
+static void rq_read_handler(int fd, short int flags, void *arg)
+{
+	rq_conn_t *conn = (rq_conn_t *) arg;
+
+	assert(fd >= 0);
+	assert(flags != 0);
+	assert(conn);
+	assert(conn->rq);
+	assert(conn->active > 0);
+	assert(flags & EV_READ);
+	
+	rq_process_read(conn);
+}
+
+
+
+
+
+//-----------------------------------------------------------------------------
+// add a controller to the end of the connection list.   If this is the first
+// controller, then we need to attempt to connect to it, and setup the socket
+// on the event queue.
+void rq_addcontroller(
+	rq_t *rq,
+	char *host,
+	void *connect_handler,
+	void *dropped_handler,
+	void *arg)
+{
+	
+	// *(connect_handler)(rq_service_t *service, void *arg)
+	
+	rq_conn_t *conn;
+	struct sockaddr_un *unaddr;
+	char *port;
+	int len;
+	
+	assert(rq != NULL);
+	assert(host != NULL);
+	assert(host[0] != 0);
+	assert((arg != NULL && (connect_handler || dropped_handler)) || (arg == NULL));
+
+	// dont currently have it coded to handle these, so we will fail for now
+	// until we find a need to use them.
+	assert(connect_handler == NULL);
+	assert(dropped_handler == NULL);
+	assert(arg == NULL);
+
+	conn = calloc(1, sizeof(rq_conn_t));
+	assert(conn);
+	
+	conn->hostname = strdup(host);
+
+	// if we were given an address (ipv4, ipv6 or 'unix:/path'), we can use it as it is.
+	// Otherwise it is a hostname, which will be looked up when we first try to
+	// connect.
+	len = sizeof(conn->addr);
+	if (strncmp(host, "unix:", 5) == 0) {
+		// a controller on the same host, through a unix socket.
+		unaddr = (struct sockaddr_un *) &conn->addr;
+		assert(host[5] != 0);
+		assert(strlen(host + 5) < sizeof(unaddr->sun_path));
+		unaddr->sun_family = AF_UNIX;
+		strcpy(unaddr->sun_path, host + 5);
+		conn->addrlen = offsetof(struct sockaddr_un, sun_path) + strlen(unaddr->sun_path) + 1;
+	}
+	else if (evutil_parse_sockaddr_port(host, (struct sockaddr *) &conn->addr, &len) == 0) {
+		conn->addrlen = len;
+	}
+	else {
+		port = strrchr(host, ':');
+		assert(port && port > host && port[1] != 0);
+		conn->dnshost = strndup(host, port - host);
+		conn->dnsport = strdup(port + 1);
+		conn->addrlen = 0;
+	}
+
+	conn->handle = INVALID_HANDLE;		// socket handle to the connected controller.
+	assert(conn->read_event == NULL);
+	assert(conn->write_event == NULL);
+	assert(conn->connect_event == NULL);
+
+	assert(conn->readbuf == NULL);
+	rq_outq_init(&conn->outbuf);
+
+	assert(rq->risp);
+	conn->risp = rq->risp;
+
+	conn->rq = rq;
+	conn->active = 0;
+	conn->shutdown = 0;
+	conn->closing = 0;
+	conn->data = NULL;
+
+	ll_push_tail(&rq->connlist, conn);
+
+	// if this is the only controller we have so far, then we need to attempt the
+	// connect (non-blocking)
+	if (ll_count(&rq->connlist) == 1) {
+		rq_connect(rq);
+	}
+}
+
+
+
+
+
+
+
+
+
+
+//-----------------------------------------------------------------------------
+// Send a request to the controller indicating a desire to consume a particular
+// queue.  We will add queue information to our RQ structure.  If we are
+// already connected to a controller, then the queue request will be sent
+// straight away.  If not, then the request will be made as soon as a
+// connection is made.  
+void rq_consume(
+	rq_t *rq,
+	char *queue,
+	int max,
+	int priority,
+	int exclusive,
+	void (*handler)(rq_message_t *msg, void *arg),
+	void (*accepted)(char *queue, queue_id_t qid, void *arg),
+	void (*dropped)(char *queue, queue_id_t qid, void *arg),
+	void *arg)
+{
+	rq_queue_t *q;
+	rq_conn_t *conn;
+	
+	assert(rq);
+	assert(queue);
+	assert(strlen(queue) < 256);
+	assert(max >= 0);
+	assert(priority == RQ_PRIORITY_NONE || priority == RQ_PRIORITY_LOW || priority == RQ_PRIORITY_NORMAL || priority == RQ_PRIORITY_HIGH);
+	assert(handler);
+
+	// check that we are connected to a controller.
+	assert(ll_count(&rq->connlist) > 0);
+
+	// check that we are not already consuming this queue.
+	if (rq_queue_find(rq, queue) == NULL) {
+		q = (rq_queue_t *) malloc(sizeof(rq_queue_t));
+		assert(q != NULL);
+
+		rq_queue_init(q);
+		q->queue = strdup(queue);
+		q->handler = handler;
+		q->accepted = accepted;
+		q->dropped = dropped;
+		q->arg = arg;
+		q->exclusive = exclusive;
+		q->max = max;
+		q->priority = priority;
+
+		ll_push_tail(&rq->queues, q);
+		rq_queue_addhash(rq, q);
+
+		// check to see if the top connection is active.  If so, send the consume request.
+		conn = ll_get_head(&rq->connlist);
+		assert(conn);
+		if (conn->active > 0 && conn->closing == 0) {
+			rq_send_consume(conn, q);
+		}
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Stop consuming a queue, if we haven't already.
+static void rq_queue_cancel(rq_t *rq, rq_queue_t *queue)
+{
+	rq_conn_t *conn;
+
+	assert(rq);
+	assert(queue);
+
+	if (queue->cancelled == 0) {
+		queue->cancelled = 1;
+
+		// if we aren't connected, then the queue just wont be consumed when we are.
+		conn = ll_get_head(&rq->connlist);
+		if (conn && conn->active > 0 && conn->closing == 0) {
+			rq_send_cancel(conn, queue);
+		}
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Stop consuming a queue.  The controller is told to stop giving us requests
+// for it, and any that it had already sent are returned as UNDELIVERED.  The
+// requests for the queue that we already have are still handled (and
+// replied to) as normal, so the queue stays until rq_cleanup().  Returns -1
+// if we weren't consuming the queue.
+int rq_cancel(rq_t *rq, char *queue)
+{
+	rq_queue_t *q;
+
+	assert(rq);
+	assert(queue);
+
+	q = rq_queue_find(rq, queue);
+	if (q == NULL) {
+		return(-1);
+	}
+
+	rq_queue_cancel(rq, q);
+	return(0);
+}
+
+
+
+
+
+
+
+
+
+
+//-----------------------------------------------------------------------------
+// Worker pool.
+//
+// When workers are enabled, requests are not given to the queue handler from
+// within risp_process().  Instead they are pushed onto the 'jobs' ring, and a
+// worker thread is woken to run the handler.  When the handler returns, the
+// message is pushed onto the 'done' ring, and the event loop is woken through
+// an eventfd, so that the reply can be sent (and the message cleaned up) from
+// the event-loop thread.  Both rings are bounded lock-free queues (each slot
+// has a sequence number that tells producers and consumers whose turn it is),
+// so the only thing shared between the threads is the ring itself.
+//
+// Only rq_reply() may be called from a handler running in a worker.
+
+// the message that the current worker thread is handling.
+static __thread rq_message_t *rq_worker_msg = NULL;
+
+
+static void rq_ring_init(rq_ring_t *ring)
+{
+	unsigned int i;
+
+	assert(ring);
+	assert((RQ_WORKER_RING & (RQ_WORKER_RING - 1)) == 0);
+
+	for (i=0; i<RQ_WORKER_RING; i++) {
+		ring->cell[i].seq = i;
+		ring->cell[i].msg = NULL;
+	}
+	ring->head = 0;
+	ring->tail = 0;
+}
+
+//-----------------------------------------------------------------------------
+// Add a message to the ring.  Returns 0 if the ring is full.  Can be called
+// from any number of threads at the same time.
+static int rq_ring_push(rq_ring_t *ring, rq_message_t *msg)
+{
+	rq_ringcell_t *cell;
+	unsigned int pos, seq;
+	int dif;
+
+	assert(ring);
+	assert(msg);
+
+	pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+	for (;;) {
+		cell = &ring->cell[pos & (RQ_WORKER_RING - 1)];
+		seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		dif = (int) (seq - pos);
+		if (dif == 0) {
+			if (__atomic_compare_exchange_n(&ring->tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				break;
+			}
+		}
+		else if (dif < 0) {
+			return(0);
+		}
+		else {
+			pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+		}
+	}
+
+	cell->msg = msg;
+	__atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+	return(1);
+}
+
+//-----------------------------------------------------------------------------
+// Take the next message off the ring, or NULL if it is empty.  Can be called
+// from any number of threads at the same time.
+static rq_message_t * rq_ring_pop(rq_ring_t *ring)
+{
+	rq_ringcell_t *cell;
+	rq_message_t *msg;
+	unsigned int pos, seq;
+	int dif;
+
+	assert(ring);
+
+	pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+	for (;;) {
+		cell = &ring->cell[pos & (RQ_WORKER_RING - 1)];
+		seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		dif = (int) (seq - (pos + 1));
+		if (dif == 0) {
+			if (__atomic_compare_exchange_n(&ring->head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				break;
+			}
+		}
+		else if (dif < 0) {
+			return(NULL);
+		}
+		else {
+			pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+		}
+	}
+
+	msg = cell->msg;
+	cell->msg = NULL;
+	__atomic_store_n(&cell->seq, pos + RQ_WORKER_RING, __ATOMIC_RELEASE);
+	return(msg);
+}
+
+
+//-----------------------------------------------------------------------------
+// The main loop of a worker thread.  Each post of the semaphore is for one
+// job.  If there is no job when we are woken, we are being stopped.
+static void * rq_worker_main(void *arg)
+{
+	rq_t *rq = (rq_t *) arg;
+	rq_message_t *msg;
+	uint64_t one = 1;
+
+	assert(rq);
+
+	for (;;) {
+		while (sem_wait(&rq->worker_sem) != 0) {
+			assert(errno == EINTR);
+		}
+
+		msg = rq_ring_pop(rq->worker_jobs);
+		if (msg == NULL) {
+			break;
+		}
+
+		assert(msg->consumer);
+		assert(msg->consumer->handler);
+		assert(msg->state == rq_msgstate_delivering);
+
+		rq_worker_msg = msg;
+		RQ_TRACE(rq, RQ_TRACE_REQUEST, request, msg->src_id, msg->trace_id, BUF_LENGTH(msg->data));
+		msg->consumer->handler(msg, msg->consumer->arg);
+		RQ_TRACE(rq, RQ_TRACE_HANDLED, handled, msg->src_id, msg->trace_id, 0);
+		rq_worker_msg = NULL;
+
+		// the number of messages out with the workers is limited to the size of
+		// the ring, so there is always room to give it back.
+		if (rq_ring_push(rq->worker_done, msg) == 0) {
+			assert(0);
+		}
+
+		// only wake the event loop if no-one else has since it last looked.
+		if (__atomic_exchange_n(&rq->worker_wake, 1, __ATOMIC_SEQ_CST) == 0) {
+			if (write(rq->worker_efd, &one, sizeof(one)) != sizeof(one)) {
+				assert(errno == EAGAIN);
+			}
+		}
+	}
+
+	return(NULL);
+}
+
+
+//-----------------------------------------------------------------------------
+// Give a message to a worker.
+static void rq_worker_start(rq_t *rq, rq_message_t *msg)
+{
+	assert(rq);
+	assert(msg);
+	assert(msg->consumer);
+	assert(rq->worker_inflight < RQ_WORKER_RING);
+
+	msg->consumer->inflight ++;
+	rq->worker_inflight ++;
+
+	if (rq_ring_push(rq->worker_jobs, msg) == 0) {
+		assert(0);
+	}
+	sem_post(&rq->worker_sem);
+
+	// after a shutdown the worker event might have been removed, and we need it
+	// to get the message back.
+	if (rq->shutdown) {
+		event_add(rq->worker_event, NULL);
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// A request has been received for a queue, and in worker mode, it is handed
+// to a worker, unless the queue already has 'max' requests being handled.  In
+// that case it waits in the backlog for the queue until one finishes.
+static void rq_worker_dispatch(rq_t *rq, rq_message_t *msg)
+{
+	rq_queue_t *queue;
+
+	assert(rq);
+	assert(msg);
+	assert(msg->consumer);
+	assert(msg->borrowed == 0);
+	assert(msg->pending_next == NULL);
+
+	queue = msg->consumer;
+	if (queue->backlog_head || (queue->max > 0 && queue->inflight >= queue->max) || rq->worker_inflight >= RQ_WORKER_RING) {
+		if (queue->backlog_tail) { queue->backlog_tail->pending_next = msg; }
+		else { queue->backlog_head = msg; }
+		queue->backlog_tail = msg;
+		rq->worker_backlog ++;
+	}
+	else {
+		rq_worker_start(rq, msg);
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Requests have finished, so hand out any that were waiting in the backlogs.
+// The priorities are all 10 apart, so we can step through them.
+static void rq_worker_backlog(rq_t *rq)
+{
+	rq_queue_t *queue;
+	rq_message_t *msg;
+	int priority;
+
+	assert(rq);
+
+	// the queues with the highest priority get the free workers first.
+	for (priority = RQ_PRIORITY_HIGH; priority >= RQ_PRIORITY_NONE && rq->worker_backlog > 0; priority -= (RQ_PRIORITY_HIGH - RQ_PRIORITY_NORMAL)) {
+		ll_start(&rq->queues);
+		while ((queue = ll_next(&rq->queues))) {
+			while (queue->priority == priority && queue->backlog_head && (queue->max == 0 || queue->inflight < queue->max) && rq->worker_inflight < RQ_WORKER_RING) {
+				msg = queue->backlog_head;
+				queue->backlog_head = msg->pending_next;
+				if (queue->backlog_head == NULL) { queue->backlog_tail = NULL; }
+				msg->pending_next = NULL;
+				rq->worker_backlog --;
+				rq_worker_start(rq, msg);
+			}
+		}
+		ll_finish(&rq->queues);
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// The handler for a request has returned in a worker thread, and the message
+// is now back on the event-loop thread.  This is where we do everything that
+// cmdRequest() would have done after calling the handler.
+static void rq_worker_finish(rq_t *rq, rq_message_t *msg)
+{
+	assert(rq);
+	assert(msg);
+	assert(msg->consumer);
+	assert(msg->consumer->inflight > 0);
+	assert(rq->worker_inflight > 0);
+
+	msg->consumer->inflight --;
+	rq->worker_inflight --;
+
+	if (msg->noreply == 1) {
+		rq_msg_clear(msg);
+	}
+	else if (msg->state == rq_msgstate_replied) {
+		if (msg->reply) {
+			rq_reply_send(msg, BUF_LENGTH(msg->reply), BUF_DATA(msg->reply));
+			msg->reply = expbuf_free(msg->reply);
+			assert(msg->reply == NULL);
+		}
+		else {
+			rq_reply_send(msg, 0, NULL);
+		}
+		rq_msg_clear(msg);
+	}
+	else {
+		// the handler hasn't replied yet, so it will need to call rq_reply from
+		// the event-loop thread when it is ready.
+		assert(msg->state == rq_msgstate_delivering);
+		msg->state = rq_msgstate_delivered;
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// The workers have finished with some messages.
+static void rq_worker_handler(int fd, short int flags, void *arg)
+{
+	rq_t *rq = (rq_t *) arg;
+	rq_message_t *msg;
+	uint64_t count;
+
+	assert(fd >= 0);
+	assert(rq);
+	assert(rq->worker_efd == fd);
+
+	if (read(fd, &count, sizeof(count)) != sizeof(count)) {
+		assert(errno == EAGAIN);
+	}
+
+	// clear the flag before we look at the ring, so that anything pushed after
+	// we stop looking will wake us again.
+	__atomic_store_n(&rq->worker_wake, 0, __ATOMIC_SEQ_CST);
+
+	while ((msg = rq_ring_pop(rq->worker_done))) {
+		rq_worker_finish(rq, msg);
+	}
+
+	rq_worker_backlog(rq);
+
+	if (rq->shutdown && rq->worker_inflight == 0 && rq->worker_backlog == 0) {
+		event_del(rq->worker_event);
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Start a pool of worker threads that the queue handlers will be run in.  The
+// event base must already be set.  Once workers are running, a queue handler
+// can take as long as it likes without stopping the event loop, but it must
+// not call any rq function other than rq_reply().  The 'max' given to
+// rq_consume() is the number of requests for the queue that will be handled
+// at the same time.
+void rq_setworkers(rq_t *rq, int workers)
+{
+	int i;
+
+	assert(rq);
+	assert(workers > 0);
+	assert(rq->workers == 0);
+	assert(rq->evbase);
+
+	rq->worker_jobs = (rq_ring_t *) malloc(sizeof(rq_ring_t));
+	rq->worker_done = (rq_ring_t *) malloc(sizeof(rq_ring_t));
+	assert(rq->worker_jobs && rq->worker_done);
+	rq_ring_init(rq->worker_jobs);
+	rq_ring_init(rq->worker_done);
+
+	i = sem_init(&rq->worker_sem, 0, 0);
+	assert(i == 0);
+
+	rq->worker_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	assert(rq->worker_efd >= 0);
+	rq->worker_event = event_new(rq->evbase, rq->worker_efd, EV_READ | EV_PERSIST, rq_worker_handler, rq);
+	assert(rq->worker_event);
+	event_add(rq->worker_event, NULL);
+
+	rq->worker_wake = 0;
+	rq->worker_inflight = 0;
+	rq->worker_backlog = 0;
+
+	rq->worker_threads = (pthread_t *) malloc(sizeof(pthread_t) * workers);
+	assert(rq->worker_threads);
+	for (i=0; i<workers; i++) {
+		if (pthread_create(&rq->worker_threads[i], NULL, rq_worker_main, rq) != 0) {
+			assert(0);
+		}
+	}
+	rq->workers = workers;
+}
+
+
+//-----------------------------------------------------------------------------
+// Stop the worker threads.  Requests still waiting in the backlogs are
+// dropped, and the ones that the workers are handling are finished first.
+// There are no connections by now, so any replies are discarded.
+static void rq_workers_stop(rq_t *rq)
+{
+	rq_queue_t *queue;
+	rq_message_t *msg;
+	int i;
+
+	assert(rq);
+	assert(rq->workers > 0);
+
+	ll_start(&rq->queues);
+	while ((queue = ll_next(&rq->queues))) {
+		while ((msg = queue->backlog_head)) {
+			queue->backlog_head = msg->pending_next;
+			msg->pending_next = NULL;
+			rq->worker_backlog --;
+			rq_msg_clear(msg);
+		}
+		queue->backlog_tail = NULL;
+	}
+	ll_finish(&rq->queues);
+	assert(rq->worker_backlog == 0);
+
+	// a post without a job tells a worker to exit.  The jobs that are already
+	// on the ring are taken first.
+	for (i=0; i<rq->workers; i++) {
+		sem_post(&rq->worker_sem);
+	}
+	for (i=0; i<rq->workers; i++) {
+		pthread_join(rq->worker_threads[i], NULL);
+	}
+	free(rq->worker_threads);
+	rq->worker_threads = NULL;
+	rq->workers = 0;
+
+	while ((msg = rq_ring_pop(rq->worker_done))) {
+		rq_worker_finish(rq, msg);
+	}
+	assert(rq->worker_inflight == 0);
+
+	event_free(rq->worker_event);
+	rq->worker_event = NULL;
+	close(rq->worker_efd);
+	rq->worker_efd = INVALID_HANDLE;
+	sem_destroy(&rq->worker_sem);
+
+	free(rq->worker_jobs);
+	free(rq->worker_done);
+	rq->worker_jobs = NULL;
+	rq->worker_done = NULL;
+}
+
+
+
+
+
+
+//-----------------------------------------------------------------------------
+// Move the payload that was received into the message.  If we are in
+// zero-copy mode, then the message gets a view of the payload which is still
+// sitting in the read buffer, otherwise the message takes the payload buffer.
+static void rq_data_movepayload(rq_data_t *data, rq_message_t *msg)
+{
+	assert(data);
+	assert(msg);
+	assert(msg->data == NULL);
+	assert(msg->borrowed == 0);
+
+	if (data->payload_ptr) {
+		assert(data->payload_len > 0);
+		assert(data->payload == NULL || BUF_LENGTH(data->payload) == 0);
+		memset(&msg->view, 0, sizeof(msg->view));
+		BUF_DATA(&msg->view) = data->payload_ptr;
+		BUF_LENGTH(&msg->view) = data->payload_len;
+		BUF_MAX(&msg->view) = data->payload_len;
+		msg->data = &msg->view;
+		msg->borrowed = 1;
+
+		data->payload_ptr = NULL;
+		data->payload_len = 0;
+	}
+	else {
+		assert(data->payload);
+		msg->data = data->payload;
+		data->payload = NULL;
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Throw away the payload that was received for a request or reply that we
+// arent going to deliver.  The buffer goes back to the pool, because the next
+// payload expects there to be no buffer waiting for it.
+static void rq_data_droppayload(rq_t *rq, rq_data_t *data)
+{
+	assert(rq);
+	assert(data);
+
+	if (data->payload) {
+		data->payload = rq_buf_return(rq, data->payload);
+		assert(data->payload == NULL);
+	}
+	data->payload_ptr = NULL;
+	data->payload_len = 0;
+}
+
+
+//-----------------------------------------------------------------------------
+// In zero-copy mode, if we have a payload that has not been attached to a
+// message by the time the buffer has been processed, then the rest of the
+// frame has not arrived yet.  The read buffer is about to be re-used, so we
+// need to take a copy of the payload.
+static void rq_data_settle(rq_t *rq, rq_data_t *data)
+{
+	assert(rq);
+	assert(data);
+
+	if (data->payload_ptr) {
+		assert(data->payload_len > 0);
+		if (data->payload == NULL) {
+			data->payload = rq_buf_get(rq, data->payload_len);
+			assert(data->payload);
+		}
+		expbuf_set(data->payload, data->payload_ptr, data->payload_len);
+		data->payload_ptr = NULL;
+		data->payload_len = 0;
+	}
+}
+
+
+static void cmdClear(void *ptr)
+{
+	rq_conn_t *conn = (rq_conn_t *) ptr;
+	assert(conn);
+	assert(conn->data);
+	
+	// every frame starts with a CLEAR.
+	conn->stats.frames_in ++;
+
+	conn->data->mask = 0;
+	conn->data->flags = 0;
+	
+	conn->data->id = 0;
+	conn->data->qid = 0;
+	conn->data->timeout = 0;
+	conn->data->priority = 0;
+
+	expbuf_clear(conn->data->queue);
+
+	if (conn->data->payload) {
+		expbuf_clear(conn->data->payload);
+	}
+
+	conn->data->payload_ptr = NULL;
+	conn->data->payload_len = 0;
+
+	conn->data->compressed = RQ_COMPRESS_NONE;
+	conn->data->rawsize = 0;
+	conn->data->trace_id = 0;
+}
+
+
+static void cmdPing(void *ptr)
+{
+	rq_conn_t *conn = (rq_conn_t *) ptr;
+	char buf;
+	
+	assert(conn);
+
+	// since we only need to send one char, its a bit silly to get an expanding buffer for it... so we'll do this one slightly different.
+	buf = RQ_CMD_PONG;
+
+	rq_senddata(conn, &buf, 1);
+}
+
+
+//-----------------------------------------------------------------------------
+// The controller has answered our heartbeat.  Measure how long it took.  The
+// average is smoothed over the last 8 or so.
+static void cmdPong(void *ptr)
+{
+	rq_conn_t *conn = (rq_conn_t *) ptr;
+	uint64_t rtt;
+
+	assert(conn);
+
+	if (conn->ping_time > 0) {
+		rtt = rq_now() - conn->ping_time;
+		if (rtt > UINT_MAX) { rtt = UINT_MAX; }
+		conn->stats.rtt = (unsigned int) rtt;
+		if (conn->stats.rtt_avg == 0) { conn->stats.rtt_avg = conn->stats.rtt; }
+		else {
+			conn->stats.rtt_avg = conn->stats.rtt_avg - (conn->stats.rtt_avg / 8) + (conn->stats.rtt / 8);
+		}
+
+		conn->ping_time = 0;
+		conn->hb_missed = 0;
+	}
+}
+
+
+
+
+
+static void cmdConsuming(void *ptr)
+{
+	rq_conn_t *conn = (rq_conn_t *) ptr;
+	rq_queue_t *q;
+	char *queue;
+	int qid;
+	
+	
+	assert(conn);
+	assert(conn->data);
+
+	if (BIT_TEST(conn->data->mask, RQ_DATA_MASK_QUEUEID)  && BIT_TEST(conn->data->mask, RQ_DATA_MASK_QUEUE)) {
+		queue = expbuf_string(conn->data->queue);
+		qid = conn->data->qid;
+
+		assert(queue);
+		assert(qid > 0);
+
+		// requests for this queue can now be sent with just the id.
+		rq_qidcache_add(conn->rq, queue, qid);
+
+		// it might not be a queue we are consuming, if the controller is just
+		// telling us what the id is.
+		q = rq_queue_find(conn->rq, queue);
+		if (q) {
+			rq_queue_setqid(conn->rq, q, qid);
+
+			// if we have an 'accepted' handler, then we need to call that too.
+			if (q->accepted) {
+				q->accepted(queue, qid, q->arg);
+			}
+		}
+	}
+	else {
+		// Not enough data.
+		assert(0);
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Tell the controller that we wont be handling a request it gave us.
+static void rq_send_undelivered(rq_conn_t *conn, msg_id_t msgid)
+{
+	assert(conn);
+	assert(msgid >= 0);
+
+	rq_ack_add(conn, msgid, RQ_CMD_UNDELIVERED);
+}
+
+
+static void cmdRequest(void *ptr)
+{
+	rq_conn_t *conn = (rq_conn_t *) ptr;
+	msg_id_t msgid;
+	queue_id_t qid = 0;
+	char *qname = NULL;
+	rq_queue_t *queue;
+	rq_message_t *msg;
+	
+	assert(conn);
+	assert(conn->data);
+
+	// the connection is going to be closed, so we dont need anything more from
+	// it.
+	if (conn->proto_error) { return; }
+	
+	if (BIT_TEST(conn->data->mask, RQ_DATA_MASK_ID) && BIT_TEST(conn->data->mask, RQ_DATA_MASK_PAYLOAD) && (BIT_TEST(conn->data->mask, RQ_DATA_MASK_QUEUEID) || BIT_TEST(conn->data->mask, RQ_DATA_MASK_QUEUE))) {
+
+		// get message ID
+		msgid = conn->data->id;
+		assert(msgid >= 0);
+
+		// get queue Id or queue name.
+		if (BIT_TEST(conn->data->mask, RQ_DATA_MASK_QUEUEID))
+			qid = conn->data->qid;
+		if (BIT_TEST(conn->data->mask, RQ_DATA_MASK_QUEUE))
+			qname = expbuf_string(conn->data->queue);
+		assert((qname == NULL && qid > 0) || (qname && qid == 0));
+
+		// find the queue to handle this request.
+		if (qid > 0) { queue = rq_queue_find_qid(conn->rq, qid); }
+		else { queue = rq_queue_find(conn->rq, qname); }
+
+		if (queue == NULL) {
+			// we dont seem to be consuming that queue...
+			rq_data_droppayload(conn->rq, conn->data);
+			rq_send_undelivered(conn, msgid);
+		}
+		else if (queue->cancelled) {
+			// the controller hadn't got the cancel yet.
+			queue->stats.refused ++;
+			rq_data_droppayload(conn->rq, conn->data);
+			rq_send_undelivered(conn, msgid);
+		}
+		else if (queue->max > 0 && queue->held >= queue->max) {
+			// we already have as many requests for this queue as we said we could
+			// handle, so we give it back, and the controller can give it to someone
+			// else.
+			queue->stats.refused ++;
+			rq_data_droppayload(conn->rq, conn->data);
+			rq_send_undelivered(conn, msgid);
+		}
+		else {
+			// let the controller know we have it.  The ack is sent with the others
+			// once this read has been processed.
+			rq_ack_add(conn, msgid, RQ_CMD_DELIVERED);
+
+			// get a new message object from the pool.
+			msg = rq_msg_new(conn->rq, conn);
+			assert(msg);
+			assert(msg->id >= 0);
+			assert(msg->src_id == -1);
+			assert(msg->state == rq_msgstate_new);
+
+			// fill out the message details, and add it to the head of the messages list.
+			assert(conn->data);
+			assert(queue && msgid >= 0);
+			msg->src_id = msgid;
+			if (BIT_TEST(conn->data->flags, RQ_DATA_FLAG_NOREPLY)) {
+				msg->noreply = 1;
+			}
+			if (BIT_TEST(conn->data->mask, RQ_DATA_MASK_TIMEOUT)) {
+				msg->timeout = conn->data->timeout * 1000;
+			}
+			if (BIT_TEST(conn->data->mask, RQ_DATA_MASK_TRACEID)) {
+				msg->trace_id = conn->data->trace_id;
+			}
+
+			// move the payload buffer to the message.
+			assert(msg->data == NULL);
+			assert(conn->data);
+			rq_data_movepayload(conn->data, msg);
+
+			msg->consumer = queue;
+			queue->held ++;
+			queue->stats.requests ++;
+			conn->rq->stats.received ++;
+			msg->state = rq_msgstate_delivering;
+
+			// in worker mode, the handler will be run by a worker thread, and the
+			// rest is done when it gives the message back.  The payload cant
+			// stay in the read buffer while that happens.
+			if (conn->rq->workers > 0) {
+				rq_msg_retain(msg);
+				rq_worker_dispatch(conn->rq, msg);
+				return;
+			}
+
+			RQ_TRACE(conn->rq, RQ_TRACE_REQUEST, request, msgid, msg->trace_id, BUF_LENGTH(msg->data));
+			queue->handler(msg, queue->arg);
+			RQ_TRACE(conn->rq, RQ_TRACE_HANDLED, handled, msgid, msg->trace_id, 0);
+
+			// if the message was NOREPLY, then we dont need to reply, and we can clear the message.
+			if (msg->noreply == 1) {
+				rq_msg_clear(msg);
+				msg = NULL;
+			}
+			else if (msg->state == rq_msgstate_replied) {
+				// we already have replied to this message.  Dont need to add it to
+				// the out-process, as that would already have been done.  So all we
+				// need to do is clear the message and return it to the pool.
+				rq_msg_clear(msg);
+				msg = NULL;
+			}
+			else {
+				// we called the handled, but it hasn't replied yet.  We will need to
+				// wait until it calls rq_reply, which can clean up this message
+				// object.
+				msg->state = rq_msgstate_delivered;
+
+				// if the payload is still pointing into the read buffer, it will not be
+				// valid once we return, so the message can no longer reference it.  If
+				// the handler needed it, it should have called rq_msg_retain().
+				if (msg->borrowed) {
+					msg->borrowed = 0;
+					msg->data = NULL;
+				}
+			}			
+		}
+	}
+	else {
+		// we dont have the required data to handle a request.
+		// TODO: This should be handled better.
+		assert(0);
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// The controller will return a DELIVERED command when a message has been
+// delivered to the consumer within the timeout period.  We will just mark it
+// as delivered.  The delivery messages are more useful to the controllers the
+// message passes through than the node that made the request.
+static void cmdDelivered(void *ptr)
+{
+	rq_conn_t *conn = (rq_conn_t *) ptr;
+	msg_id_t id;
+	rq_message_t *msg;
+	
+	assert(conn);
+	assert(conn->data);
+	
+	if (BIT_TEST(conn->data->mask, RQ_DATA_MASK_ID)) {
+
+		id = conn->data->id;
+		assert(id >= 0);
+
+		// make sure that the message exists.
+		assert(conn->rq);
+		assert(conn->rq->msg_list);
+		assert(id >= 0 && id < conn->rq->msg_max);
+		msg = conn->rq->msg_list[id].msg;
+		if (msg == NULL) {
+			// the request has already timed out.
+			assert(conn->rq->msg_list[id].next_free == RQ_MSGSLOT_EXPIRED);
+		}
+		else {
+			// make sure that it was a SENT message, and not a consumed one.
+			assert(msg->conn == NULL);
+			assert(msg->state == rq_msgstate_sent);
+			msg->state = rq_msgstate_delivered;
+			RQ_TRACE(conn->rq, RQ_TRACE_DELIVERED, delivered, id, msg->trace_id, 0);
+		}
+
+		// the controller is taking requests again.
+		conn->rq->full_backoff = 0;
+	}
+	else {
+		// we received a DELIVERED command, but we didn't have the required data also.
+		assert(0);
+	}
+}
+
+//-----------------------------------------------------------------------------
+// When the reply to a request comes in, we need to match it with the request
+// that was sent, and then using that information call the callback functions
+// with the payload.
+static void cmdReply(void *ptr)
+{
+	rq_conn_t *conn = (rq_conn_t *) ptr;
+	msg_id_t msgid;
+	rq_message_t *msg;
+	
+	assert(conn);
+	assert(conn->data);
+
+	// the connection is going to be closed, so we dont need anything more from
+	// it.
+	if (conn->proto_error) { return; }
+	
+	if (BIT_TEST(conn->data->mask, RQ_DATA_MASK_ID) && BIT_TEST(conn->data->mask, RQ_DATA_MASK_PAYLOAD)) {
+
+		// get message ID
+		msgid = conn->data->id;
+		assert(msgid >= 0);
+
+		// make sure this msgid is potentially legit.
+		assert(conn->rq);
+		assert(conn->rq->msg_list);
+		assert(conn->rq->msg_used > 0 || conn->rq->msg_expired > 0);
+		assert(conn->rq->msg_max > 0);
+		assert(msgid < conn->rq->msg_max);
+		assert(msgid != conn->rq->msg_next);
+
+		msg = conn->rq->msg_list[msgid].msg;
+		if (msg == NULL) {
+			// the request timed out before the reply arrived.  Now that it has, the
+			// id can be used again, and the reply can be thrown away.
+			rq_data_droppayload(conn->rq, conn->data);
+			rq_msglist_release(conn->rq, msgid);
+			return;
+		}
+
+		assert(msg->id == msgid);
+		assert(msg->src_id == -1);
+		assert(msg->conn == NULL);
+		assert(msg->state == rq_msgstate_delivered);
+
+		// replace the data buffer in the message, with the data buffer received with the reply.
+		assert(msg->data);
+		assert(msg->borrowed == 0);
+		assert(conn->data->payload || conn->data->payload_ptr);
+
+		msg->data = rq_buf_return(conn->rq, msg->data);
+		assert(msg->data == NULL);
+		rq_data_movepayload(conn->data, msg);
+
+		conn->rq->stats.replies ++;
+		RQ_TRACE(conn->rq, RQ_TRACE_REPLIED, replied, msgid, msg->trace_id, BUF_LENGTH(msg->data));
+		if (conn->rq->latency && msg->sent_time > 0) {
+			rq_hist_add(conn->rq->latency, rq_now() - msg->sent_time);
+		}
+
+		// if we have a reply handler, then we should call it, with the payload information.
+		if (msg->reply_handler) {
+			msg->reply_handler(msg);
+		}
+
+		// clear the message, retrun it to the pool.
+		rq_msg_clear(msg);
+		msg = NULL;
+	}
+	else {
+		// we dont have the required data to handle a request.
+		// TODO: This should be handled better.
+		assert(0);
+	}
+}
+
+
+
+static void cmdBroadcast(void *ptr)
+{
+	rq_conn_t *conn = (rq_conn_t *) ptr;
+	assert(conn);
+	assert(conn->data);
+
+	assert(0);
+}
+	
+// set the noreply flag.
+static void cmdNoreply(void *ptr)
+{
+	rq_conn_t *conn = (rq_conn_t *) ptr;
+
+	assert(conn);
+	assert(conn->data);
+	BIT_SET(conn->data->flags, RQ_DATA_FLAG_NOREPLY);	
+}
+
+//-----------------------------------------------------------------------------
+// By receiving the closing command from the controller, we should not get any
+// more queue requests to consume.  Also as soon as there are no more messages
+// waiting for replies, the controller will drop the connection.  Therefore,
+// when this command is processed, we need to initiate a connection to an
+// alternative controller that can receive requests.
+static void cmdClosing(void *ptr)
+{
+	rq_conn_t *conn = (rq_conn_t *) ptr;
+
+	assert(conn);
+	assert(conn->data);
+
+	// mark the connectiong as 'closing'.
+	assert(conn->closing == 0);
+	conn->closing ++;
+
+	// initialise the connection to the alternate controller.
+	assert(conn->rq);
+	rq_connect(conn->rq);
+}
+	
+//-----------------------------------------------------------------------------
+// The backoff after a SERVER_FULL is over, so we can send what has been
+// waiting.
+static void rq_full_handler(int fd, short int flags, void *arg)
+{
+	rq_t *rq = (rq_t *) arg;
+	rq_conn_t *conn;
+
+	assert(rq);
+	assert(rq->full_paused);
+
+	rq->full_paused = 0;
+
+	conn = ll_get_head(&rq->connlist);
+	if (conn && conn->active > 0 && conn->closing == 0) {
+		rq_pending_flush(conn);
+	}
+}
+
+//-----------------------------------------------------------------------------
+// The controller could not accept one of our requests because it is full.
+// The request is put back on the pending list, and we stop sending for a
+// while.  If it keeps happening, we wait longer each time.
+static void cmdServerFull(void *ptr)
+{
+	rq_conn_t *conn = (rq_conn_t *) ptr;
+	rq_message_t *msg;
+	rq_t *rq;
+	struct timeval tv;
+	msg_id_t id;
+
+	assert(conn);
+	assert(conn->data);
+	assert(conn->rq);
+	rq = conn->rq;
+
+	if (BIT_TEST(conn->data->mask, RQ_DATA_MASK_ID)) {
+		id = conn->data->id;
+		assert(id >= 0 && id < rq->msg_max);
+
+		msg = rq->msg_list[id].msg;
+		if (msg == NULL) {
+			// the request has already timed out, so now that we know it wont be
+			// replied to, the id can be used again.
+			rq_msglist_release(rq, id);
+		}
+		else {
+			assert(msg->conn == NULL);
+			assert(msg->src_id == -1);
+			assert(msg->state == rq_msgstate_sent);
+			msg->state = rq_msgstate_new;
+			rq_pending_add(rq, msg, 0);
+		}
+
+		if (rq->full_paused == 0) {
+			if (rq->full_backoff == 0) { rq->full_backoff = RQ_FULL_BACKOFF_MIN; }
+			else if (rq->full_backoff < RQ_FULL_BACKOFF_MAX) {
+				rq->full_backoff *= 2;
+				if (rq->full_backoff > RQ_FULL_BACKOFF_MAX) { rq->full_backoff = RQ_FULL_BACKOFF_MAX; }
+			}
+
+			if (rq->full_event == NULL) {
+				assert(rq->evbase);
+				rq->full_event = evtimer_new(rq->evbase, rq_full_handler, rq);
+				assert(rq->full_event);
+			}
+			tv.tv_sec = rq->full_backoff / 1000;
+			tv.tv_usec = (rq->full_backoff % 1000) * 1000;
+			evtimer_add(rq->full_event, &tv);
+			rq->full_paused = 1;
+		}
+	}
+	else {
+		// we received a SERVER_FULL command, but we didn't have the required data also.
+		assert(0);
+	}
+}
+	
+static void cmdID(void *ptr, risp_int_t value)
+{
+	rq_conn_t *conn = (rq_conn_t *) ptr;
+	
+	assert(conn);
+	assert(value >= 0 && value <= 0xffff);
+	assert(conn->data);
+	
+	conn->data->id = value;
+	BIT_SET(conn->data->mask, RQ_DATA_MASK_ID);
+}
+	
+static void cmdQueueID(void *ptr, risp_int_t value)
+{
+	rq_conn_t *conn = (rq_conn_t *) ptr;
+	
+	assert(conn);
+	assert(value > 0 && value <= 0xffff);
+	assert(conn->data);
+	
+	conn->data->qid = value;
+	BIT_SET(conn->data->mask, RQ_DATA_MASK_QUEUEID);
+
+}
+	
+static void cmdTimeout(void *ptr, risp_int_t value)
+{
+	rq_conn_t *conn = (rq_conn_t *) ptr;
+	
+	assert(conn);
+	assert(value > 0 && value <= 0xffff);
+	assert(conn->data);
+	
+	conn->data->timeout = value;
+	BIT_SET(conn->data->mask, RQ_DATA_MASK_TIMEOUT);
+}
+	
+static void cmdPriority(void *ptr, risp_int_t value)
+{
+	rq_conn_t *conn = (rq_conn_t *) ptr;
+
+	assert(conn);
+	assert(value > 0 && value <= 0xffff);
+	assert(conn->data);
+	
+	conn->data->priority = value;
+	BIT_SET(conn->data->mask, RQ_DATA_MASK_PRIORITY);
+}
+	
+//-----------------------------------------------------------------------------
+// The controller has answered our COMPRESS with the method it will use.  It
+// can only pick one we offered.
+static void cmdCompress(void *ptr, risp_int_t value)
+{
+	rq_conn_t *conn = (rq_conn_t *) ptr;
+
+	assert(conn);
+	assert(conn->rq);
+
+	if ((value != RQ_COMPRESS_NONE && value != RQ_COMPRESS_LZ4 && value != RQ_COMPRESS_ZSTD) || (value & ~conn->rq->compress_methods) != 0) {
+		conn->proto_error = 1;
+		return;
+	}
+
+	conn->compress = value;
+}
+
+static void cmdCompressed(void *ptr, risp_int_t value)
+{
+	rq_conn_t *conn = (rq_conn_t *) ptr;
+
+	assert(conn);
+	assert(conn->data);
+
+	if (value != RQ_COMPRESS_LZ4 && value != RQ_COMPRESS_ZSTD) {
+		conn->proto_error = 1;
+		return;
+	}
+
+	conn->data->compressed = value;
+	BIT_SET(conn->data->mask, RQ_DATA_MASK_COMPRESSED);
+}
+
+static void cmdTraceID(void *ptr, risp_int_t value)
+{
+	rq_conn_t *conn = (rq_conn_t *) ptr;
+
+	assert(conn);
+	assert(conn->data);
+
+	conn->data->trace_id = (uint32_t) value;
+	BIT_SET(conn->data->mask, RQ_DATA_MASK_TRACEID);
+}
+
+static void cmdRawSize(void *ptr, risp_int_t value)
+{
+	rq_conn_t *conn = (rq_conn_t *) ptr;
+
+	assert(conn);
+	assert(conn->data);
+	assert(conn->rq);
+
+	// we dont let a compressed payload grow to more than the read buffer is
+	// allowed to.
+	if (value <= 0 || value > conn->rq->readbuf_max) {
+		conn->proto_error = 1;
+		return;
+	}
+
+	conn->data->rawsize = value;
+	BIT_SET(conn->data->mask, RQ_DATA_MASK_RAWSIZE);
+}
+
+static void cmdPayload(void *ptr, risp_length_t length, risp_data_t *data)
+{
+	rq_conn_t *conn = (rq_conn_t *) ptr;
+	
+	assert(conn && length > 0 && data);
+
+	assert(conn->data);
+	assert(conn->rq);
+	if (BIT_TEST(conn->data->mask, RQ_DATA_MASK_COMPRESSED)) {
+		// the payload is uncompressed into its own buffer, so even in zero-copy
+		// mode there is nothing to leave in the read buffer.
+		if (BIT_TEST(conn->data->mask, RQ_DATA_MASK_RAWSIZE) == 0) {
+			conn->proto_error = 1;
+			return;
+		}
+		if (conn->data->payload == NULL) {
+			conn->data->payload = rq_buf_get(conn->rq, conn->data->rawsize);
+			assert(conn->data->payload);
+		}
+		if (rq_decompress(conn->rq, conn->data->compressed, (char *) data, length, conn->data->rawsize, conn->data->payload) != 0) {
+			// the controller sent us something we cant read.
+			conn->proto_error = 1;
+			return;
+		}
+	}
+	else if (conn->rq->zerocopy) {
+		// leave the payload in the read buffer.  It will be attached to the
+		// message as a view when the REQUEST or REPLY command is processed.
+		conn->data->payload_ptr = (char *) data;
+		conn->data->payload_len = length;
+	}
+	else {
+		assert(conn->data->payload == NULL);
+		if (conn->data->payload == NULL) {
+			conn->data->payload = rq_buf_get(conn->rq, length);
+			assert(conn->data->payload);
+		}
+		expbuf_set(conn->data->payload, data, length);
+	}
+	BIT_SET(conn->data->mask, RQ_DATA_MASK_PAYLOAD);
+// 	fprintf(stderr, "Payload. len=%d\n", length);
+}
+
+
+static void cmdQueue(void *ptr, risp_length_t length, risp_data_t *data)
+{
+	rq_conn_t *conn = (rq_conn_t *) ptr;
+	
+ 	assert(conn && length > 0 && data);
+
+ 	assert(conn->data);
+ 	assert(conn->data->queue);
+ 	expbuf_set(conn->data->queue, data, length);
+ 	BIT_SET(conn->data->mask, RQ_DATA_MASK_QUEUE);
+}
+
+
+#ifdef RQ_RISP_INLINE
+//-----------------------------------------------------------------------------
+// Built-in parser for the rq protocol, used instead of risp_process() when
+// librq is built with RISP_INLINE=1.  It decodes the same encoding as librisp
+// (the top 3 bits of the command say what kind of parameter follows), but
+// dispatches with a switch so that the compiler can inline the handlers
+// rather than calling them through librisp's function table.  Commands we
+// dont know about are skipped.  A command that has not completely arrived is
+// left in the buffer for the next read.  Returns the number of bytes
+// processed.
+static int rq_risp_process(rq_conn_t *conn, int length, const unsigned char *data)
+{
+	const unsigned char *ptr, *end, *str;
+	unsigned char cmd;
+	uint16_t v16;
+	uint32_t v32;
+	risp_int_t value;
+	risp_length_t len;
+	size_t avail, size;
+
+	assert(conn);
+	assert(length >= 0);
+	assert(data || length == 0);
+
+	ptr = data;
+	end = data + length;
+	while (ptr < end && conn->proto_error == 0) {
+		cmd = *ptr;
+		avail = (end - ptr) - 1;
+		value = 0;
+		len = 0;
+		str = NULL;
+
+		// work out how big the command is, and get its parameter, if it has one.
+		if (cmd < 64) {
+			size = 1;
+		}
+		else if (cmd < 96) {
+			if (avail < 1) break;
+			value = ptr[1];
+			size = 2;
+		}
+		else if (cmd < 128) {
+			if (avail < 2) break;
+			memcpy(&v16, ptr + 1, 2);
+			value = ntohs(v16);
+			size = 3;
+		}
+		else if (cmd < 160) {
+			if (avail < 4) break;
+			memcpy(&v32, ptr + 1, 4);
+			value = (risp_int_t) ntohl(v32);
+			size = 5;
+		}
+		else if (cmd < 192) {
+			if (avail < 1) break;
+			len = ptr[1];
+			if (avail < 1 + (size_t) len) break;
+			str = ptr + 2;
+			size = 2 + len;
+		}
+		else if (cmd < 224) {
+			if (avail < 2) break;
+			memcpy(&v16, ptr + 1, 2);
+			len = ntohs(v16);
+			if (avail < 2 + (size_t) len) break;
+			str = ptr + 3;
+			size = 3 + len;
+		}
+		else {
+			if (avail < 4) break;
+			memcpy(&v32, ptr + 1, 4);
+			len = ntohl(v32);
+			if (avail < 4 + (size_t) len) break;
+			str = ptr + 5;
+			size = 5 + len;
+		}
+
+		switch (cmd) {
+			case RQ_CMD_CLEAR:        cmdClear(conn);                  break;
+			case RQ_CMD_PING:         cmdPing(conn);                   break;
+			case RQ_CMD_PONG:         cmdPong(conn);                   break;
+			case RQ_CMD_REQUEST:      cmdRequest(conn);                break;
+			case RQ_CMD_REPLY:        cmdReply(conn);                  break;
+			case RQ_CMD_DELIVERED:    cmdDelivered(conn);              break;
+			case RQ_CMD_BROADCAST:    cmdBroadcast(conn);              break;
+			case RQ_CMD_NOREPLY:      cmdNoreply(conn);                break;
+			case RQ_CMD_CLOSING:      cmdClosing(conn);                break;
+			case RQ_CMD_CONSUMING:    cmdConsuming(conn);              break;
+			case RQ_CMD_SERVER_FULL:  cmdServerFull(conn);             break;
+			case RQ_CMD_ID:           cmdID(conn, value);              break;
+			case RQ_CMD_QUEUEID:      cmdQueueID(conn, value);         break;
+			case RQ_CMD_TIMEOUT:      cmdTimeout(conn, value);         break;
+			case RQ_CMD_PRIORITY:     cmdPriority(conn, value);        break;
+			case RQ_CMD_COMPRESS:     cmdCompress(conn, value);        break;
+			case RQ_CMD_COMPRESSED:   cmdCompressed(conn, value);      break;
+			case RQ_CMD_RAWSIZE:      cmdRawSize(conn, value);         break;
+			case RQ_CMD_TRACEID:      cmdTraceID(conn, value);         break;
+			case RQ_CMD_QUEUE:        cmdQueue(conn, len, (risp_data_t *) str);   break;
+			case RQ_CMD_PAYLOAD:      cmdPayload(conn, len, (risp_data_t *) str); break;
+			default:
+				break;
+		}
+
+		ptr += size;
+	}
+
+	assert(ptr <= end);
+	return(ptr - data);
+}
+#endif
+
+
+
+//-----------------------------------------------------------------------------
+// Put the id of a request that had expired back on the free-id stack.
+static void rq_msglist_release(rq_t *rq, msg_id_t id)
+{
+	assert(rq);
+	assert(id >= 0 && id < rq->msg_max);
+	assert(rq->msg_list[id].msg == NULL);
+	assert(rq->msg_list[id].next_free == RQ_MSGSLOT_EXPIRED);
+	assert(rq->msg_expired > 0);
+
+	rq->msg_list[id].next_free = rq->msg_next;
+	rq->msg_next = id;
+	rq->msg_expired --;
+}
+
+//-----------------------------------------------------------------------------
+// Release all the ids held by expired requests.  This is only done when the
+// connection is lost, so it doesnt matter that we need to scan the table.
+static void rq_msglist_release_expired(rq_t *rq)
+{
+	int i;
+
+	assert(rq);
+
+	for (i=0; i<rq->msg_max && rq->msg_expired > 0; i++) {
+		if (rq->msg_list[i].msg == NULL && rq->msg_list[i].next_free == RQ_MSGSLOT_EXPIRED) {
+			rq_msglist_release(rq, i);
+		}
+	}
+	assert(rq->msg_expired == 0);
+}
+
+
+//-----------------------------------------------------------------------------
+// Grow the message table to 'max' slots, and push the new slots onto the
+// free-id stack.  They are pushed in reverse so that the lowest ids are used
+// first.
+static void rq_msglist_grow(rq_t *rq, int max)
+{
+	int i;
+
+	assert(rq);
+	assert(max > rq->msg_max);
+
+	rq->msg_list = (rq_msgslot_t *) realloc(rq->msg_list, sizeof(rq_msgslot_t) * max);
+	assert(rq->msg_list);
+
+	for (i = max - 1; i >= rq->msg_max; i--) {
+		rq->msg_list[i].msg = NULL;
+		rq->msg_list[i].next_free = rq->msg_next;
+		rq->msg_next = i;
+	}
+	rq->msg_max = max;
+}
+
+
+//-----------------------------------------------------------------------------
+// (Re)arm the timer that drives the wheel.
+static void rq_wheel_arm(rq_t *rq)
+{
+	struct timeval tv;
+
+	assert(rq);
+	assert(rq->evbase);
+	assert(rq->wheel_event);
+
+	tv.tv_sec = 0;
+	tv.tv_usec = RQ_WHEEL_TICK * 1000;
+	evtimer_add(rq->wheel_event, &tv);
+}
+
+//-----------------------------------------------------------------------------
+// A request has timed out.  If it is still waiting to be sent, we take it off
+// the pending list.  If it has been sent, then its id cant be re-used until
+// we know the reply wont arrive.  Then it is failed.
+static void rq_msg_expire(rq_message_t *msg)
+{
+	assert(msg);
+	assert(msg->rq);
+	assert(msg->timer_set == 0);
+	assert(msg->src_id == -1);
+
+	if (msg->state == rq_msgstate_pending) {
+		rq_pending_remove(msg->rq, msg);
+	}
+	else {
+		assert(msg->state == rq_msgstate_sent || msg->state == rq_msgstate_delivered);
+		msg->expired = 1;
+	}
+	msg->rq->stats.expired ++;
+
+	rq_msg_fail(msg);
+}
+
+//-----------------------------------------------------------------------------
+// Take a message out of the timer wheel.
+static void rq_timer_remove(rq_message_t *msg)
+{
+	rq_t *rq;
+
+	assert(msg);
+	assert(msg->rq);
+	assert(msg->timer_set);
+	rq = msg->rq;
+
+	if (msg->wheel_prev) { msg->wheel_prev->wheel_next = msg->wheel_next; }
+	else {
+		assert(rq->wheel[msg->expires % RQ_WHEEL_SLOTS] == msg);
+		rq->wheel[msg->expires % RQ_WHEEL_SLOTS] = msg->wheel_next;
+	}
+	if (msg->wheel_next) { msg->wheel_next->wheel_prev = msg->wheel_prev; }
+	msg->wheel_prev = NULL;
+	msg->wheel_next = NULL;
+	msg->timer_set = 0;
+
+	assert(rq->wheel_count > 0);
+	rq->wheel_count --;
+	if (rq->wheel_count == 0) {
+		assert(rq->wheel_event);
+		evtimer_del(rq->wheel_event);
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Put a message in the timer wheel, in the slot for the tick that it will
+// expire on.
+static void rq_timer_add(rq_message_t *msg)
+{
+	rq_t *rq;
+	unsigned int ticks;
+
+	assert(msg);
+	assert(msg->rq);
+	assert(msg->timeout > 0);
+	assert(msg->timer_set == 0);
+	rq = msg->rq;
+
+	// if the wheel isn't running, then it doesn't matter where it is up to.
+	// We start it from now.
+	if (rq->wheel_count == 0) {
+		rq->wheel_time = rq_now();
+		if (rq->wheel_event == NULL) {
+			assert(rq->evbase);
+			rq->wheel_event = evtimer_new(rq->evbase, rq_wheel_handler, rq);
+			assert(rq->wheel_event);
+		}
+		rq_wheel_arm(rq);
+	}
+
+	ticks = (msg->timeout + RQ_WHEEL_TICK - 1) / RQ_WHEEL_TICK;
+	msg->expires = rq->wheel_tick + ticks;
+	msg->wheel_prev = NULL;
+	msg->wheel_next = rq->wheel[msg->expires % RQ_WHEEL_SLOTS];
+	if (msg->wheel_next) { msg->wheel_next->wheel_prev = msg; }
+	rq->wheel[msg->expires % RQ_WHEEL_SLOTS] = msg;
+	msg->timer_set = 1;
+	rq->wheel_count ++;
+}
+
+//-----------------------------------------------------------------------------
+// The wheel timer has fired.  We move the wheel forward for every tick that
+// has passed, and expire the messages in each slot that are due.  Messages in
+// the slot that are due on a later turn of the wheel are left there.
+static void rq_wheel_handler(int fd, short int flags, void *arg)
+{
+	rq_t *rq = (rq_t *) arg;
+	rq_message_t *msg;
+	uint64_t now;
+
+	assert(rq);
+
+	now = rq_now();
+	while (rq->wheel_count > 0 && rq->wheel_time + (RQ_WHEEL_TICK * 1000) <= now) {
+		rq->wheel_time += RQ_WHEEL_TICK * 1000;
+		rq->wheel_tick ++;
+
+		// the fail handler can send or clear other messages, so after expiring
+		// one, we start again from the top of the slot.
+		msg = rq->wheel[rq->wheel_tick % RQ_WHEEL_SLOTS];
+		while (msg) {
+			if ((int) (msg->expires - rq->wheel_tick) <= 0) {
+				rq_timer_remove(msg);
+				rq_msg_expire(msg);
+				msg = rq->wheel[rq->wheel_tick % RQ_WHEEL_SLOTS];
+			}
+			else {
+				msg = msg->wheel_next;
+			}
+		}
+	}
+
+	if (rq->wheel_count > 0) {
+		rq_wheel_arm(rq);
+	}
+}
+
+
+// Initialise an RQ structure.  
+void rq_init(rq_t *rq)
+{
+	assert(rq);
+
+	rq->evbase = NULL;
+	rq->zerocopy = 0;
+
+	rq->readbuf_init = RQ_DEFAULT_BUFFSIZE;
+	rq->readbuf_max = RQ_DEFAULT_READBUF_MAX;
+	rq->readbuf_shrink = RQ_DEFAULT_READBUF_SHRINK;
+	rq->connect_timeout = RQ_DEFAULT_CONNECT_TIMEOUT;
+	rq->connect_parallel = 1;
+
+	rq->workers = 0;
+	rq->worker_threads = NULL;
+	rq->worker_jobs = NULL;
+	rq->worker_done = NULL;
+	rq->worker_efd = INVALID_HANDLE;
+	rq->worker_event = NULL;
+	rq->worker_wake = 0;
+	rq->worker_inflight = 0;
+	rq->worker_backlog = 0;
+	rq->shutdown = 0;
+
+	rq->full_backoff = 0;
+	rq->full_paused = 0;
+	rq->full_event = NULL;
+
+	memset(&rq->stats, 0, sizeof(rq->stats));
+	rq->latency = NULL;
+
+	rq->heartbeat_interval = 0;
+	rq->heartbeat_missed = RQ_DEFAULT_HEARTBEAT_MISSED;
+
+	rq->dns = NULL;
+	rq->dns_owned = 0;
+	rq->dns_ttl = RQ_DEFAULT_DNS_TTL;
+
+	rq->io = &rq_io_libevent;
+	rq->io_data = NULL;
+
+	rq->trace_handler = NULL;
+	rq->trace_arg = NULL;
+	rq->trace_sample = 0;
+	rq->trace_count = 0;
+	rq->trace_seed = 0;
+
+	rq->draining = 0;
+	rq->drain_start = 0;
+	rq->drain_deadline = 0;
+	rq->drain_report = 0;
+	rq->drain_event = NULL;
+	rq->drain_handler = NULL;
+	rq->drain_arg = NULL;
+
+	rq->budget_conn = 0;
+	rq->budget_send = 0;
+	rq->budget_pool = 0;
+	rq->held_bytes = 0;
+	rq->unwritable = 0;
+	rq->writable_handler = NULL;
+	rq->writable_arg = NULL;
+
+	rq->sock_sndbuf = 0;
+	rq->sock_rcvbuf = 0;
+	rq->sock_flags = RQ_SOCKET_NODELAY;
+
+	rq->compress_methods = RQ_COMPRESS_NONE;
+	rq->compress_threshold = RQ_DEFAULT_COMPRESS_THRESHOLD;
+	rq->compress_buf = NULL;
+	rq->zstd_cctx = NULL;
+	rq->zstd_dctx = NULL;
+	rq->zstd_cdict = NULL;
+	rq->zstd_ddict = NULL;
+
+	// setup the risp processor.
+	rq->risp = risp_init(NULL);
+	risp_add_command(rq->risp, RQ_CMD_CLEAR,        &cmdClear);
+	risp_add_command(rq->risp, RQ_CMD_PING,         &cmdPing);
+	risp_add_command(rq->risp, RQ_CMD_PONG,         &cmdPong);
+	risp_add_command(rq->risp, RQ_CMD_REQUEST,      &cmdRequest);
+	risp_add_command(rq->risp, RQ_CMD_REPLY,        &cmdReply);
+	risp_add_command(rq->risp, RQ_CMD_DELIVERED,    &cmdDelivered);
+	risp_add_command(rq->risp, RQ_CMD_BROADCAST,    &cmdBroadcast);
+	risp_add_command(rq->risp, RQ_CMD_NOREPLY,      &cmdNoreply);
+	risp_add_command(rq->risp, RQ_CMD_CLOSING,      &cmdClosing);
+	risp_add_command(rq->risp, RQ_CMD_CONSUMING,    &cmdConsuming);
+	risp_add_command(rq->risp, RQ_CMD_SERVER_FULL,  &cmdServerFull);
+	risp_add_command(rq->risp, RQ_CMD_ID,           &cmdID);
+	risp_add_command(rq->risp, RQ_CMD_QUEUEID,      &cmdQueueID);
+	risp_add_command(rq->risp, RQ_CMD_TIMEOUT,      &cmdTimeout);
+	risp_add_command(rq->risp, RQ_CMD_PRIORITY,     &cmdPriority);
+	risp_add_command(rq->risp, RQ_CMD_QUEUE,        &cmdQueue);
+	risp_add_command(rq->risp, RQ_CMD_COMPRESS,     &cmdCompress);
+	risp_add_command(rq->risp, RQ_CMD_COMPRESSED,   &cmdCompressed);
+	risp_add_command(rq->risp, RQ_CMD_RAWSIZE,      &cmdRawSize);
+	risp_add_command(rq->risp, RQ_CMD_TRACEID,      &cmdTraceID);
+	risp_add_command(rq->risp, RQ_CMD_PAYLOAD,      &cmdPayload);
+
+	ll_init(&rq->connlist);
+	ll_init(&rq->queues);
+
+	rq->queue_index = NULL;
+	rq->queue_index_max = 0;
+	memset(rq->queue_hash, 0, sizeof(rq->queue_hash));
+	memset(rq->qid_cache, 0, sizeof(rq->qid_cache));
+	rq->qid_gen = 0;
+
+	// create an array of DEFAULT_MSG_ARRAY items;
+	assert(DEFAULT_MSG_ARRAY > 0);
+	rq->msg_list = NULL;
+	rq->msg_max = 0;
+	rq->msg_used = 0;
+	rq->msg_next = -1;
+	rq->msg_live = NULL;
+	rq_msglist_grow(rq, DEFAULT_MSG_ARRAY);
+
+	rq->pending_head = NULL;
+	rq->pending_tail = NULL;
+	rq->pending_bytes = 0;
+	rq->pending_max = RQ_DEFAULT_PENDING_MAX;
+
+	rq->msg_expired = 0;
+	memset(rq->wheel, 0, sizeof(rq->wheel));
+	rq->wheel_tick = 0;
+	rq->wheel_time = 0;
+	rq->wheel_count = 0;
+	rq->wheel_event = NULL;
+	assert(rq->msg_max == DEFAULT_MSG_ARRAY);
+	assert(rq->msg_next == 0);
+
+	rq->msg_pool = ll_init(NULL);
+	assert(rq->msg_pool);
+
+	rq_bufpool_init(&rq->bufpool, RQ_BUFPOOL_DEFAULT_MAX);
+}
+
+
+
+
+//-----------------------------------------------------------------------------
+// Return a new message struct.  Will get one from the mempool if there are any
+// available, otherwise it will create a new entry.  Cannot assume that
+// anything left in the mempool has any valid data, so will initialise it as if
+// it was a fresh allocation.  The message will need to be applied to the
+// message list.  Even incoming messages need to be placed on the list in case
+// it receives cancel commands for it.
+rq_message_t * rq_msg_new(rq_t *rq, rq_conn_t *conn)
+{
+	rq_message_t *msg;
+
+	// need to get a message struct from the mempool.
+	assert(rq);
+	assert(rq->msg_pool);
+	msg = ll_pop_head(rq->msg_pool);
+	if (msg == NULL) {
+		// there wasnt any messages available in the pool, so we need to create one.
+		msg = (rq_message_t *) malloc(sizeof(rq_message_t));
+		rq->stats.msgpool_misses ++;
+	}
+	else {
+		rq->stats.msgpool_hits ++;
+	}
+
+	assert(msg);
+	msg->rq = rq;
+	msg->queue = NULL;
+	msg->id = -1;
+	msg->src_id = -1;
+	msg->broadcast = 0;
+	msg->noreply = 0;
+	msg->borrowed = 0;
+	msg->state = rq_msgstate_new;
+	msg->conn = conn;
+	msg->reply_handler = NULL;
+	msg->fail_handler = NULL;
+	msg->arg = NULL;
+	msg->pending_next = NULL;
+	msg->timeout = 0;
+	msg->expired = 0;
+	msg->timer_set = 0;
+	msg->wheel_prev = NULL;
+	msg->wheel_next = NULL;
+	msg->consumer = NULL;
+	msg->reply = NULL;
+	msg->sent_time = 0;
+	msg->tmpl = NULL;
+	msg->trace_id = 0;
+	msg->held_bytes = 0;
+
+	// if we are supplied with a 'conn' it means we know which connection the
+	// message came from, which means it is already fully formed, and we wont
+	// need a data buffer, because the data is already in a buffer which we will
+	// be assigned.   If conn is null, it means that we are building a message
+	// and will therefore need a data buffer.
+	if (conn) { msg->data = NULL; }
+	else { msg->data = rq_buf_get(rq, 0); }
+
+	// add the message to the message list.  If there are no free ids left,
+	// then we double the size of the list.
+	assert(rq->msg_list);
+	assert(rq->msg_max > 0);
+	assert(rq->msg_used >= 0 && rq->msg_used <= rq->msg_max);
+	if (rq->msg_next < 0) {
+		assert(rq->msg_used + rq->msg_expired == rq->msg_max);
+		rq_msglist_grow(rq, rq->msg_max * 2);
+	}
+
+	assert(rq->msg_next >= 0 && rq->msg_next < rq->msg_max);
+	assert(rq->msg_list[rq->msg_next].msg == NULL);
+	msg->id = rq->msg_next;
+	rq->msg_next = rq->msg_list[msg->id].next_free;
+	rq->msg_list[msg->id].msg = msg;
+	rq->msg_list[msg->id].next_free = -1;
+
+	// and add it to the list of live messages.
+	msg->live_prev = NULL;
+	msg->live_next = rq->msg_live;
+	if (rq->msg_live) { rq->msg_live->live_prev = msg; }
+	rq->msg_live = msg;
+
+	assert(rq->msg_used >= 0);
+	rq->msg_used ++;
+	if (rq->msg_used > rq->stats.msg_peak) { rq->stats.msg_peak = rq->msg_used; }
+	assert(rq->msg_used > 0 && rq->msg_used <= rq->msg_max);
+
+	assert(msg);
+	return(msg);
+}
+
+
+//-----------------------------------------------------------------------------
+// Create 'count' new messages to be sent.  The message table is grown once
+// to fit all of them, rather than as it fills up.
+void rq_msg_new_batch(rq_t *rq, rq_message_t **msgs, int count)
+{
+	int need, max, i;
+
+	assert(rq);
+	assert(msgs);
+	assert(count > 0);
+
+	need = rq->msg_used + rq->msg_expired + count;
+	if (need > rq->msg_max) {
+		max = rq->msg_max;
+		while (max < need) { max *= 2; }
+		rq_msglist_grow(rq, max);
+	}
+
+	for (i=0; i<count; i++) {
+		msgs[i] = rq_msg_new(rq, NULL);
+		assert(msgs[i]);
+	}
+}
+
+//-----------------------------------------------------------------------------
+// clean up the resources used by the message so that it can be used again.  We
+// will return the data buffer to the bufpool so that it can be used for
+// payloads of future messages.  We will also return the message to the message
+// pool.
+void rq_msg_clear(rq_message_t *msg)
+{
+	assert(msg);
+
+	// remove the message from the msg_list.
+	assert(msg->rq);
+	assert(msg->rq->msg_list);
+	assert(msg->rq->msg_used > 0);
+	assert(msg->id >= 0);
+	assert(msg->id < msg->rq->msg_max);
+	assert(msg->rq->msg_list[msg->id].msg == msg);
+	msg->rq->msg_list[msg->id].msg = NULL;
+	if (msg->expired) {
+		// the reply might still arrive, so the id cant be used yet.
+		msg->rq->msg_list[msg->id].next_free = RQ_MSGSLOT_EXPIRED;
+		msg->rq->msg_expired ++;
+	}
+	else {
+		msg->rq->msg_list[msg->id].next_free = msg->rq->msg_next;
+		msg->rq->msg_next = msg->id;
+	}
+	msg->rq->msg_used--;
+	if (msg->rq->draining && msg->rq->msg_used == 0) {
+		rq_drain_wake(msg->rq);
+	}
+
+	if (msg->timer_set) {
+		rq_timer_remove(msg);
+	}
+	msg->timeout = 0;
+	msg->expired = 0;
+
+	assert(msg->reply == NULL);
+	msg->tmpl = NULL;
+	if (msg->consumer) {
+		assert(msg->consumer->held > 0);
+		msg->consumer->held --;
+		if (msg->rq->draining && msg->consumer->held == 0) {
+			rq_drain_wake(msg->rq);
+		}
+		msg->consumer = NULL;
+	}
+
+	if (msg->live_prev) { msg->live_prev->live_next = msg->live_next; }
+	else {
+		assert(msg->rq->msg_live == msg);
+		msg->rq->msg_live = msg->live_next;
+	}
+	if (msg->live_next) { msg->live_next->live_prev = msg->live_prev; }
+	msg->live_prev = NULL;
+	msg->live_next = NULL;
+	
+	msg->id = -1;
+	msg->broadcast = 0;
+	msg->noreply = 0;
+	msg->queue = NULL;
+	msg->state = rq_msgstate_new;
+
+	if (msg->held_bytes > 0) {
+		msg->rq->held_bytes -= msg->held_bytes;
+		assert(msg->rq->held_bytes >= 0);
+		msg->held_bytes = 0;
+		if (msg->rq->unwritable) {
+			rq_budget_check(msg->rq);
+		}
+	}
+
+	// clear the buffer, if we have one allocated.  If the data is only a view
+	// of the read buffer, then there is nothing to free.
+	if (msg->borrowed) {
+		assert(msg->data == &msg->view);
+		msg->borrowed = 0;
+		msg->data = NULL;
+	}
+	else if (msg->data) {
+		msg->data = rq_buf_return(msg->rq, msg->data);
+		assert(msg->data == NULL);
+	}
+	
+	// return the message to the msgpool, unless that would put the pools over
+	// their budget.
+	assert(msg->rq);
+	assert(msg->rq->msg_pool);
+	if (rq_pool_over(msg->rq, sizeof(rq_message_t))) {
+		free(msg);
+	}
+	else {
+		ll_push_head(msg->rq->msg_pool, msg);
+	}
+}
+
+
+void rq_msg_setqueue(rq_message_t *msg, const char *queue)
+{
+	assert(msg != NULL);
+	assert(queue != NULL);
+	assert(msg->queue == NULL);
+
+	msg->queue = queue;
+}
+
+
+void rq_msg_setbroadcast(rq_message_t *msg)
+{
+	assert(msg != NULL);
+	assert(msg->broadcast == 0);
+
+	msg->broadcast = 1;
+}
+
+void rq_msg_setnoreply(rq_message_t *msg)
+{
+	assert(msg != NULL);
+	assert(msg->noreply == 0);
+
+	msg->noreply = 1;
+}
+
+
+//-----------------------------------------------------------------------------
+// Set a timeout (in milliseconds) for a request that is about to be sent.  If
+// the reply hasn't been received within that time, the fail handler given to
+// rq_send() will be called.  The controller is also told about the timeout
+// (in seconds).
+void rq_msg_settimeout(rq_message_t *msg, int msecs)
+{
+	assert(msg);
+	assert(msecs > 0);
+	assert(msg->conn == NULL);
+	assert(msg->state == rq_msgstate_new);
+
+	msg->timeout = msecs;
+}
+
+
+//-----------------------------------------------------------------------------
+// Give a request a trace id, so that it (and its reply) can be followed.  A
+// consumer that sends requests of its own while handling one would normally
+// pass the trace id of the request it is handling along to them.
+void rq_msg_settraceid(rq_message_t *msg, uint32_t trace_id)
+{
+	assert(msg);
+	assert(msg->conn == NULL);
+	assert(msg->state == rq_msgstate_new);
+
+	msg->trace_id = trace_id;
+}
+
+
+//-----------------------------------------------------------------------------
+// Return the trace id of a message (0 if it isn't being traced).
+uint32_t rq_msg_traceid(rq_message_t *msg)
+{
+	assert(msg);
+	return(msg->trace_id);
+}
+
+
+//-----------------------------------------------------------------------------
+// Re-encode the prefix of a template after it has changed.
+static void rq_template_encode(rq_template_t *tmpl)
+{
+	assert(tmpl);
+	assert(tmpl->prefix);
+	assert(tmpl->queue);
+
+	expbuf_clear(tmpl->prefix);
+	addCmd(tmpl->prefix, RQ_CMD_CLEAR);
+	rq_encode_header(tmpl->prefix, tmpl->queue, strlen(tmpl->queue), tmpl->qid, tmpl->timeout, tmpl->noreply);
+}
+
+
+//-----------------------------------------------------------------------------
+// Create a send template for a queue.  Messages given the template with
+// rq_msg_settemplate() are sent to the queue with the flags and timeout of
+// the template, without having to encode them each time.
+rq_template_t * rq_template_new(rq_t *rq, const char *queue)
+{
+	rq_template_t *tmpl;
+
+	assert(rq);
+	assert(queue);
+	assert(strlen(queue) > 0 && strlen(queue) < 256);
+
+	tmpl = (rq_template_t *) malloc(sizeof(rq_template_t));
+	assert(tmpl);
+	tmpl->rq = rq;
+	tmpl->queue = strdup(queue);
+	tmpl->noreply = 0;
+	tmpl->broadcast = 0;
+	tmpl->timeout = 0;
+	tmpl->qid = 0;
+	tmpl->qid_gen = rq->qid_gen - 1;
+	tmpl->prefix = expbuf_init(NULL, 32);
+	rq_template_encode(tmpl);
+
+	return(tmpl);
+}
+
+
+void rq_template_setnoreply(rq_template_t *tmpl)
+{
+	assert(tmpl);
+	assert(tmpl->noreply == 0);
+
+	tmpl->noreply = 1;
+	rq_template_encode(tmpl);
+}
+
+
+void rq_template_setbroadcast(rq_template_t *tmpl)
+{
+	assert(tmpl);
+	assert(tmpl->broadcast == 0);
+
+	tmpl->broadcast = 1;
+}
+
+
+void rq_template_settimeout(rq_template_t *tmpl, int msecs)
+{
+	assert(tmpl);
+	assert(msecs > 0);
+
+	tmpl->timeout = msecs;
+	rq_template_encode(tmpl);
 }
 
 
-static void cmdPong(void *ptr)
+//-----------------------------------------------------------------------------
+// Free a template.  There must not be any messages still using it.
+void rq_template_free(rq_template_t *tmpl)
 {
-	rq_conn_t *conn = (rq_conn_t *) ptr;
-	assert(conn);
+	assert(tmpl);
 
-	// not sure what to do with this yet.  Havent built in the code to actually handle things if we dont get the pong back.
-	assert(0);
+	assert(tmpl->queue);
+	free(tmpl->queue);
+	tmpl->queue = NULL;
+
+	assert(tmpl->prefix);
+	tmpl->prefix = expbuf_free(tmpl->prefix);
+	assert(tmpl->prefix == NULL);
+
+	free(tmpl);
 }
 
 
+//-----------------------------------------------------------------------------
+// Set up a new message to be sent using a template.  This is used instead of
+// rq_msg_setqueue(), and sets the flags and timeout from the template as well.
+void rq_msg_settemplate(rq_message_t *msg, rq_template_t *tmpl)
+{
+	assert(msg);
+	assert(tmpl);
+	assert(tmpl->rq == msg->rq);
+	assert(msg->conn == NULL);
+	assert(msg->queue == NULL);
+	assert(msg->state == rq_msgstate_new);
 
+	msg->tmpl = tmpl;
+	msg->queue = tmpl->queue;
+	msg->noreply = tmpl->noreply;
+	msg->broadcast = tmpl->broadcast;
+	msg->timeout = tmpl->timeout;
+}
 
 
-static void cmdConsuming(void *ptr)
+//-----------------------------------------------------------------------------
+// In zero-copy mode the payload of an incoming message is only a view of the
+// read buffer, which will be re-used as soon as the handler returns.  If the
+// handler needs to keep the payload (for example, because it is going to
+// reply later), then it needs to call this function so that the message gets
+// its own copy.  If the message already owns its data, this does nothing.
+void rq_msg_retain(rq_message_t *msg)
 {
-	rq_conn_t *conn = (rq_conn_t *) ptr;
-	rq_queue_t *q;
-	char *queue;
-	int qid;
-	
-	
-	assert(conn);
-	assert(conn->data);
+	char *data;
+	int length;
 
-	if (BIT_TEST(conn->data->mask, RQ_DATA_MASK_QUEUEID)  && BIT_TEST(conn->data->mask, RQ_DATA_MASK_QUEUE)) {
-		queue = expbuf_string(conn->data->queue);
-		qid = conn->data->qid;
+	assert(msg);
 
-		assert(queue);
-		assert(qid > 0);
-		assert(ll_count(&conn->rq->queues) > 0);
-		
-		ll_start(&conn->rq->queues);
-		q = ll_next(&conn->rq->queues);
-		while (q) {
-			assert(q->queue);
-			if (strcmp(q->queue, queue) == 0) {
-				assert(q->qid == 0);
-				q->qid = qid;
-				
-				// if we have an 'accepted' handler, then we need to call that too.
-				if (q->accepted) {
-					q->accepted(queue, qid, q->arg);
-				}
-				
-				q = NULL;
-			}
-			else {
-				q = ll_next(&conn->rq->queues);
-			}
-		}
-		ll_finish(&conn->rq->queues);
-	}
-	else {
-		// Not enough data.
-		assert(0);
+	if (msg->borrowed) {
+		assert(msg->data == &msg->view);
+		data = BUF_DATA(msg->data);
+		length = BUF_LENGTH(msg->data);
+		assert(data && length > 0);
+
+		msg->data = rq_buf_get(msg->rq, length);
+		assert(msg->data);
+		expbuf_set(msg->data, data, length);
+		msg->borrowed = 0;
 	}
 }
 
-static void cmdRequest(void *ptr)
+
+//-----------------------------------------------------------------------------
+// This function copies the data that is presented, into an expanding buffer
+// that it controls.  It should be assumed that the 'data' field is empty when
+// this function is called.
+void rq_msg_setdata(rq_message_t *msg, int length, char *data)
 {
-	rq_conn_t *conn = (rq_conn_t *) ptr;
-	msg_id_t msgid;
-	queue_id_t qid = 0;
-	char *qname = NULL;
-	rq_queue_t *tmp, *queue;
-	rq_message_t *msg;
-	
-	assert(conn);
-	assert(conn->data);
+	assert(msg);
+	assert(length > 0);
+	assert(data);
+	assert(BUF_LENGTH(msg->data) == 0);
 	
-	if (BIT_TEST(conn->data->mask, RQ_DATA_MASK_ID) && BIT_TEST(conn->data->mask, RQ_DATA_MASK_PAYLOAD) && (BIT_TEST(conn->data->mask, RQ_DATA_MASK_QUEUEID) || BIT_TEST(conn->data->mask, RQ_DATA_MASK_QUEUE))) {
+	expbuf_set(msg->data, data, length);
+}
 
-		// get message ID
-		msgid = conn->data->id;
-		assert(msgid >= 0);
 
-		// get queue Id or queue name.
-		if (BIT_TEST(conn->data->mask, RQ_DATA_MASK_QUEUEID))
-			qid = conn->data->qid;
-		if (BIT_TEST(conn->data->mask, RQ_DATA_MASK_QUEUE))
-			qname = expbuf_string(conn->data->queue);
-		assert((qname == NULL && qid > 0) || (qname && qid == 0));
 
-		// find the queue to handle this request.
-		// TODO: use a function call to do this.
-		queue = NULL;
-		ll_start(&conn->rq->queues);
-		tmp = ll_next(&conn->rq->queues);
-		while (tmp) {
-			assert(tmp->qid > 0);
-			assert(tmp->queue);
-			if (qid == tmp->qid || strcmp(qname, tmp->queue) == 0) {
-				queue = tmp;
-				tmp = NULL;
-			}
-			else {
-				tmp = ll_next(&conn->rq->queues);
-			}
-		}
-		ll_finish(&conn->rq->queues);
+//-----------------------------------------------------------------------------
+// Encode the parts of a request that describe where it is going and how it
+// should be handled.  The order of these doesn't matter to the controller, as
+// long as they are after the CLEAR and before the REQUEST or BROADCAST.
+static void rq_encode_header(expbuf_t *buf, const char *queue, int qlen, queue_id_t qid, int timeout, char noreply)
+{
+	int secs;
 
-		if (queue == NULL) {
-			// we dont seem to be consuming that queue...
-			assert(conn->sendbuf);
-			assert(BUF_LENGTH(conn->sendbuf) == 0);
-			addCmd(conn->sendbuf, RQ_CMD_CLEAR);
-			addCmdLargeInt(conn->sendbuf, RQ_CMD_ID, (short int)msgid);
-			addCmd(conn->sendbuf, RQ_CMD_UNDELIVERED);
-			rq_senddata(conn, BUF_DATA(conn->sendbuf), BUF_LENGTH(conn->sendbuf));
-			expbuf_clear(conn->sendbuf);
-		}
-		else {
-			// send a delivery message back to the controller.
-			assert(conn->sendbuf);
-			assert(BUF_LENGTH(conn->sendbuf) == 0);
-			addCmd(conn->sendbuf, RQ_CMD_CLEAR);
-			addCmdLargeInt(conn->sendbuf, RQ_CMD_ID, (short int)msgid);
-			addCmd(conn->sendbuf, RQ_CMD_DELIVERED);
-			rq_senddata(conn, BUF_DATA(conn->sendbuf), BUF_LENGTH(conn->sendbuf));
-			expbuf_clear(conn->sendbuf);
+	assert(buf);
+	assert(queue);
+	assert(qlen > 0 && qlen < 256);
 
-			// get a new message object from the pool.
-			msg = rq_msg_new(conn->rq, conn);
-			assert(msg);
-			assert(msg->id >= 0);
-			assert(msg->src_id == -1);
-			assert(msg->state == rq_msgstate_new);
+	if (qid > 0) { addCmdInt(buf, RQ_CMD_QUEUEID, qid); }
+	else { addCmdShortStr(buf, RQ_CMD_QUEUE, qlen, (char *) queue); }
+	if (timeout > 0) {
+		secs = (timeout + 999) / 1000;
+		addCmdInt(buf, RQ_CMD_TIMEOUT, secs > 0xffff ? 0xffff : secs);
+	}
+	if (noreply > 0) { addCmd(buf, RQ_CMD_NOREPLY); }
+}
 
-			// fill out the message details, and add it to the head of the messages list.
-			assert(conn->data);
-			assert(queue && msgid >= 0);
-			msg->src_id = msgid;
-			if (BIT_TEST(conn->data->flags, RQ_DATA_FLAG_NOREPLY)) {
-				msg->noreply = 1;
-			}
 
-			// move the payload buffer to the message.
-			assert(msg->data == NULL);
-			assert(conn->data);
-			assert(conn->data->payload);
-			msg->data = conn->data->payload;
-			conn->data->payload = NULL;
+//-----------------------------------------------------------------------------
+// Encode the message and put it in the outbound buffer of the connection.  The
+// frame is encoded directly into the outbound buffer.  Large payloads are not
+// copied at all, the outbound buffer references the message data until it
+// is sent.   The message data will not be released until we get a reply or
+// the connection is closed, which will always be after the queue is flushed
+// or cleared.  A request with a timeout can be failed while its frame is still
+// queued, so its payload is always copied.
+static void rq_send_encode(rq_conn_t *conn, rq_message_t *msg)
+{
+	expbuf_t *buf;
+	rq_template_t *tmpl;
+	queue_id_t qid;
+	int before, qlen, length, refsize, clen;
 
-			msg->state = rq_msgstate_delivering;
-			queue->handler(msg, queue->arg);
+	assert(conn);
+	assert(conn->rq);
+	assert(msg);
+	assert(msg->data);
+	assert(msg->borrowed == 0);
+	assert(msg->state == rq_msgstate_new);
 
-			// if the message was NOREPLY, then we dont need to reply, and we can clear the message.
-			if (msg->noreply == 1) {
-				rq_msg_clear(msg);
-				msg = NULL;
-			}
-			else if (msg->state == rq_msgstate_replied) {
-				// we already have replied to this message.  Dont need to add it to
-				// the out-process, as that would already have been done.  So all we
-				// need to do is clear the message and return it to the pool.
-				rq_msg_clear(msg);
-				msg = NULL;
+	length = BUF_LENGTH(msg->data);
+	assert(length > 0);
+
+	// the template can only be used if the message hasn't been changed from
+	// it since.
+	tmpl = msg->tmpl;
+	if (tmpl && (tmpl->queue != msg->queue || tmpl->noreply != msg->noreply || tmpl->broadcast != msg->broadcast || tmpl->timeout != msg->timeout)) {
+		tmpl = NULL;
+	}
+	if (tmpl) {
+		// if the queue-ids we know about have changed, the template might need
+		// to have its id updated.
+		if (tmpl->qid_gen != conn->rq->qid_gen) {
+			tmpl->qid_gen = conn->rq->qid_gen;
+			qid = rq_qidcache_find(conn->rq, tmpl->queue);
+			if (qid != tmpl->qid) {
+				tmpl->qid = qid;
+				rq_template_encode(tmpl);
 			}
-			else {
-				// we called the handled, but it hasn't replied yet.  We will need to
-				// wait until it calls rq_reply, which can clean up this message
-				// object.
-				msg->state = rq_msgstate_delivered;
-			}			
 		}
+		qlen = BUF_LENGTH(tmpl->prefix);
 	}
 	else {
-		// we dont have the required data to handle a request.
-		// TODO: This should be handled better.
-		assert(0);
+		qlen = strlen(msg->queue);
+		assert(qlen > 0 && qlen < 256);
 	}
-}
 
+	// a message that wont get a reply could be cleared by the application as
+	// soon as it has been sent, and one that times out is released when it
+	// expires, so we can only reference the data of messages that will be held
+	// until their reply.
+	refsize = (msg->noreply == 0 && msg->broadcast == 0 && msg->timeout == 0) ? RQ_OUT_REFSIZE : INT_MAX;
 
-//-----------------------------------------------------------------------------
-// The controller will return a DELIVERED command when a message has been
-// delivered to the consumer within the timeout period.  We will just mark it
-// as delivered.  The delivery messages are more useful to the controllers the
-// message passes through than the node that made the request.
-static void cmdDelivered(void *ptr)
-{
-	rq_conn_t *conn = (rq_conn_t *) ptr;
-	msg_id_t id;
-	rq_message_t *msg;
-	
-	assert(conn);
-	assert(conn->data);
-	
-	if (BIT_TEST(conn->data->mask, RQ_DATA_MASK_ID)) {
+	// the DELIVERED acks for requests we've received go out first.
+	rq_ack_flush(conn);
 
-		id = conn->data->id;
-		assert(id >= 0);
+	// if the payload can be compressed, then the compressed copy is what gets
+	// sent, and it always has to be copied.
+	clen = rq_compress(conn, BUF_DATA(msg->data), length);
+	if (clen > 0) {
+		refsize = INT_MAX;
+	}
 
-		// make sure that the message exists.
-		assert(conn->rq);
-		assert(conn->rq->msg_list);
-		assert(id >= 0 && id < conn->rq->msg_max);
-		assert(conn->rq->msg_list[id]);
-		msg = conn->rq->msg_list[id];
+	// send the request to the controller.  The extra bytes are enough for the
+	// command and length headers.
+	buf = rq_outq_tail(conn->rq, &conn->outbuf, 24 + qlen + (clen > 0 ? clen : (length < refsize ? length : 0)));
+	before = BUF_LENGTH(buf);
+	if (tmpl) {
+		expbuf_add(buf, BUF_DATA(tmpl->prefix), BUF_LENGTH(tmpl->prefix));
+		addCmdLargeInt(buf, RQ_CMD_ID, msg->id);
+	}
+	else {
+		addCmd(buf, RQ_CMD_CLEAR);
+		addCmdLargeInt(buf, RQ_CMD_ID, msg->id);
+		qid = rq_qidcache_find(conn->rq, msg->queue);
+		rq_encode_header(buf, msg->queue, qlen, qid, msg->timeout, msg->noreply);
+	}
+	if (msg->trace_id) {
+		addCmdLargeInt(buf, RQ_CMD_TRACEID, (int) msg->trace_id);
+	}
 
-		// make sure that it was a SENT message, and not a consumed one.
-		assert(msg->conn == NULL);
-		assert(msg->state == rq_msgstate_new);
-		msg->state = rq_msgstate_delivered;
+	if (length >= refsize) {
+		rq_addlargestr_header(buf, RQ_CMD_PAYLOAD, length);
+		rq_outq_commit(&conn->outbuf, buf, before);
+		if (rq_outq_addref(&conn->outbuf, BUF_DATA(msg->data), length) == 0) {
+			// no room in the ring for the reference, so we need to copy it.
+			rq_outq_add(conn->rq, &conn->outbuf, BUF_DATA(msg->data), length);
+		}
+		buf = rq_outq_tail(conn->rq, &conn->outbuf, 2);
+		before = BUF_LENGTH(buf);
+	}
+	else if (clen > 0) {
+		addCmdShortInt(buf, RQ_CMD_COMPRESSED, conn->compress);
+		addCmdLargeInt(buf, RQ_CMD_RAWSIZE, length);
+		addCmdLargeStr(buf, RQ_CMD_PAYLOAD, clen, BUF_DATA(conn->rq->compress_buf));
 	}
 	else {
-		// we received a DELIVERED command, but we didn't have the required data also.
-		assert(0);
+		addCmdLargeStr(buf, RQ_CMD_PAYLOAD, length, BUF_DATA(msg->data));
 	}
+
+	if (msg->broadcast > 0) { addCmd(buf, RQ_CMD_BROADCAST); }
+	else { addCmd(buf, RQ_CMD_REQUEST); }
+	rq_outq_commit(&conn->outbuf, buf, before);
+	conn->stats.frames_out ++;
+
+	msg->state = rq_msgstate_sent;
 }
 
+
 //-----------------------------------------------------------------------------
-// When the reply to a request comes in, we need to match it with the request
-// that was sent, and then using that information call the callback functions
-// with the payload.
-static void cmdReply(void *ptr)
+// Send a single request, and make sure it goes out.
+static void rq_send_msg(rq_conn_t *conn, rq_message_t *msg)
 {
-	rq_conn_t *conn = (rq_conn_t *) ptr;
-	msg_id_t msgid;
-	rq_message_t *msg;
-	
 	assert(conn);
-	assert(conn->data);
-	
-	if (BIT_TEST(conn->data->mask, RQ_DATA_MASK_ID) && BIT_TEST(conn->data->mask, RQ_DATA_MASK_PAYLOAD)) {
+	assert(msg);
 
-		// get message ID
-		msgid = conn->data->id;
-		assert(msgid >= 0);
+	rq_send_encode(conn, msg);
+	rq_conn_armwrite(conn);
+}
 
-		// make sure this msgid is potentially legit.
-		assert(conn->rq);
-		assert(conn->rq->msg_list);
-		assert(conn->rq->msg_used > 0);
-		assert(conn->rq->msg_max > 0);
-		assert(msgid < conn->rq->msg_max);
-		assert(msgid != conn->rq->msg_next);
-		assert(conn->rq->msg_list[msgid]);
 
-		msg = conn->rq->msg_list[msgid];
-		assert(msg->id == msgid);
-		assert(msg->src_id == -1);
-		assert(msg->conn == NULL);
-		assert(msg->state == rq_msgstate_delivered);
+//-----------------------------------------------------------------------------
+// A message that could not be sent is given to its fail handler (if it has
+// one), and then returned to the pool.
+static void rq_msg_fail(rq_message_t *msg)
+{
+	assert(msg);
+	assert(msg->conn == NULL);
 
-		// replace the data buffer in the message, with the data buffer received with the reply.
-		assert(msg->data);
-		assert(conn->data->payload);
+	msg->rq->stats.failed ++;
+	if (msg->fail_handler) {
+		msg->fail_handler(msg);
+	}
+	rq_msg_clear(msg);
+}
 
-		expbuf_clear(msg->data);
-		msg->data = expbuf_free(msg->data);
-		assert(msg->data == NULL);
-		msg->data = conn->data->payload;
-		conn->data->payload = NULL;
 
-		// if we have a reply handler, then we should call it, with the payload information.
-		if (msg->reply_handler) {
-			msg->reply_handler(msg);
-		}
+//-----------------------------------------------------------------------------
+// Add a message to the pending list, so that it can be sent when we have a
+// connection.  If 'head' is set, the message is put at the front of the list
+// so that it goes before anything that was sent after it.  If the pending
+// list is already holding as much as it is allowed, the message is failed.
+static void rq_pending_add(rq_t *rq, rq_message_t *msg, int head)
+{
+	assert(rq);
+	assert(msg);
+	assert(msg->data);
+	assert(msg->pending_next == NULL);
 
-		// clear the message, retrun it to the pool.
-		rq_msg_clear(msg);
-		msg = NULL;
+	if (rq->pending_bytes + BUF_LENGTH(msg->data) > rq->pending_max) {
+		rq_msg_fail(msg);
 	}
 	else {
-		// we dont have the required data to handle a request.
-		// TODO: This should be handled better.
-		assert(0);
+		msg->state = rq_msgstate_pending;
+		rq->pending_bytes += BUF_LENGTH(msg->data);
+
+		if (rq->pending_head == NULL) {
+			assert(rq->pending_tail == NULL);
+			rq->pending_head = msg;
+			rq->pending_tail = msg;
+		}
+		else if (head) {
+			msg->pending_next = rq->pending_head;
+			rq->pending_head = msg;
+		}
+		else {
+			assert(rq->pending_tail);
+			rq->pending_tail->pending_next = msg;
+			rq->pending_tail = msg;
+		}
 	}
 }
 
+static rq_message_t * rq_pending_pop(rq_t *rq)
+{
+	rq_message_t *msg;
+
+	assert(rq);
 
+	msg = rq->pending_head;
+	if (msg) {
+		rq->pending_head = msg->pending_next;
+		if (rq->pending_head == NULL) { rq->pending_tail = NULL; }
+		msg->pending_next = NULL;
 
-static void cmdBroadcast(void *ptr)
+		assert(msg->state == rq_msgstate_pending);
+		msg->state = rq_msgstate_new;
+		rq->pending_bytes -= BUF_LENGTH(msg->data);
+		assert(rq->pending_bytes >= 0);
+	}
+
+	return(msg);
+}
+
+
+//-----------------------------------------------------------------------------
+// Take a message out of the pending list, wherever it is.  This only happens
+// when a pending message times out, so we dont mind walking the list.
+static void rq_pending_remove(rq_t *rq, rq_message_t *msg)
 {
-	rq_conn_t *conn = (rq_conn_t *) ptr;
-	assert(conn);
-	assert(conn->data);
+	rq_message_t *prev;
+
+	assert(rq);
+	assert(msg);
+	assert(msg->state == rq_msgstate_pending);
+	assert(rq->pending_head);
+
+	if (rq->pending_head == msg) {
+		rq->pending_head = msg->pending_next;
+		prev = NULL;
+	}
+	else {
+		prev = rq->pending_head;
+		while (prev->pending_next != msg) {
+			prev = prev->pending_next;
+			assert(prev);
+		}
+		prev->pending_next = msg->pending_next;
+	}
+	if (rq->pending_tail == msg) { rq->pending_tail = prev; }
+	msg->pending_next = NULL;
 
-	assert(0);
+	msg->state = rq_msgstate_new;
+	rq->pending_bytes -= BUF_LENGTH(msg->data);
+	assert(rq->pending_bytes >= 0);
 }
-	
-// set the noreply flag.
-static void cmdNoreply(void *ptr)
-{
-	rq_conn_t *conn = (rq_conn_t *) ptr;
 
-	assert(conn);
-	assert(conn->data);
-	BIT_SET(conn->data->flags, RQ_DATA_FLAG_NOREPLY);	
-}
 
 //-----------------------------------------------------------------------------
-// By receiving the closing command from the controller, we should not get any
-// more queue requests to consume.  Also as soon as there are no more messages
-// waiting for replies, the controller will drop the connection.  Therefore,
-// when this command is processed, we need to initiate a connection to an
-// alternative controller that can receive requests.
-static void cmdClosing(void *ptr)
+// We have a new connection, so send all the messages that were waiting for
+// one, in the order they were sent.
+static void rq_pending_flush(rq_conn_t *conn)
 {
-	rq_conn_t *conn = (rq_conn_t *) ptr;
+	rq_message_t *msg;
 
 	assert(conn);
-	assert(conn->data);
+	assert(conn->rq);
+	assert(conn->active > 0);
 
-	// mark the connectiong as 'closing'.
-	assert(conn->closing == 0);
-	conn->closing ++;
+	// if the controller is full, then they will be sent when the backoff is
+	// over.
+	if (conn->rq->full_paused) {
+		return;
+	}
 
-	// initialise the connection to the alternate controller.
-	assert(conn->rq);
-	rq_connect(conn->rq);
+	while ((msg = rq_pending_pop(conn->rq))) {
+		rq_send_encode(conn, msg);
+	}
+	assert(conn->rq->pending_bytes == 0);
+	if (conn->outbuf.bytes > 0) {
+		rq_conn_armwrite(conn);
+	}
 }
-	
-static void cmdServerFull(void *ptr)
-{
-	rq_conn_t *conn = (rq_conn_t *) ptr;
 
-	assert(conn);
-	assert(conn->data);
 
-	assert(0);
-}
-	
-static void cmdID(void *ptr, risp_int_t value)
-{
-	rq_conn_t *conn = (rq_conn_t *) ptr;
-	
-	assert(conn);
-	assert(value >= 0 && value <= 0xffff);
-	assert(conn->data);
-	
-	conn->data->id = value;
-	BIT_SET(conn->data->mask, RQ_DATA_MASK_ID);
-}
-	
-static void cmdQueueID(void *ptr, risp_int_t value)
+//-----------------------------------------------------------------------------
+// The connection that our requests were sent on has been lost.  Requests that
+// the controller hadn't yet delivered are put back on the pending list so that
+// they are sent again.  Requests that were already delivered to a consumer
+// will never get their reply, so they are failed.
+//
+// The live list has the newest messages at the head, so by pushing each one at
+// the head of the pending list they end up in the order they were created.
+static void rq_pending_requeue(rq_t *rq)
 {
-	rq_conn_t *conn = (rq_conn_t *) ptr;
-	
-	assert(conn);
-	assert(value > 0 && value <= 0xffff);
-	assert(conn->data);
-	
-	conn->data->qid = value;
-	BIT_SET(conn->data->mask, RQ_DATA_MASK_QUEUEID);
+	rq_message_t *msg, *next;
+
+	assert(rq);
 
+	msg = rq->msg_live;
+	while (msg) {
+		next = msg->live_next;
+		if (msg->conn == NULL && msg->src_id == -1) {
+			if (msg->state == rq_msgstate_sent) {
+				msg->state = rq_msgstate_new;
+				rq_pending_add(rq, msg, 1);
+			}
+			else if (msg->state == rq_msgstate_delivered) {
+				rq_msg_fail(msg);
+			}
+		}
+		msg = next;
+	}
 }
-	
-static void cmdTimeout(void *ptr, risp_int_t value)
+
+
+//-----------------------------------------------------------------------------
+// Fail all the messages waiting to be sent.
+static void rq_pending_failall(rq_t *rq)
 {
-	rq_conn_t *conn = (rq_conn_t *) ptr;
-	
-	assert(conn);
-	assert(value > 0 && value <= 0xffff);
-	assert(conn->data);
-	
-	conn->data->timeout = value;
-	BIT_SET(conn->data->mask, RQ_DATA_MASK_TIMEOUT);
+	rq_message_t *msg;
+
+	assert(rq);
+
+	while ((msg = rq_pending_pop(rq))) {
+		rq_msg_fail(msg);
+	}
+	assert(rq->pending_bytes == 0);
 }
-	
-static void cmdPriority(void *ptr, risp_int_t value)
+
+
+//-----------------------------------------------------------------------------
+// Set the maximum number of payload bytes that can be held while waiting for a
+// connection to a controller.
+void rq_setpendinglimit(rq_t *rq, int bytes)
 {
-	rq_conn_t *conn = (rq_conn_t *) ptr;
+	assert(rq);
+	assert(bytes >= 0);
 
-	assert(conn);
-	assert(value > 0 && value <= 0xffff);
-	assert(conn->data);
-	
-	conn->data->priority = value;
-	BIT_SET(conn->data->mask, RQ_DATA_MASK_PRIORITY);
+	rq->pending_max = bytes;
 }
-	
-static void cmdPayload(void *ptr, risp_length_t length, risp_data_t *data)
+
+
+//-----------------------------------------------------------------------------
+// Configure the sizing of the connection read buffers.  'initial' is the size
+// a read buffer starts at, and it will double each time a read fills it, up
+// to 'max'.  After 'shrink' reads in a row that use less than a quarter of the
+// buffer, it will be shrunk back to 'initial'.  Connections that are already
+// established keep their current buffer until it next grows or shrinks.
+void rq_setreadbuf(rq_t *rq, int initial, int max, int shrink)
 {
-	rq_conn_t *conn = (rq_conn_t *) ptr;
-	
-	assert(conn && length > 0 && data);
+	assert(rq);
+	assert(initial > 0);
+	assert(max >= initial);
+	assert(shrink > 0);
 
-	assert(conn->data);
-	assert(conn->data->payload == NULL);
-	if (conn->data->payload == NULL) {
-		assert(conn->rq);
-		conn->data->payload = expbuf_init(NULL, length);
-		assert(conn->data->payload);
-	}
- 	expbuf_set(conn->data->payload, data, length);
-	BIT_SET(conn->data->mask, RQ_DATA_MASK_PAYLOAD);
-// 	fprintf(stderr, "Payload. len=%d\n", length);
+	rq->readbuf_init = initial;
+	rq->readbuf_max = max;
+	rq->readbuf_shrink = shrink;
 }
 
 
-static void cmdQueue(void *ptr, risp_length_t length, risp_data_t *data)
+//-----------------------------------------------------------------------------
+// Configure how we connect to the controllers.  A connect that hasn't
+// completed within 'timeout' milliseconds is treated as failed (0 will wait
+// forever).  If 'parallel' is more than 1, then connects are started to that
+// many controllers at once (in the order they were added), and the first one
+// to complete is used.  The others are abandoned.
+void rq_setconnect(rq_t *rq, int timeout, int parallel)
 {
-	rq_conn_t *conn = (rq_conn_t *) ptr;
-	
- 	assert(conn && length > 0 && data);
+	assert(rq);
+	assert(timeout >= 0);
+	assert(parallel > 0);
 
- 	assert(conn->data);
- 	assert(conn->data->queue);
- 	expbuf_set(conn->data->queue, data, length);
- 	BIT_SET(conn->data->mask, RQ_DATA_MASK_QUEUE);
+	rq->connect_timeout = timeout;
+	rq->connect_parallel = parallel;
 }
 
 
-
-// Initialise an RQ structure.  
-void rq_init(rq_t *rq)
+//-----------------------------------------------------------------------------
+// Send a PING to the controller every 'interval' milliseconds (0 turns
+// heartbeats off).  If 'missed' intervals go by without a PONG, the
+// connection is dropped and we fail-over to the next controller.  The
+// round-trip times are available through rq_stats_controller().  Only
+// connections established after this is called are affected.
+void rq_setheartbeat(rq_t *rq, int interval, int missed)
 {
 	assert(rq);
+	assert(interval >= 0);
+	assert(missed > 0);
 
-	rq->evbase = NULL;
+	rq->heartbeat_interval = interval;
+	rq->heartbeat_missed = missed;
+}
 
-	// setup the risp processor.
-	rq->risp = risp_init(NULL);
-	risp_add_command(rq->risp, RQ_CMD_CLEAR,        &cmdClear);
-	risp_add_command(rq->risp, RQ_CMD_PING,         &cmdPing);
-	risp_add_command(rq->risp, RQ_CMD_PONG,         &cmdPong);
-	risp_add_command(rq->risp, RQ_CMD_REQUEST,      &cmdRequest);
-	risp_add_command(rq->risp, RQ_CMD_REPLY,        &cmdReply);
-	risp_add_command(rq->risp, RQ_CMD_DELIVERED,    &cmdDelivered);
-	risp_add_command(rq->risp, RQ_CMD_BROADCAST,    &cmdBroadcast);
-	risp_add_command(rq->risp, RQ_CMD_NOREPLY,      &cmdNoreply);
-	risp_add_command(rq->risp, RQ_CMD_CLOSING,      &cmdClosing);
-	risp_add_command(rq->risp, RQ_CMD_CONSUMING,    &cmdConsuming);
-	risp_add_command(rq->risp, RQ_CMD_SERVER_FULL,  &cmdServerFull);
-	risp_add_command(rq->risp, RQ_CMD_ID,           &cmdID);
-	risp_add_command(rq->risp, RQ_CMD_QUEUEID,      &cmdQueueID);
-	risp_add_command(rq->risp, RQ_CMD_TIMEOUT,      &cmdTimeout);
-	risp_add_command(rq->risp, RQ_CMD_PRIORITY,     &cmdPriority);
-	risp_add_command(rq->risp, RQ_CMD_QUEUE,        &cmdQueue);
-	risp_add_command(rq->risp, RQ_CMD_PAYLOAD,      &cmdPayload);
 
-	ll_init(&rq->connlist);
-	ll_init(&rq->queues);
+//-----------------------------------------------------------------------------
+// Controller hostnames are resolved using 'dns' (if NULL, we create our own
+// when it is first needed).  Resolved addresses are looked up again in the
+// background once they are 'ttl' seconds old (0 to never look them up
+// again).  A connect never waits for a lookup if we already have an address.
+void rq_setdns(rq_t *rq, struct evdns_base *dns, int ttl)
+{
+	assert(rq);
+	assert(ttl >= 0);
 
-	// create an array of DEFAULT_MSG_ARRAY items;
-	assert(DEFAULT_MSG_ARRAY > 0);
-	rq->msg_list = (void **) malloc(sizeof(void *) * DEFAULT_MSG_ARRAY);
-	assert(rq->msg_list);
-	for (rq->msg_max = 0; rq->msg_max < DEFAULT_MSG_ARRAY; rq->msg_max ++) {
-		rq->msg_list[rq->msg_max] = NULL;
+	if (dns) {
+		assert(rq->dns == NULL);
+		rq->dns = dns;
+		rq->dns_owned = 0;
 	}
-	assert(rq->msg_max == DEFAULT_MSG_ARRAY);
-	rq->msg_used = 0;
-	rq->msg_next = 0;
-
-	rq->msg_pool = ll_init(NULL);
-	assert(rq->msg_pool);
+	rq->dns_ttl = ttl;
 }
 
 
+//-----------------------------------------------------------------------------
+// Set the socket buffer sizes (0 leaves the system default) and options
+// (RQ_SOCKET_NODELAY, RQ_SOCKET_QUICKACK) used for controller connections.
+// The tcp options dont apply to unix sockets.  Only affects connections made
+// after it is called.
+void rq_setsocket(rq_t *rq, int sndbuf, int rcvbuf, int flags)
+{
+	assert(rq);
+	assert(sndbuf >= 0);
+	assert(rcvbuf >= 0);
+	assert((flags & ~(RQ_SOCKET_NODELAY | RQ_SOCKET_QUICKACK)) == 0);
+
+	rq->sock_sndbuf = sndbuf;
+	rq->sock_rcvbuf = rcvbuf;
+	rq->sock_flags = flags;
+}
 
 
 //-----------------------------------------------------------------------------
-// Return a new message struct.  Will get one from the mempool if there are any
-// available, otherwise it will create a new entry.  Cannot assume that
-// anything left in the mempool has any valid data, so will initialise it as if
-// it was a fresh allocation.  The message will need to be applied to the
-// message list.  Even incoming messages need to be placed on the list in case
-// it receives cancel commands for it.
-rq_message_t * rq_msg_new(rq_t *rq, rq_conn_t *conn)
+// Choose the I/O backend used for the controller connections (RQ_IO_LIBEVENT
+// or RQ_IO_URING).  It needs to be done after the evbase has been set, and
+// before any controllers are added.  Returns -1 if the backend isn't
+// available (librq wasn't built with it, or the kernel doesn't support it),
+// in which case the libevent backend is still used.
+int rq_setio(rq_t *rq, int backend)
 {
-	rq_message_t *msg;
-	int i;
+	const rq_io_t *io;
 
-	// need to get a message struct from the mempool.
 	assert(rq);
-	assert(rq->msg_pool);
-	msg = ll_pop_head(rq->msg_pool);
-	if (msg == NULL) {
-		// there wasnt any messages available in the pool, so we need to create one.
-		msg = (rq_message_t *) malloc(sizeof(rq_message_t));
-	}
-
-	assert(msg);
-	msg->rq = rq;
-	msg->queue = NULL;
-	msg->id = -1;
-	msg->src_id = -1;
-	msg->broadcast = 0;
-	msg->noreply = 0;
-	msg->state = rq_msgstate_new;
-	msg->conn = conn;
-	msg->reply_handler = NULL;
-	msg->fail_handler = NULL;
-	msg->arg = NULL;
+	assert(rq->evbase);
+	assert(ll_count(&rq->connlist) == 0);
+	assert(rq->io == &rq_io_libevent);
 
-	// if we are supplied with a 'conn' it means we know which connection the
-	// message came from, which means it is already fully formed, and we wont
-	// need a data buffer, because the data is already in a buffer which we will
-	// be assigned.   If conn is null, it means that we are building a message
-	// and will therefore need a data buffer.
-	if (conn) { msg->data = NULL; }
-	else { msg->data = expbuf_init(NULL, 0); }
+	io = NULL;
+	if (backend == RQ_IO_LIBEVENT) { io = &rq_io_libevent; }
+#ifdef RQ_WITH_URING
+	else if (backend == RQ_IO_URING) { io = &rq_io_uring; }
+#endif
 
-	// add the message to the message list.
-	assert(rq->msg_list);
-	assert(rq->msg_max > 0);
-	assert(rq->msg_used >= 0 && rq->msg_used <= rq->msg_max);
-	if (rq->msg_used < rq->msg_max) {
-		// there has to be at least one empty slot in the list.
-		if (rq->msg_next >= 0) {
-			assert(rq->msg_next < rq->msg_max);
-			assert(rq->msg_list[rq->msg_next] == NULL);
-			rq->msg_list[rq->msg_next] = msg;
-			msg->id = rq->msg_next;
-			rq->msg_next = -1;
-		}
-		else {
-			// we need to go through the list, to find the empty slot.
-			for (i=0; i < rq->msg_max; i++) {
-				if (rq->msg_list[i] == NULL) {
-					rq->msg_list[i] = msg;
-					msg->id = i;
-					i = rq->msg_max;
-				}
-			}
-		}
+	if (io == NULL || (io->init && io->init(rq) != 0)) {
+		return(-1);
 	}
-	else {
-		// the list is full, we need to expand it.
-		rq->msg_list = (void **) realloc(rq->msg_list, sizeof(void *) * (rq->msg_max + 1));
-		assert(rq->msg_list);
-		rq->msg_list[rq->msg_max] = msg;
-		msg->id = rq->msg_max;
-		rq->msg_max ++;
-	}
-
-	assert(rq->msg_used >= 0);
-	rq->msg_used ++;
-	assert(rq->msg_used > 0 && rq->msg_used <= rq->msg_max);
 
-	assert(msg);
-	return(msg);
+	rq->io = io;
+	return(0);
 }
 
+
 //-----------------------------------------------------------------------------
-// clean up the resources used by the message so that it can be used again.  We
-// will return the data buffer to the bufpool so that it can be used for
-// payloads of future messages.  We will also return the message to the message
-// pool.
-void rq_msg_clear(rq_message_t *msg)
+// Set a handler to be called at each trace point (see RQ_TRACE_* in rq.h), or
+// NULL to stop.  If 'sample' is more than 0, then one in every 'sample'
+// requests that are sent is given a trace id, which goes to the controller
+// with the request, and comes back with the reply.  When using worker
+// threads, the REQUEST, HANDLED and REPLY points are called from the worker,
+// so the handler needs to be thread-safe.
+void rq_settrace(rq_t *rq, void (*handler)(rq_t *rq, const rq_trace_t *trace, void *arg), void *arg, int sample)
 {
-	assert(msg);
-
-	// remove the message from the msg_list.
-	assert(msg->rq);
-	assert(msg->rq->msg_list);
-	assert(msg->rq->msg_used > 0);
-	assert(msg->id >= 0);
-	assert(msg->id < msg->rq->msg_max);
-	assert(msg->rq->msg_list[msg->id] == msg);
-	msg->rq->msg_list[msg->id] = NULL;
-	msg->rq->msg_next = msg->id;
-	msg->rq->msg_used--;
-	
-	msg->id = -1;
-	msg->broadcast = 0;
-	msg->noreply = 0;
-	msg->queue = NULL;
-	msg->state = rq_msgstate_new;
-
-	// clear the buffer, if we have one allocated.
-	if (msg->data) {
-		expbuf_clear(msg->data);
-		msg->data = expbuf_free(msg->data);
-		assert(msg->data == NULL);
+	assert(rq);
+	assert(sample >= 0);
+	assert(handler || arg == NULL);
+
+	rq->trace_handler = handler;
+	rq->trace_arg = arg;
+	rq->trace_sample = sample;
+	rq->trace_count = 0;
+	if (rq->trace_seed == 0) {
+		rq->trace_seed = (uint32_t) (rq_now() ^ ((uint64_t) getpid() << 16));
+		if (rq->trace_seed == 0) { rq->trace_seed = 1; }
 	}
-	
-	// return the message to the msgpool.
-	assert(msg->rq);
-	assert(msg->rq->msg_pool);
-	ll_push_head(msg->rq->msg_pool, msg);
 }
 
 
-void rq_msg_setqueue(rq_message_t *msg, const char *queue)
+//-----------------------------------------------------------------------------
+// Turn on payload compression.  'methods' is the set of RQ_COMPRESS_* methods
+// that will be offered to the controller when we connect (it picks one), and
+// payloads smaller than 'threshold' bytes are always sent as they are.
+// Methods that librq wasn't built with are dropped, and the set that is left
+// is returned.  Only affects connections that are made after it is called.
+int rq_setcompression(rq_t *rq, int methods, int threshold)
 {
-	assert(msg != NULL);
-	assert(queue != NULL);
-	assert(msg->queue == NULL);
+	assert(rq);
+	assert(methods >= 0);
+	assert(threshold >= 0);
+
+#ifndef RQ_WITH_LZ4
+	methods &= ~RQ_COMPRESS_LZ4;
+#endif
+#ifndef RQ_WITH_ZSTD
+	methods &= ~RQ_COMPRESS_ZSTD;
+#endif
+	methods &= (RQ_COMPRESS_LZ4 | RQ_COMPRESS_ZSTD);
 
-	msg->queue = queue;
-}
+	rq->compress_methods = methods;
+	rq->compress_threshold = threshold;
 
+	if (methods != RQ_COMPRESS_NONE && rq->compress_buf == NULL) {
+		rq->compress_buf = expbuf_init(NULL, RQ_DEFAULT_BUFFSIZE);
+		assert(rq->compress_buf);
+	}
 
-void rq_msg_setbroadcast(rq_message_t *msg)
-{
-	assert(msg != NULL);
-	assert(msg->broadcast == 0);
+#ifdef RQ_WITH_ZSTD
+	if ((methods & RQ_COMPRESS_ZSTD) && rq->zstd_cctx == NULL) {
+		rq->zstd_cctx = ZSTD_createCCtx();
+		rq->zstd_dctx = ZSTD_createDCtx();
+		assert(rq->zstd_cctx && rq->zstd_dctx);
+	}
+#endif
 
-	msg->broadcast = 1;
+	return(methods);
 }
 
-void rq_msg_setnoreply(rq_message_t *msg)
-{
-	assert(msg != NULL);
-	assert(msg->noreply == 0);
 
-	msg->noreply = 1;
+//-----------------------------------------------------------------------------
+// Give a trained dictionary to use for zstd compression (NULL to stop using
+// one).  Both ends need to be using the same dictionary.  It is copied, so it
+// doesnt need to be kept.
+void rq_setcompressdict(rq_t *rq, char *dict, int length)
+{
+	assert(rq);
+	assert((dict == NULL && length == 0) || (dict && length > 0));
+
+#ifdef RQ_WITH_ZSTD
+	if (rq->zstd_cdict) { ZSTD_freeCDict(rq->zstd_cdict); }
+	if (rq->zstd_ddict) { ZSTD_freeDDict(rq->zstd_ddict); }
+	rq->zstd_cdict = NULL;
+	rq->zstd_ddict = NULL;
+
+	if (dict) {
+		rq->zstd_cdict = ZSTD_createCDict(dict, length, RQ_ZSTD_LEVEL);
+		rq->zstd_ddict = ZSTD_createDDict(dict, length);
+		assert(rq->zstd_cdict && rq->zstd_ddict);
+	}
+#endif
 }
 
 
 //-----------------------------------------------------------------------------
-// This function copies the data that is presented, into an expanding buffer
-// that it controls.  It should be assumed that the 'data' field is empty when
-// this function is called.
-void rq_msg_setdata(rq_message_t *msg, int length, char *data)
+// Make up a new (non-zero) trace id.  They only need to be unlikely to clash,
+// so a xorshift is enough.
+static uint32_t rq_trace_newid(rq_t *rq)
 {
-	assert(msg);
-	assert(length > 0);
-	assert(data);
-	assert(BUF_LENGTH(msg->data) == 0);
-	
-	expbuf_set(msg->data, data, length);
-}
+	uint32_t x;
+
+	assert(rq);
 
+	x = rq->trace_seed;
+	do {
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+	} while (x == 0);
+	rq->trace_seed = x;
+	return(x);
+}
 
 
 //-----------------------------------------------------------------------------
-// send a message to the controller.   We dont need to worry about the
-// mechanics of the actual send, that will be done through the rq_senddata
-// function.
-void rq_send(
+// Get a message ready to be sent.  This is the same for every message no
+// matter how it is sent.
+static void rq_send_prepare(
 	rq_message_t *msg,
 	void (*reply_handler)(rq_message_t *reply),
 	void (*fail_handler)(rq_message_t *msg),
 	void *arg)
 {
-	rq_conn_t *conn;
-	
 	assert(msg);
 	assert(msg->data);
 	assert(BUF_LENGTH(msg->data) > 0);
@@ -1680,34 +6510,195 @@ void rq_send(
 	msg->fail_handler = fail_handler;
 	msg->arg = arg;
 
-	// find an active connection to a controller, and send it.
-	// otherwise, if we dont have any active connections, then we keep it in the
-	// messages list, and send it out when we finally get a connection.
-	conn = ll_get_head(&msg->rq->connlist);
-	if (conn && conn->active > 0 && conn->closing == 0) {
+	// the timeout starts now, whether we can send it straight away or not.
+	if (msg->timeout > 0) {
+		rq_timer_add(msg);
+	}
 
-		// get a buffer from the bufpool.
-		assert(conn->sendbuf);
-		assert(BUF_LENGTH(conn->sendbuf) == 0);
-	
-		// send consume request to controller.
-		addCmd(conn->sendbuf, RQ_CMD_CLEAR);
-		addCmdLargeInt(conn->sendbuf, RQ_CMD_ID, msg->id);
-		addCmdShortStr(conn->sendbuf, RQ_CMD_QUEUE, strlen(msg->queue), (char *) msg->queue);
-		addCmdLargeStr(conn->sendbuf, RQ_CMD_PAYLOAD, BUF_LENGTH(msg->data), BUF_DATA(msg->data));
-
-		if (msg->noreply > 0) { addCmd(conn->sendbuf, RQ_CMD_NOREPLY); }
-		if (msg->broadcast > 0) { addCmd(conn->sendbuf, RQ_CMD_BROADCAST); }
-		else { addCmd(conn->sendbuf, RQ_CMD_REQUEST); }
+	msg->rq->stats.sent ++;
+	if (msg->rq->latency) {
+		msg->sent_time = rq_now();
+	}
+
+	// if we are sampling, then every so often a request is given a trace id
+	// (unless it already has one).
+	if (msg->rq->trace_sample > 0 && msg->trace_id == 0) {
+		msg->rq->trace_count ++;
+		if (msg->rq->trace_count >= msg->rq->trace_sample) {
+			msg->rq->trace_count = 0;
+			msg->trace_id = rq_trace_newid(msg->rq);
+		}
+	}
+	RQ_TRACE(msg->rq, RQ_TRACE_SEND, send, msg->id, msg->trace_id, BUF_LENGTH(msg->data));
+
+	// the payload is kept until the request is finished with, in case it
+	// needs to be sent again.
+	assert(msg->held_bytes == 0);
+	msg->held_bytes = BUF_LENGTH(msg->data);
+	msg->rq->held_bytes += msg->held_bytes;
+	rq_budget_check(msg->rq);
+}
+
+
+//-----------------------------------------------------------------------------
+// Return the connection that requests can be sent on right now, or NULL if
+// they need to wait on the pending list.
+static rq_conn_t * rq_send_conn(rq_t *rq)
+{
+	rq_conn_t *conn;
+
+	assert(rq);
+
+	conn = ll_get_head(&rq->connlist);
+	if (conn && conn->active > 0 && conn->closing == 0 && rq->full_paused == 0) {
+		assert(rq->pending_head == NULL);
+		return(conn);
+	}
+	return(NULL);
+}
+
+
+//-----------------------------------------------------------------------------
+// send a message to the controller.   We dont need to worry about the
+// mechanics of the actual send, that will be done through the rq_senddata
+// function.  If we are not connected to a controller, the message is held
+// until we are.
+void rq_send(
+	rq_message_t *msg,
+	void (*reply_handler)(rq_message_t *reply),
+	void (*fail_handler)(rq_message_t *msg),
+	void *arg)
+{
+	rq_conn_t *conn;
 	
-		rq_senddata(conn, BUF_DATA(conn->sendbuf), BUF_LENGTH(conn->sendbuf));
-		
-		// return the buffer to the bufpool.
-		expbuf_clear(conn->sendbuf);
+	assert(msg);
+	rq_send_prepare(msg, reply_handler, fail_handler, arg);
+
+	// find an active connection to a controller, and send it.
+	// otherwise, if we dont have any active connections (or the controller is
+	// full), then we keep it in the pending list, and send it out when we can.
+	conn = rq_send_conn(msg->rq);
+	if (conn) {
+		rq_send_msg(conn, msg);
 	}
 	else {
-		// We need to put the message in a linked list so that we do send it in the right order.
-		assert(0);
+		rq_pending_add(msg->rq, msg, 0);
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// The same as rq_send(), except that if we are over the send budget (see
+// rq_setbudget), the request isn't sent and EAGAIN is returned.  The message
+// still belongs to the caller, and can be sent once the writable handler says
+// we are back under the budget.  Returns 0 if it was sent.
+int rq_trysend(
+	rq_message_t *msg,
+	void (*reply_handler)(rq_message_t *reply),
+	void (*fail_handler)(rq_message_t *msg),
+	void *arg)
+{
+	assert(msg);
+	assert(msg->rq);
+
+	if (msg->rq->unwritable) {
+		return(EAGAIN);
+	}
+
+	rq_send(msg, reply_handler, fail_handler, arg);
+	return(0);
+}
+
+
+//-----------------------------------------------------------------------------
+// Send a batch of requests (all from the same rq_t) with the same handlers.
+// They are all encoded into the outbound buffer before the write is armed,
+// so they go out together.  The requests are sent in the order given.
+void rq_send_batch(
+	rq_message_t **msgs,
+	int count,
+	void (*reply_handler)(rq_message_t *reply),
+	void (*fail_handler)(rq_message_t *msg),
+	void *arg)
+{
+	rq_conn_t *conn;
+	rq_t *rq;
+	int i;
+
+	assert(msgs);
+	assert(count > 0);
+	assert(msgs[0]);
+	rq = msgs[0]->rq;
+	assert(rq);
+
+	conn = rq_send_conn(rq);
+	for (i=0; i<count; i++) {
+		assert(msgs[i]);
+		assert(msgs[i]->rq == rq);
+		rq_send_prepare(msgs[i], reply_handler, fail_handler, arg);
+
+		if (conn) {
+			rq_send_encode(conn, msgs[i]);
+
+			// dont let a huge batch build up in memory before any of it is sent.
+			if (conn->outbuf.bytes >= RQ_OUT_FLUSH_THRESHOLD) {
+				rq_conn_armwrite(conn);
+			}
+		}
+		else {
+			rq_pending_add(rq, msgs[i], 0);
+		}
+	}
+
+	if (conn) {
+		rq_conn_armwrite(conn);
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Encode a reply to a request onto the connection it arrived on.
+static void rq_reply_send(rq_message_t *msg, int length, char *data)
+{
+	expbuf_t *buf;
+	int before;
+	int clen;
+
+	assert(msg);
+	assert(msg->rq);
+
+	// if the connection the request came in on has been lost, then there is
+	// no-where to send the reply, and the controller will have given the
+	// request to someone else anyway.
+	if (msg->conn) {
+		// encode the reply directly into the outbound buffer, so that the data is
+		// only copied once.  We dont own the data, so we cant reference it.
+		rq_ack_flush(msg->conn);
+		clen = rq_compress(msg->conn, data, length);
+		buf = rq_outq_tail(msg->rq, &msg->conn->outbuf, 24 + (clen > 0 ? clen : length));
+		before = BUF_LENGTH(buf);
+		addCmd(buf, RQ_CMD_CLEAR);
+		addCmdLargeInt(buf, RQ_CMD_ID, (short int) msg->src_id);
+		if (msg->trace_id) {
+			addCmdLargeInt(buf, RQ_CMD_TRACEID, (int) msg->trace_id);
+		}
+		if (clen > 0) {
+			addCmdShortInt(buf, RQ_CMD_COMPRESSED, msg->conn->compress);
+			addCmdLargeInt(buf, RQ_CMD_RAWSIZE, length);
+			addCmdLargeStr(buf, RQ_CMD_PAYLOAD, clen, BUF_DATA(msg->rq->compress_buf));
+		}
+		else if (length > 0) {
+			assert(data);
+			addCmdLargeStr(buf, RQ_CMD_PAYLOAD, length, data);
+		}
+		addCmd(buf, RQ_CMD_REPLY);
+		rq_outq_commit(&msg->conn->outbuf, buf, before);
+		msg->conn->stats.frames_out ++;
+		rq_conn_armwrite(msg->conn);
+	}
+
+	if (msg->consumer) {
+		msg->consumer->stats.replies ++;
 	}
 }
 
@@ -1731,7 +6722,6 @@ void rq_reply(rq_message_t *msg, int length, char *data)
 	assert((length == 0 && data == NULL) || (length > 0 && data));
 	
 	assert(msg->rq);
-	assert(msg->conn);
 
 	assert(msg->id >= 0);
 	assert(msg->src_id >= 0);
@@ -1740,21 +6730,27 @@ void rq_reply(rq_message_t *msg, int length, char *data)
 	assert(msg->queue == NULL);
 	assert(msg->state == rq_msgstate_delivering || msg->state == rq_msgstate_delivered);
 
-	assert(msg->data);
-
-	// get the send buffer from rq.
-	assert(msg->conn);
-	assert(msg->conn->sendbuf);
-	assert(BUF_LENGTH(msg->conn->sendbuf) == 0);
-	addCmd(msg->conn->sendbuf, RQ_CMD_CLEAR);
-	addCmdLargeInt(msg->conn->sendbuf, RQ_CMD_ID, (short int) msg->src_id);
-	if (length > 0) {
-		assert(data);
-		addCmdLargeStr(msg->conn->sendbuf, RQ_CMD_PAYLOAD, length, data);
+	// in zero-copy mode, a deferred reply will no longer have the payload
+	// unless it has been retained.
+	assert(msg->data || msg->rq->zerocopy);
+
+	// if we are being called from the handler in a worker thread, then we
+	// cant touch the connection.  We keep a copy of the reply, and it will be
+	// sent when the message gets back to the event-loop thread.
+	if (rq_worker_msg == msg) {
+		RQ_TRACE(msg->rq, RQ_TRACE_REPLY, reply, msg->src_id, msg->trace_id, length);
+		assert(msg->state == rq_msgstate_delivering);
+		assert(msg->reply == NULL);
+		if (length > 0) {
+			msg->reply = expbuf_init(NULL, length);
+			expbuf_set(msg->reply, data, length);
+		}
+		msg->state = rq_msgstate_replied;
+		return;
 	}
-	addCmd(msg->conn->sendbuf, RQ_CMD_REPLY);
-	rq_senddata(msg->conn, BUF_DATA(msg->conn->sendbuf), BUF_LENGTH(msg->conn->sendbuf));
-	expbuf_clear(msg->conn->sendbuf);
+
+	RQ_TRACE(msg->rq, RQ_TRACE_REPLY, reply, msg->src_id, msg->trace_id, length);
+	rq_reply_send(msg, length, data);
 
 	// if this reply is being sent after the message was delivered to the handler,
 	if (msg->state == rq_msgstate_delivered) {
@@ -1768,3 +6764,257 @@ void rq_reply(rq_message_t *msg, int length, char *data)
 }
 
 
+
+//-----------------------------------------------------------------------------
+// Sharded mode.
+//
+// An rq_t is only ever used by one thread.  To use more than one core, a
+// group has a shard (an rq_t with its own event base) per thread, and each
+// shard has its own connection to the controllers.  Every shard consumes the
+// same queues, so the controller spreads the requests over them, and a
+// handler always runs in the thread of the shard that received the request.
+// Messages sent from within a shard thread should be created with
+// rq_group_msg_new(), so that they are sent by that shard.
+//
+// The only thing that can be done to a running group from another thread is
+// rq_group_shutdown(), which signals each shard through an eventfd.
+
+// the shard that the current thread is running.
+static __thread rq_shard_t *rq_shard_local = NULL;
+
+
+//-----------------------------------------------------------------------------
+// Another thread has asked this shard to shut down.
+static void rq_shard_handler(int fd, short int flags, void *arg)
+{
+	rq_shard_t *shard = (rq_shard_t *) arg;
+	uint64_t count;
+
+	assert(fd >= 0);
+	assert(shard);
+	assert(shard->efd == fd);
+	assert(rq_shard_local == shard);
+
+	if (read(fd, &count, sizeof(count)) != sizeof(count)) {
+		assert(errno == EAGAIN);
+	}
+
+	// once there is nothing left for the event loop to do, the thread will exit.
+	event_del(shard->ctl_event);
+	rq_shutdown(&shard->rq);
+}
+
+
+static void * rq_shard_main(void *arg)
+{
+	rq_shard_t *shard = (rq_shard_t *) arg;
+
+	assert(shard);
+	assert(shard->evbase);
+
+	rq_shard_local = shard;
+	event_base_dispatch(shard->evbase);
+	rq_shard_local = NULL;
+
+	return(NULL);
+}
+
+
+//-----------------------------------------------------------------------------
+// Initialise a group with 'shards' instances.  Each gets its own event base.
+void rq_group_init(rq_group_t *group, int shards)
+{
+	rq_shard_t *shard;
+	int i;
+
+	assert(group);
+	assert(shards > 0);
+
+	group->shards = shards;
+	group->running = 0;
+	group->shard = (rq_shard_t *) calloc(shards, sizeof(rq_shard_t));
+	assert(group->shard);
+
+	for (i=0; i<shards; i++) {
+		shard = &group->shard[i];
+		shard->group = group;
+
+		rq_init(&shard->rq);
+		shard->evbase = event_base_new();
+		assert(shard->evbase);
+		rq_setevbase(&shard->rq, shard->evbase);
+
+		shard->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		assert(shard->efd >= 0);
+		shard->ctl_event = event_new(shard->evbase, shard->efd, EV_READ | EV_PERSIST, rq_shard_handler, shard);
+		assert(shard->ctl_event);
+		event_add(shard->ctl_event, NULL);
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Add a controller to every shard.  Each shard will make its own connection.
+void rq_group_addcontroller(rq_group_t *group, char *host)
+{
+	int i;
+
+	assert(group);
+	assert(group->running == 0);
+	assert(host);
+
+	for (i=0; i<group->shards; i++) {
+		rq_addcontroller(&group->shard[i].rq, host, NULL, NULL, NULL);
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Consume a queue on every shard.  The handler will be called from all of the
+// shard threads (but only ever by one at a time for each shard), so anything
+// it shares through 'arg' needs to be thread-safe.  'max' applies to each
+// shard.
+void rq_group_consume(
+	rq_group_t *group,
+	char *queue,
+	int max,
+	int priority,
+	int exclusive,
+	void (*handler)(rq_message_t *msg, void *arg),
+	void (*accepted)(char *queue, queue_id_t qid, void *arg),
+	void (*dropped)(char *queue, queue_id_t qid, void *arg),
+	void *arg)
+{
+	int i;
+
+	assert(group);
+	assert(group->running == 0);
+
+	for (i=0; i<group->shards; i++) {
+		rq_consume(&group->shard[i].rq, queue, max, priority, exclusive, handler, accepted, dropped, arg);
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Return one of the shards, so that it can be configured (before the group is
+// started).
+rq_t * rq_group_shard(rq_group_t *group, int index)
+{
+	assert(group);
+	assert(index >= 0 && index < group->shards);
+
+	return(&group->shard[index].rq);
+}
+
+
+//-----------------------------------------------------------------------------
+// Start a thread for each shard, running its event loop.
+void rq_group_start(rq_group_t *group)
+{
+	int i;
+
+	assert(group);
+	assert(group->running == 0);
+
+	for (i=0; i<group->shards; i++) {
+		if (pthread_create(&group->shard[i].thread, NULL, rq_shard_main, &group->shard[i]) != 0) {
+			assert(0);
+		}
+	}
+	group->running = 1;
+}
+
+
+//-----------------------------------------------------------------------------
+// Return the shard that the calling thread is running, or NULL if it isn't
+// one of the threads of this group.
+rq_t * rq_group_local(rq_group_t *group)
+{
+	assert(group);
+
+	if (rq_shard_local && rq_shard_local->group == group) {
+		return(&rq_shard_local->rq);
+	}
+	return(NULL);
+}
+
+
+//-----------------------------------------------------------------------------
+// Create a new message to be sent by the shard of the calling thread.  Once
+// it is filled out, it is sent with rq_send() as normal.
+rq_message_t * rq_group_msg_new(rq_group_t *group)
+{
+	rq_t *rq;
+
+	assert(group);
+
+	rq = rq_group_local(group);
+	assert(rq);
+	return(rq_msg_new(rq, NULL));
+}
+
+
+//-----------------------------------------------------------------------------
+// Tell every shard to shut down.  This can be called from any thread.  Use
+// rq_group_wait() to wait for them to finish.
+void rq_group_shutdown(rq_group_t *group)
+{
+	uint64_t one = 1;
+	int i;
+
+	assert(group);
+	assert(group->running);
+
+	for (i=0; i<group->shards; i++) {
+		if (write(group->shard[i].efd, &one, sizeof(one)) != sizeof(one)) {
+			assert(errno == EAGAIN);
+		}
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Wait for the threads of all the shards to exit.
+void rq_group_wait(rq_group_t *group)
+{
+	int i;
+
+	assert(group);
+	assert(group->running);
+
+	for (i=0; i<group->shards; i++) {
+		pthread_join(group->shard[i].thread, NULL);
+	}
+	group->running = 0;
+}
+
+
+//-----------------------------------------------------------------------------
+// Free all the resources of the group.  The shard threads must have exited.
+void rq_group_cleanup(rq_group_t *group)
+{
+	rq_shard_t *shard;
+	int i;
+
+	assert(group);
+	assert(group->running == 0);
+
+	for (i=0; i<group->shards; i++) {
+		shard = &group->shard[i];
+
+		event_free(shard->ctl_event);
+		shard->ctl_event = NULL;
+		close(shard->efd);
+		shard->efd = INVALID_HANDLE;
+
+		rq_cleanup(&shard->rq);
+		rq_setevbase(&shard->rq, NULL);
+		event_base_free(shard->evbase);
+		shard->evbase = NULL;
+	}
+
+	free(group->shard);
+	group->shard = NULL;
+	group->shards = 0;
+}
@@ -3,6 +3,9 @@
 
 #include <event.h>
 #include <netdb.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdint.h>
 #include <expbuf.h>
 #include <linklist.h>
 #include <risp.h>
@@ -12,8 +15,8 @@
 // services can ensure that the correct version is installed.
 // This version number should be incremented with every change that would
 // effect logic.
-#define LIBRQ_VERSION  0x00010910
-#define LIBRQ_VERSION_NAME "v1.09.10"
+#define LIBRQ_VERSION  0x00010939
+#define LIBRQ_VERSION_NAME "v1.09.39"
 
 
 // include libevent.  If we are using 1.x version of libevent, we need to do 
@@ -59,6 +62,13 @@ typedef int evutil_socket_t;
 // buffer, so this is just a minimum starting point.
 #define RQ_DEFAULT_BUFFSIZE	1024
 
+// the read buffer will not grow bigger than this on its own, although it
+// will be sized to fit a large payload that is being received.  And after
+// enough small reads, it will shrink back to the starting size.  It is also
+// the largest that a compressed payload is allowed to uncompress to.
+#define RQ_DEFAULT_READBUF_MAX     (1024*1024)
+#define RQ_DEFAULT_READBUF_SHRINK  64
+
 // The priorities are used to determine which node to send a request to.  A
 // priority of NONE indicates taht this node should only receive broadcast
 // messages, and no actual requests.
@@ -67,13 +77,190 @@ typedef int evutil_socket_t;
 #define RQ_PRIORITY_NORMAL     20
 #define RQ_PRIORITY_HIGH       30
 
+// Number of buckets in the queue-name hash.  Must be a power of 2.  Most
+// nodes only consume a handful of queues, but some consume many, and it
+// costs very little to have a few spare buckets.
+#define RQ_QUEUE_HASH_SIZE     64
+
 
 
 typedef int queue_id_t;
 typedef int msg_id_t;
 
+struct __rq_queue_t;
+struct __rq_message_t;
+struct __rq_io_t;
+struct evdns_base;
+struct evdns_getaddrinfo_request;
+
+// Each slot of the message table either holds a message, or if it is free,
+// the id of the next free slot.  This gives us a stack of free ids without
+// needing any extra allocations.
+typedef struct {
+	struct __rq_message_t *msg;
+	msg_id_t next_free;
+} rq_msgslot_t;
+
+#define RQ_MSGSLOT_EXPIRED  -2
+
+
+// The buffer pool keeps buffers in size classes, starting at
+// RQ_BUFPOOL_MINSIZE and doubling for each class.  Buffers bigger than the
+// largest class are not pooled.  The high-water mark is the maximum number of
+// free buffers that will be kept in each class.  'bytes' is the total size of
+// the free buffers (see rq_setbudget).
+#define RQ_BUFPOOL_CLASSES      12
+#define RQ_BUFPOOL_MINSIZE      512
+#define RQ_BUFPOOL_DEFAULT_MAX  32
+
+typedef struct {
+	expbuf_t **free[RQ_BUFPOOL_CLASSES];
+	int count[RQ_BUFPOOL_CLASSES];
+	int max;
+	int bytes;
+
+	unsigned int hits;
+	unsigned int misses;
+} rq_bufpool_t;
+
+
+// Request timeouts are kept in a hashed timer wheel.  The wheel has
+// RQ_WHEEL_SLOTS slots, RQ_WHEEL_TICK milliseconds apart, and it is driven by
+// a single timer event for the whole rq_t.  Timeouts longer than one turn of
+// the wheel just stay in their slot for more than one turn.
+#define RQ_WHEEL_SLOTS  256
+#define RQ_WHEEL_TICK   50
+
+
+// Runtime statistics (see rq_stats).  The counters are only ever updated by
+// the thread running the rq_t, so they need no locking.
+//
+// The latency histogram has 8 linear buckets for each power of 2
+// microseconds, which keeps every bucket within 12.5% of the values in it.
+#define RQ_HIST_SUB      8
+#define RQ_HIST_BUCKETS  256
+
+typedef struct {
+	uint64_t count[RQ_HIST_BUCKETS];
+	uint64_t total;
+	uint64_t sum;
+	uint64_t max;
+} rq_hist_t;
+
+typedef struct {
+	uint64_t bytes_in, bytes_out;
+	uint64_t frames_in, frames_out;
+	unsigned int connects;
+	unsigned int connect_fails;
+	unsigned int drops;
+	int outbuf_peak;
+
+	// heartbeats.  rtt is the round-trip time of the last PING, and rtt_avg is
+	// smoothed over the recent ones (both in microseconds).  heartbeat_drops
+	// is how many times the connection was dropped because the controller
+	// stopped answering.
+	unsigned int rtt, rtt_avg;
+	unsigned int heartbeat_drops;
+} rq_connstats_t;
+
+typedef struct {
+	int held;
+	uint64_t requests;
+	uint64_t replies;
+	uint64_t refused;
+} rq_queuestats_t;
+
+typedef struct {
+	// totals over all the controller connections.
+	rq_connstats_t conn;
+
+	// requests we have sent.
+	uint64_t sent, replies, failed, expired;
+
+	// requests we have received (for all queues).
+	uint64_t received;
+
+	// message table and pools.
+	int msg_used, msg_max, msg_peak;
+	uint64_t msgpool_hits, msgpool_misses;
+	unsigned int bufpool_hits, bufpool_misses;
+
+	// bytes waiting to go out, on the current connection and while we dont
+	// have one.
+	int outbuf_bytes;
+	int pending_bytes;
+
+	// payload bytes held by the requests we have sent that haven't finished,
+	// and the memory kept in the message and buffer pools (see rq_setbudget).
+	int held_bytes;
+	int pool_bytes;
+} rq_stats_t;
+
+
+// an entry in the queue-id cache (rq->qid_cache).
+typedef struct __rq_qidname_t {
+	char *name;
+	queue_id_t qid;
+	struct __rq_qidname_t *next;
+} rq_qidname_t;
+
+
+// Messages are passed between the event-loop thread and the worker threads
+// (see rq_setworkers) through bounded lock-free rings.  RQ_WORKER_RING must be
+// a power of 2.
+#define RQ_WORKER_RING  4096
+
+typedef struct {
+	unsigned int seq;
+	struct __rq_message_t *msg;
+} rq_ringcell_t;
 
 typedef struct {
+	rq_ringcell_t cell[RQ_WORKER_RING];
+	unsigned int head;
+	char pad[60];
+	unsigned int tail;
+} rq_ring_t;
+
+
+// Trace points (see rq_settrace).  The message id is the one used on the
+// connection to the controller: for the requests we send it is the id of our
+// message, and for requests we consume, it is the id the controller gave it.
+#define RQ_TRACE_SEND       1		// a request is being sent (rq_send)
+#define RQ_TRACE_FLUSH      2		// data has been written to the controller
+#define RQ_TRACE_DELIVERED  3		// the controller says a request was delivered
+#define RQ_TRACE_REQUEST    4		// a consumer handler is about to be called
+#define RQ_TRACE_HANDLED    5		// the consumer handler has returned
+#define RQ_TRACE_REPLY      6		// a consumer is replying (rq_reply)
+#define RQ_TRACE_REPLIED    7		// the reply to a request we sent has arrived
+
+typedef struct __rq_trace_t {
+	int point;
+	msg_id_t id;		// -1 for RQ_TRACE_FLUSH.
+	uint32_t trace_id;	// 0 if the message isn't being traced.
+	uint64_t when;		// monotonic, in microseconds.
+	int bytes;			// payload (or for FLUSH, written) bytes.
+} rq_trace_t;
+
+
+// Progress of a drain (see rq_drain).  'inflight' is the requests we received
+// that haven't been replied to, 'outstanding' is the requests we sent that
+// are still waiting for their reply, and 'outbound' is the bytes still to be
+// written to the controller.  When 'done' is set, the drain is finished, and
+// if the deadline was reached first, 'timedout' is set and 'abandoned' is the
+// number of requests (of either kind) that were given up on.
+typedef struct __rq_drain_t {
+	int inflight;
+	int outstanding;
+	int outbound;
+	int abandoned;
+	int elapsed;		// milliseconds since the drain started.
+	char done;
+	char timedout;
+} rq_drain_t;
+
+
+typedef struct __rq_t {
 	risp_t *risp;
 	struct event_base *evbase;
 
@@ -85,13 +272,166 @@ typedef struct {
 	// Linked-list of queues that this node is consuming.
 	list_t queues;			/// rq_queue_t
 
+	// index of the queues, so that incoming requests do not need to walk the
+	// list.  The qid index is a dense array indexed by the qid the controller
+	// assigned, and the hash is used when a request is addressed by name.
+	struct __rq_queue_t **queue_index;
+	int queue_index_max;
+	struct __rq_queue_t *queue_hash[RQ_QUEUE_HASH_SIZE];
+
+	// the queue-ids the controller has told us about on the current
+	// connection, by name, so that requests can be sent with just the id.
+	// qid_gen changes whenever the cache does, so that templates know when to
+	// look again.
+	struct __rq_qidname_t *qid_cache[RQ_QUEUE_HASH_SIZE];
+	unsigned int qid_gen;
+
 	// pool of messages.
 	list_t *msg_pool;
 
-	void **msg_list;
+	// pool of buffers used for payloads and connection buffers.
+	rq_bufpool_t bufpool;
+
+	// table of messages that have an id.  msg_next is the top of the free-id
+	// stack (-1 when the table is full), and the table is doubled in size when
+	// it runs out.  msg_live is a list of the messages in the table so that we
+	// dont need to scan the whole table to find them.
+	rq_msgslot_t *msg_list;
 	int msg_max;
 	int msg_used;
 	int msg_next;
+	struct __rq_message_t *msg_live;
+
+	// When a request times out, its id cant be used again until either the
+	// late reply arrives, or the connection it was sent on is closed.  Until
+	// then its slot is marked with RQ_MSGSLOT_EXPIRED, and counted here.
+	int msg_expired;
+
+	// timer wheel for request timeouts.
+	struct __rq_message_t *wheel[RQ_WHEEL_SLOTS];
+	unsigned int wheel_tick;
+	uint64_t wheel_time;
+	int wheel_count;
+	struct event *wheel_event;
+
+	// messages that are waiting to be sent, because we are not connected to a
+	// controller.  They are sent in order when a connection is established.
+	// pending_max limits how many bytes of payload can be held.
+	struct __rq_message_t *pending_head, *pending_tail;
+	int pending_bytes;
+	int pending_max;
+
+	// when set, incoming payloads are not copied out of the read buffer.  The
+	// message data is only valid while the handler is running, unless the
+	// handler calls rq_msg_retain().
+	char zerocopy;
+
+	// sizing of the connection read buffers.  They start at readbuf_init,
+	// and double whenever a read fills them (up to readbuf_max).  After
+	// readbuf_shrink reads in a row that use less than a quarter of the
+	// buffer, it is shrunk back to the initial size.
+	int readbuf_init;
+	int readbuf_max;
+	int readbuf_shrink;
+
+	// a connect attempt that hasn't completed after connect_timeout
+	// milliseconds is treated as failed (0 to wait forever).  Connects are
+	// started to the first connect_parallel controllers at the same time, and
+	// the first to complete is kept.
+	int connect_timeout;
+	int connect_parallel;
+
+	// worker pool.  When 'workers' is set, requests are handed to the worker
+	// threads through worker_jobs (waking one with worker_sem), and come back
+	// through worker_done (waking the event loop with worker_efd).  The
+	// in-flight and backlog counts are only touched by the event-loop thread.
+	// 'shutdown' is set once rq_shutdown() has been called, and from then on
+	// the worker event is only added while the workers have something.
+	int workers;
+	pthread_t *worker_threads;
+	rq_ring_t *worker_jobs;
+	rq_ring_t *worker_done;
+	sem_t worker_sem;
+	int worker_efd;
+	struct event *worker_event;
+	int worker_wake;
+	int worker_inflight;
+	int worker_backlog;
+	char shutdown;
+
+	// when the controller tells us it is full, we stop sending requests for
+	// full_backoff milliseconds (doubling each time, until a request is
+	// accepted again).  Sends during that time wait on the pending list.
+	int full_backoff;
+	char full_paused;
+	struct event *full_event;
+
+	// socket buffer sizes (0 for the system default) and RQ_SOCKET_* options
+	// for controller connections.
+	int sock_sndbuf;
+	int sock_rcvbuf;
+	int sock_flags;
+
+	// resolver for controller hostnames, and how long (in seconds) a
+	// resolved address is used before it is resolved again.
+	struct evdns_base *dns;
+	char dns_owned;
+	int dns_ttl;
+
+	// when heartbeat_interval (milliseconds) is set, a PING is sent on the
+	// connection that often.  If heartbeat_missed intervals go by without the
+	// PONG, the connection is treated as lost.
+	int heartbeat_interval;
+	int heartbeat_missed;
+
+	// runtime statistics.  Only the counters are kept here, the rest is filled
+	// in by rq_stats().  The latency histogram is only kept if it has been
+	// turned on with rq_setlatency().
+	rq_stats_t stats;
+	rq_hist_t *latency;
+
+	// payload compression.  compress_methods are the methods we offer to the
+	// controller when we connect, and payloads of at least compress_threshold
+	// bytes are compressed on connections where one was agreed.  The zstd
+	// contexts (and the digested dictionary if we were given one) are created
+	// when compression is turned on.
+	int compress_methods;
+	int compress_threshold;
+	expbuf_t *compress_buf;
+	void *zstd_cctx, *zstd_dctx;
+	void *zstd_cdict, *zstd_ddict;
+
+	// the I/O backend used for the controller connections, and its state.
+	const struct __rq_io_t *io;
+	void *io_data;
+
+	// tracing (see rq_settrace).  If trace_sample is set, one in that many
+	// requests that are sent are given a trace id.
+	void (*trace_handler)(struct __rq_t *rq, const rq_trace_t *trace, void *arg);
+	void *trace_arg;
+	int trace_sample;
+	int trace_count;
+	uint32_t trace_seed;
+
+	// draining (see rq_drain).  The handler is called with the progress at
+	// drain_report, and the drain is given up on at drain_deadline (0 if
+	// there isn't one).
+	char draining;
+	uint64_t drain_start, drain_deadline, drain_report;
+	struct event *drain_event;
+	void (*drain_handler)(struct __rq_t *rq, const rq_drain_t *drain, void *arg);
+	void *drain_arg;
+
+	// memory budgets (see rq_setbudget), 0 for no limit.  held_bytes is the
+	// payload held by the requests we have sent until they are finished with.
+	// 'unwritable' is set while we are over the conn or send budget.
+	int budget_conn;
+	int budget_send;
+	int budget_pool;
+	int held_bytes;
+	char unwritable;
+	void (*writable_handler)(struct __rq_t *rq, int writable, void *arg);
+	void *writable_arg;
 } rq_t;
 
 
@@ -106,6 +446,9 @@ typedef struct {
 #define RQ_DATA_MASK_ID           8
 #define RQ_DATA_MASK_QUEUE        16
 #define RQ_DATA_MASK_PAYLOAD      32
+#define RQ_DATA_MASK_COMPRESSED   64
+#define RQ_DATA_MASK_RAWSIZE      128
+#define RQ_DATA_MASK_TRACEID      256
 
 
 typedef struct {
@@ -118,9 +461,52 @@ typedef struct {
 	unsigned short priority;
 	expbuf_t *payload;
 	expbuf_t *queue;
+
+	// when zero-copy is enabled, the payload is left in the read buffer and we
+	// only keep a pointer to it.  It is only valid while that buffer is being
+	// processed.
+	char *payload_ptr;
+	int payload_len;
+
+	// if the payload was compressed, the method that was used, and how big it
+	// is once it is uncompressed.
+	unsigned char compressed;
+	unsigned int rawsize;
+
+	uint32_t trace_id;
 } rq_data_t;
 
 
+// Outbound data for a connection is kept as a ring of buffer segments.  New
+// frames are appended to the last segment until it reaches RQ_OUT_SEGSIZE, so
+// many small frames are coalesced.  The whole ring is sent with a single
+// writev, and partially sent segments are tracked with an offset rather than
+// moving the remaining data to the front of the buffer.  If the queue reaches
+// RQ_OUT_FLUSH_THRESHOLD bytes, we dont wait for the event loop to flush it.
+#define RQ_OUTQ_SIZE            64
+#define RQ_OUT_SEGSIZE          16384
+#define RQ_OUT_FLUSH_THRESHOLD  (256*1024)
+
+// Payloads of at least RQ_OUT_REFSIZE bytes are not copied into a segment.
+// Instead the segment references the buffer of the message being sent until
+// it has been written.
+#define RQ_OUT_REFSIZE          4096
+
+typedef struct {
+	expbuf_t *buf;			// owned segment, from the bufpool.
+	const char *ref;		// or reference to data we dont own.
+	int reflen;
+	int offset;
+} rq_outseg_t;
+
+typedef struct {
+	rq_outseg_t seg[RQ_OUTQ_SIZE];
+	int head;
+	int count;
+	int bytes;
+} rq_outq_t;
+
+
 typedef struct {
 	evutil_socket_t handle;		// socket handle to the connected controller.
 	char active;
@@ -133,23 +519,111 @@ typedef struct {
 	risp_t *risp;
 	char *hostname;
 	
-	expbuf_t *inbuf, *outbuf, *readbuf, *sendbuf;
+	expbuf_t *readbuf, *sendbuf;
+
+	// DELIVERED and UNDELIVERED acks for the requests found while processing
+	// the read buffer.  They are collected here and added to the outbuf
+	// together once risp_process() is done, or before anything else is sent.
+	expbuf_t *ackbuf;
+	rq_outq_t outbuf;
 	rq_data_t *data;
+
+	// data is read directly into the tail of readbuf.  readpos is how much
+	// of it has already been processed.  If a partial frame is left over, it
+	// stays where it is until we run out of room at the tail, and then it is
+	// moved to the front.
+	int readpos;
+
+	// number of reads in a row that used only a small part of readbuf.
+	int read_small;
+
+	rq_connstats_t stats;
+
+	// address of the controller ('connect_error' is set if connecting to it
+	// failed straight away).  If the hostname is a name rather than an
+	// address, it is resolved (asynchronously) into 'addr', and resolved again
+	// in the background once the cached address is older than the TTL.
+	// 'dns_connect' is set when a connect is waiting for the resolve.  If the
+	// resolve fails, the connect keeps waiting for dns_backoff milliseconds
+	// (doubling each time, until it resolves again) before we move on.
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	int connect_error;
+	char *dnshost, *dnsport;
+	struct evdns_getaddrinfo_request *dns_req;
+	uint64_t resolved_at;
+	char resolving;
+	char dns_connect;
+	int dns_backoff;
+	struct event *dns_event;
+
+	// heartbeats.  ping_time is when the outstanding PING was sent (0 if there
+	// isn't one), and hb_missed is how many intervals it has been outstanding.
+	struct event *hb_event;
+	uint64_t ping_time;
+	int hb_missed;
+
+	// the compression method agreed with the controller for payloads on this
+	// connection (RQ_COMPRESS_NONE until the controller has answered).
+	// 'proto_error' is set if the controller sends compression details, or a
+	// compressed payload, that we cant use.  The rest of what was read is
+	// ignored, and the connection is closed.
+	int compress;
+	char proto_error;
+
+	// state kept by the I/O backend for the connection.  'in_input' is set
+	// while received data is being processed, so that anything sent while
+	// handling it can go out together once it is done.  The libevent backend
+	// keeps its events for the life of the connection, and 'write_armed' is
+	// set while the write event is added.
+	void *io_data;
+	char in_input;
+	char write_armed;
 	
 } rq_conn_t;
 
 
+// I/O backend.  Once a connection is established, the backend is 'attach'ed
+// to it, and from then on it is responsible for reading from the socket into
+// the read buffer, and for sending the outbuf whenever 'armwrite' is called.
+// 'flush' (optional) is called once the data that was read has been
+// processed.  'unsent' (optional) returns the bytes the backend has taken
+// from the outbuf but not written yet.  It is 'detach'ed before the socket is
+// closed.  'shutdown' (optional) is called by rq_shutdown(), and the backend
+// should then remove any events of its own that would keep the event loop
+// running once its connections are gone.  The libevent backend (read and
+// write events) is the default.
+typedef struct __rq_io_t {
+	const char *name;
+	int  (*init)(rq_t *rq);
+	void (*attach)(rq_conn_t *conn);
+	void (*detach)(rq_conn_t *conn);
+	void (*armwrite)(rq_conn_t *conn);
+	void (*flush)(rq_conn_t *conn);
+	int  (*unsent)(rq_conn_t *conn);
+	void (*shutdown)(rq_t *rq);
+	void (*cleanup)(rq_t *rq);
+} rq_io_t;
+
+#define RQ_IO_LIBEVENT  0
+#define RQ_IO_URING     1
+
+
 typedef struct __rq_message_t {
 	msg_id_t    id;
 	msg_id_t    src_id;
 	char        broadcast;
 	char        noreply;
+	char        borrowed;	// data points into the read buffer (see rq_msg_retain)
 	expbuf_t   *data;
+	expbuf_t    view;
 	const char *queue;
 	rq_t       *rq;
 	rq_conn_t  *conn;
 	enum {
 		rq_msgstate_new,
+		rq_msgstate_pending,
+		rq_msgstate_sent,
 		rq_msgstate_delivering,
 		rq_msgstate_delivered,
 		rq_msgstate_replied
@@ -157,9 +631,42 @@ typedef struct __rq_message_t {
 	void (*reply_handler)(struct __rq_message_t *msg);
 	void (*fail_handler)(struct __rq_message_t *msg);
 	void *arg;
+
+	// list of live messages in rq->msg_list.
+	struct __rq_message_t *live_prev, *live_next;
+
+	// list of messages waiting for a connection (rq->pending_head).
+	struct __rq_message_t *pending_next;
+
+	// timeout of the request in milliseconds (0 for none).  For requests we
+	// receive, this is the timeout the controller gave us.
+	int timeout;
+	char expired;
+	char timer_set;
+	unsigned int expires;
+	struct __rq_message_t *wheel_prev, *wheel_next;
+
+	// for requests we receive, the queue that is handling it.  When the
+	// handler is running in a worker, the reply is kept here until it can be
+	// sent by the event-loop thread.
+	struct __rq_queue_t *consumer;
+	expbuf_t *reply;
+
+	// when the request was sent (only if latency is being measured).
+	uint64_t sent_time;
+
+	// the send template the message was created from (see rq_template_new).
+	struct __rq_template_t *tmpl;
+
+	// if the request is being traced, the id that is sent along with it (and
+	// with its reply), so it can be followed across hops.  0 if not traced.
+	uint32_t trace_id;
+
+	// for requests we send, the payload bytes counted in rq->held_bytes.
+	int held_bytes;
 } rq_message_t;
 
-typedef struct {
+typedef struct __rq_queue_t {
 	char *queue;
 	queue_id_t qid;
 	char exclusive;
@@ -171,17 +678,100 @@ typedef struct {
 	void (*dropped)(char *queue, queue_id_t qid, void *arg);
 	
 	void *arg;
+
+	// next queue in the same hash bucket of rq->queue_hash.
+	struct __rq_queue_t *hash_next;
+
+	// in worker mode, the number of requests being handled by workers, and the
+	// requests waiting for one because 'max' were already being handled (linked
+	// through pending_next).
+	int inflight;
+	rq_message_t *backlog_head, *backlog_tail;
+
+	// number of requests for this queue that we have received but not yet
+	// finished with (or replied to).  When this reaches 'max', any more that
+	// the controller gives us are returned as UNDELIVERED (and counted as
+	// refused).
+	int held;
+	rq_queuestats_t stats;
+
+	// set once the queue has been cancelled (see rq_cancel).  Requests that
+	// still arrive for it are returned as UNDELIVERED.
+	char cancelled;
 } rq_queue_t;
 
 
+// A send template holds the queue and flags that a lot of requests will be
+// sent with, already encoded, so that each send only needs to add the id and
+// payload.  Messages using a template must be finished with before the
+// template is freed.
+typedef struct __rq_template_t {
+	rq_t *rq;
+	char *queue;
+	char noreply;
+	char broadcast;
+	int timeout;
+	expbuf_t *prefix;
+
+	// the queue-id the prefix was encoded with (0 if by name), and the
+	// rq->qid_gen it was looked up at.
+	queue_id_t qid;
+	unsigned int qid_gen;
+} rq_template_t;
+
+
+// A group of rq_t instances, each with its own thread, event base and
+// connection to the controllers.  Every shard consumes the same queues, so
+// the controller spreads the requests across them.  See rq_group_init().
+struct __rq_group_t;
+typedef struct {
+	rq_t rq;
+	struct event_base *evbase;
+	pthread_t thread;
+	int efd;
+	struct event *ctl_event;
+	struct __rq_group_t *group;
+} rq_shard_t;
+
+typedef struct __rq_group_t {
+	int shards;
+	rq_shard_t *shard;
+	int running;
+} rq_group_t;
+
+
 void rq_set_maxconns(int maxconns);
 int  rq_new_socket(struct addrinfo *ai);
 void rq_daemon(const char *username, const char *pidfile, const int noclose);
 
 void rq_init(rq_t *rq);
 void rq_shutdown(rq_t *rq);
+void rq_drain(rq_t *rq, int timeout, void (*handler)(rq_t *rq, const rq_drain_t *drain, void *arg), void *arg);
 void rq_cleanup(rq_t *rq);
 void rq_setevbase(rq_t *rq, struct event_base *base);
+void rq_setzerocopy(rq_t *rq, int enabled);
+void rq_setbufpool(rq_t *rq, int max);
+void rq_setpendinglimit(rq_t *rq, int bytes);
+void rq_setreadbuf(rq_t *rq, int initial, int max, int shrink);
+void rq_setconnect(rq_t *rq, int timeout, int parallel);
+void rq_setworkers(rq_t *rq, int workers);
+void rq_setheartbeat(rq_t *rq, int interval, int missed);
+void rq_setdns(rq_t *rq, struct evdns_base *dns, int ttl);
+void rq_setsocket(rq_t *rq, int sndbuf, int rcvbuf, int flags);
+int  rq_setio(rq_t *rq, int backend);
+void rq_settrace(rq_t *rq, void (*handler)(rq_t *rq, const rq_trace_t *trace, void *arg), void *arg, int sample);
+int  rq_setcompression(rq_t *rq, int methods, int threshold);
+void rq_setcompressdict(rq_t *rq, char *dict, int length);
+void rq_setbudget(rq_t *rq, int conn_bytes, int send_bytes, int pool_bytes);
+void rq_setwritable(rq_t *rq, void (*handler)(rq_t *rq, int writable, void *arg), void *arg);
+void rq_bufpool_stats(rq_t *rq, unsigned int *hits, unsigned int *misses);
+void rq_stats(rq_t *rq, rq_stats_t *stats);
+int  rq_stats_controller(rq_t *rq, int index, const char **host, rq_connstats_t *stats);
+int  rq_queue_stats(rq_t *rq, char *queue, rq_queuestats_t *stats);
+queue_id_t rq_queue_lookup(rq_t *rq, const char *queue);
+void rq_setlatency(rq_t *rq, int enabled);
+int  rq_latency(rq_t *rq, rq_hist_t *hist);
+uint64_t rq_hist_percentile(const rq_hist_t *hist, double percentile);
 
 // add a controller to the list, and it should attempt to connect to one of
 // them.   Callback functions can be provided so that actions can be performed
@@ -206,11 +796,24 @@ void rq_consume(
 	void *arg);
 
 
+int  rq_cancel(rq_t *rq, char *queue);
+
 rq_message_t * rq_msg_new(rq_t *rq, rq_conn_t *conn);
 void rq_msg_clear(rq_message_t *msg);
 void rq_msg_setqueue(rq_message_t *msg, const char *queue);
 void rq_msg_setbroadcast(rq_message_t *msg);
 void rq_msg_setnoreply(rq_message_t *msg);
+void rq_msg_retain(rq_message_t *msg);
+void rq_msg_settimeout(rq_message_t *msg, int msecs);
+void rq_msg_settraceid(rq_message_t *msg, uint32_t trace_id);
+uint32_t rq_msg_traceid(rq_message_t *msg);
+
+rq_template_t * rq_template_new(rq_t *rq, const char *queue);
+void rq_template_setnoreply(rq_template_t *tmpl);
+void rq_template_setbroadcast(rq_template_t *tmpl);
+void rq_template_settimeout(rq_template_t *tmpl, int msecs);
+void rq_template_free(rq_template_t *tmpl);
+void rq_msg_settemplate(rq_message_t *msg, rq_template_t *tmpl);
 
 
 // macros to add RISP commands to the message buffer.   This is better than
@@ -237,15 +840,101 @@ void rq_send(
 	void (*fail_handler)(rq_message_t *msg),
 	void *arg);
 
+// the same as rq_send(), but returns EAGAIN instead if we are over the send
+// budget (see rq_setbudget).
+int  rq_trysend(
+	rq_message_t *msg,
+	void (*reply_handler)(rq_message_t *reply),
+	void (*fail_handler)(rq_message_t *msg),
+	void *arg);
+
+// send a batch of requests with the same handlers.  rq_msg_new_batch() can
+// be used to create them.
+void rq_msg_new_batch(rq_t *rq, rq_message_t **msgs, int count);
+void rq_send_batch(
+	rq_message_t **msgs,
+	int count,
+	void (*reply_handler)(rq_message_t *reply),
+	void (*fail_handler)(rq_message_t *msg),
+	void *arg);
+
 void rq_resend(rq_message_t *msg);
 void rq_reply(rq_message_t *msg, int length, char *data);
 
 
+// sharded mode.  Controllers and queues are given to the group before it is
+// started, and are applied to every shard.
+void rq_group_init(rq_group_t *group, int shards);
+void rq_group_addcontroller(rq_group_t *group, char *host);
+void rq_group_consume(
+	rq_group_t *group,
+	char *queue,
+	int max,
+	int priority,
+	int exclusive,
+	void (*handler)(rq_message_t *msg, void *arg),
+	void (*accepted)(char *queue, queue_id_t qid, void *arg),
+	void (*dropped)(char *queue, queue_id_t qid, void *arg),
+	void *arg);
+rq_t * rq_group_shard(rq_group_t *group, int index);
+void rq_group_start(rq_group_t *group);
+rq_t * rq_group_local(rq_group_t *group);
+rq_message_t * rq_group_msg_new(rq_group_t *group);
+void rq_group_shutdown(rq_group_t *group);
+void rq_group_wait(rq_group_t *group);
+void rq_group_cleanup(rq_group_t *group);
+
+
 // This value is the number of elements we pre-create for the message list.
 // When the system is running, it should always assume that there is at least
-// something in the list.   The list will grow as the need arises, so this
-// number doesn't really matter much, except to maybe tune it a little better.
+// something in the list.   The list will double in size as the need arises, so
+// this number doesn't really matter much, except to maybe tune it a little
+// better.
 #define DEFAULT_MSG_ARRAY 10
 
+// The maximum number of payload bytes that will be held for sending while
+// there is no connection to a controller.  Messages sent beyond this will
+// fail.
+#define RQ_DEFAULT_PENDING_MAX  (16*1024*1024)
+
+// Default time to wait for a connect to a controller to complete.
+#define RQ_DEFAULT_CONNECT_TIMEOUT  5000
+
+// Socket options for controller connections (see rq_setsocket).
+#define RQ_SOCKET_NODELAY   1
+#define RQ_SOCKET_QUICKACK  2
+
+// Payload compression methods.  They are bits, so that a set of them can be
+// offered to the controller.  A method is only available if librq was built
+// with it (see the Makefile).
+#define RQ_COMPRESS_NONE    0
+#define RQ_COMPRESS_LZ4     1
+#define RQ_COMPRESS_ZSTD    2
+
+// Payloads smaller than this are not worth compressing.
+#define RQ_DEFAULT_COMPRESS_THRESHOLD  1024
+
+// Default number of seconds a resolved controller address is used for.
+#define RQ_DEFAULT_DNS_TTL  300
+
+// Range of the delay (in milliseconds) after a controller address could not
+// be resolved, before we try again.
+#define RQ_DNS_BACKOFF_MIN  100
+#define RQ_DNS_BACKOFF_MAX  10000
+
+// Default number of heartbeat intervals without a PONG before the connection
+// is considered dead.
+#define RQ_DEFAULT_HEARTBEAT_MISSED  3
+
+// Range of the backoff (in milliseconds) after the controller reports that
+// it is full.
+#define RQ_FULL_BACKOFF_MIN  10
+#define RQ_FULL_BACKOFF_MAX  1000
+
+// How often (in milliseconds) the progress of a drain is reported, and how
+// often we look again when all that is left is data waiting to be written.
+#define RQ_DRAIN_INTERVAL        100
+#define RQ_DRAIN_FLUSH_INTERVAL  2
+
 
 #endif
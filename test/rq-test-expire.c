@@ -0,0 +1,338 @@
+// rq-test-expire
+// Requests with large payloads that expire before they have been written.
+//
+// A fake controller accepts the connection over a unix socket, but doesnt
+// read anything from it until every request in the first batch has timed out.
+// The socket buffers are kept small, so the frames of those requests are still
+// waiting in the outbound queue when they expire, and their data is released.
+// A second batch is then sent, so that the released memory gets re-used,
+// before the controller starts reading.
+//
+// Every payload carries its sequence number and a pattern made from it, and
+// the test fails if any payload that arrives at the controller doesnt match
+// (or if they dont all arrive).  The buffer pool is turned off so that
+// released buffers go straight back to malloc.
+
+#include <rq.h>
+#include <rq-proto.h>
+
+#include <arpa/inet.h>
+#include <assert.h>
+#include <errno.h>
+#include <event.h>
+#include <rispbuf.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+
+// the payloads need to be big enough to be referenced rather than copied into
+// the outbound queue (RQ_OUT_REFSIZE), but small enough that malloc doesnt
+// map them separately.
+#define TEST_COUNT      16
+#define TEST_SIZE       16384
+#define TEST_TIMEOUT    100
+#define TEST_SOCKBUF    4096
+#define TEST_LIMIT      5
+
+#define TEST_QUEUE      "rq-test-expire"
+
+
+typedef struct {
+	struct event_base *evbase;
+	rq_t rq;
+
+	char path[108];
+	evutil_socket_t listener;
+	struct event *accept_event;
+	struct event *timeout_event;
+
+	// the controller side of the connection.
+	evutil_socket_t handle;
+	struct event *read_event;
+	expbuf_t *in;
+	expbuf_t *payload;
+	risp_t *risp;
+
+	int expired;
+	int received;
+	int mismatched;
+	char seen[TEST_COUNT * 2];
+	int finished;
+} test_t;
+
+
+static void test_fill(char *data, uint32_t seq)
+{
+	uint32_t nseq = htonl(seq);
+	int i;
+
+	memcpy(data, &nseq, sizeof(nseq));
+	for (i=sizeof(nseq); i<TEST_SIZE; i++) { data[i] = (char) ((seq * 13) + i); }
+}
+
+static int test_check(const char *data, int length)
+{
+	uint32_t seq;
+	int i;
+
+	if (length != TEST_SIZE) { return(-1); }
+	memcpy(&seq, data, sizeof(seq));
+	seq = ntohl(seq);
+	if (seq >= TEST_COUNT * 2) { return(-1); }
+	for (i=sizeof(seq); i<TEST_SIZE; i++) {
+		if (data[i] != (char) ((seq * 13) + i)) { return(-1); }
+	}
+	return(seq);
+}
+
+
+//-----------------------------------------------------------------------------
+// The fake controller.
+
+static void test_finish(test_t *test)
+{
+	assert(test);
+	if (test->finished == 0) {
+		test->finished = 1;
+		rq_shutdown(&test->rq);
+		event_del(test->accept_event);
+		event_del(test->timeout_event);
+	}
+}
+
+static void test_close(test_t *test)
+{
+	assert(test);
+	assert(test->handle >= 0);
+	event_free(test->read_event);
+	test->read_event = NULL;
+	close(test->handle);
+	test->handle = -1;
+	test_finish(test);
+}
+
+static void test_read_handler(int fd, short int flags, void *arg)
+{
+	test_t *test = arg;
+	int res;
+
+	assert(test);
+	expbuf_shrink(test->in, TEST_SIZE * 2);
+	res = read(fd, BUF_DATA(test->in) + BUF_LENGTH(test->in), BUF_MAX(test->in) - BUF_LENGTH(test->in));
+	if (res > 0) {
+		BUF_LENGTH(test->in) += res;
+		res = risp_process(test->risp, test, BUF_LENGTH(test->in), (unsigned char *) BUF_DATA(test->in));
+		assert(res >= 0);
+		if (res > 0) { expbuf_purge(test->in, res); }
+	}
+	else if (res == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+		test_close(test);
+	}
+}
+
+static void test_accept_handler(int fd, short int flags, void *arg)
+{
+	test_t *test = arg;
+	evutil_socket_t handle;
+
+	handle = accept(fd, NULL, NULL);
+	if (handle >= 0) {
+		// we only expect the one connection.
+		assert(test->handle < 0);
+		evutil_make_socket_nonblocking(handle);
+		test->handle = handle;
+		test->read_event = event_new(test->evbase, handle, EV_READ | EV_PERSIST, test_read_handler, test);
+	}
+}
+
+static void test_timeout_handler(int fd, short int flags, void *arg)
+{
+	test_t *test = arg;
+
+	assert(test);
+	fprintf(stderr, "rq-test-expire: timed out (%d expired, %d received).\n", test->expired, test->received);
+	test_finish(test);
+	event_base_loopexit(test->evbase, NULL);
+}
+
+
+static void cmdClear(void *ptr)
+{
+	test_t *test = ptr;
+	expbuf_clear(test->payload);
+}
+
+static void cmdNothing(void *ptr)
+{
+}
+
+static void cmdInt(void *ptr, risp_int_t value)
+{
+}
+
+static void cmdStr(void *ptr, risp_length_t length, risp_data_t *data)
+{
+}
+
+static void cmdPayload(void *ptr, risp_length_t length, risp_data_t *data)
+{
+	test_t *test = ptr;
+	expbuf_set(test->payload, data, length);
+}
+
+static void cmdRequest(void *ptr)
+{
+	test_t *test = ptr;
+	int seq;
+
+	seq = test_check(BUF_DATA(test->payload), BUF_LENGTH(test->payload));
+	if (seq < 0 || test->seen[seq] != 0) {
+		test->mismatched ++;
+	}
+	else {
+		test->seen[seq] = 1;
+	}
+
+	test->received ++;
+	if (test->received == TEST_COUNT * 2) { test_finish(test); }
+}
+
+static void cmdClosing(void *ptr)
+{
+	test_t *test = ptr;
+	if (test->handle >= 0) { test_close(test); }
+}
+
+
+//-----------------------------------------------------------------------------
+// The producer.
+
+static void test_fail(rq_message_t *msg);
+
+static void test_send(test_t *test, int first, int timeout)
+{
+	rq_message_t *msg;
+	char data[TEST_SIZE];
+	int i;
+
+	for (i=first; i<first+TEST_COUNT; i++) {
+		msg = rq_msg_new(&test->rq, NULL);
+		assert(msg);
+		rq_msg_setqueue(msg, TEST_QUEUE);
+		test_fill(data, i);
+		rq_msg_setdata(msg, TEST_SIZE, data);
+		if (timeout > 0) {
+			rq_msg_settimeout(msg, timeout);
+			rq_send(msg, NULL, test_fail, test);
+		}
+		else {
+			rq_msg_setnoreply(msg);
+			rq_send(msg, NULL, NULL, NULL);
+		}
+	}
+}
+
+static void test_fail(rq_message_t *msg)
+{
+	test_t *test = msg->arg;
+
+	assert(test);
+	assert(msg->expired);
+	test->expired ++;
+
+	// all of the first batch has expired, so send some more to re-use the
+	// memory, and let the controller start reading.
+	if (test->expired == TEST_COUNT) {
+		test_send(test, TEST_COUNT, 0);
+		assert(test->read_event);
+		event_add(test->read_event, NULL);
+	}
+}
+
+
+int main(int argc, char **argv)
+{
+	test_t test;
+	struct sockaddr_un sun;
+	struct timeval tv;
+	char controller[128];
+	int i;
+
+	memset(&test, 0, sizeof(test));
+	test.handle = -1;
+	test.in = expbuf_init(NULL, TEST_SIZE * 2);
+	test.payload = expbuf_init(NULL, 0);
+
+	test.risp = risp_init(NULL);
+	risp_add_command(test.risp, RQ_CMD_CLEAR,     &cmdClear);
+	risp_add_command(test.risp, RQ_CMD_PING,      &cmdNothing);
+	risp_add_command(test.risp, RQ_CMD_CLOSING,   &cmdClosing);
+	risp_add_command(test.risp, RQ_CMD_REQUEST,   &cmdRequest);
+	risp_add_command(test.risp, RQ_CMD_NOREPLY,   &cmdNothing);
+	risp_add_command(test.risp, RQ_CMD_ID,        &cmdInt);
+	risp_add_command(test.risp, RQ_CMD_QUEUEID,   &cmdInt);
+	risp_add_command(test.risp, RQ_CMD_TIMEOUT,   &cmdInt);
+	risp_add_command(test.risp, RQ_CMD_QUEUE,     &cmdStr);
+	risp_add_command(test.risp, RQ_CMD_PAYLOAD,   &cmdPayload);
+
+	test.evbase = event_base_new();
+	assert(test.evbase);
+
+	snprintf(test.path, sizeof(test.path), "/tmp/rq-test-expire.%d", (int) getpid());
+	unlink(test.path);
+	test.listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	assert(test.listener >= 0);
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, test.path);
+	if (bind(test.listener, (struct sockaddr *) &sun, sizeof(sun)) != 0 || listen(test.listener, 4) != 0) {
+		perror("rq-test-expire: unable to listen for the controller");
+		return(1);
+	}
+	evutil_make_socket_nonblocking(test.listener);
+	test.accept_event = event_new(test.evbase, test.listener, EV_READ | EV_PERSIST, test_accept_handler, &test);
+	event_add(test.accept_event, NULL);
+
+	tv.tv_sec = TEST_LIMIT;
+	tv.tv_usec = 0;
+	test.timeout_event = evtimer_new(test.evbase, test_timeout_handler, &test);
+	evtimer_add(test.timeout_event, &tv);
+
+	rq_init(&test.rq);
+	rq_setevbase(&test.rq, test.evbase);
+	rq_setbufpool(&test.rq, 0);
+	rq_setsocket(&test.rq, TEST_SOCKBUF, TEST_SOCKBUF, 0);
+	snprintf(controller, sizeof(controller), "unix:%s", test.path);
+	rq_addcontroller(&test.rq, controller, NULL, NULL, NULL);
+
+	test_send(&test, 0, TEST_TIMEOUT);
+
+	event_base_loop(test.evbase, 0);
+
+	if (test.handle >= 0) { test_close(&test); }
+	event_free(test.timeout_event);
+	event_free(test.accept_event);
+	close(test.listener);
+	unlink(test.path);
+	rq_cleanup(&test.rq);
+	event_base_free(test.evbase);
+	test.risp = risp_shutdown(test.risp);
+	expbuf_free(test.in);
+	expbuf_free(test.payload);
+
+	for (i=0; i<TEST_COUNT * 2; i++) {
+		if (test.seen[i] == 0) { test.mismatched ++; }
+	}
+
+	if (test.expired != TEST_COUNT || test.mismatched > 0) {
+		fprintf(stderr, "rq-test-expire: FAILED (%d expired, %d received, %d bad or missing).\n", test.expired, test.received, test.mismatched);
+		return(1);
+	}
+	printf("rq-test-expire: ok\n");
+	return(0);
+}